@@ -0,0 +1,224 @@
+#pragma once
+#include "SpinMutex.h"
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace utils {
+// Payload of one record, pointing into the buffer.
+struct LogSpan {
+  const uint8_t *data;
+  size_t size;
+};
+
+// Multi-writer, single-consumer append buffer. Writers reserve a byte range
+// of the active segment with one fetch_add, fill it in place and set the
+// record's commit flag. The writer whose range crosses the end of a segment
+// links in the next one; only that step and the segment free list take a
+// SpinMutex. The consumer reads committed records in order, in place.
+class AppendBuffer {
+public:
+  static constexpr uint32_t HEADER_SIZE = 8;
+
+  explicit AppendBuffer(uint32_t segmentSize = 1 << 20)
+      : _segmentSize(segmentSize) {
+    _head = _active = new_segment(0);
+  }
+
+  AppendBuffer(const AppendBuffer &) = delete;
+  AppendBuffer &operator=(const AppendBuffer &) = delete;
+
+  ~AppendBuffer() {
+    Segment *s = _head;
+    while (s != nullptr) {
+      Segment *next = s->_next.load(std::memory_order_relaxed);
+      delete s;
+      s = next;
+    }
+    for (Segment *f : _free)
+      delete f;
+  }
+
+  // Largest payload one record can carry: a record never spans segments.
+  inline uint32_t max_record() const noexcept {
+    return _segmentSize - HEADER_SIZE;
+  }
+
+  // Reserves len bytes and returns where to write them, or nullptr if len is
+  // above max_record(). The record becomes visible to the consumer only after
+  // commit().
+  uint8_t *reserve(uint32_t len) {
+    if (len > max_record())
+      return nullptr;
+    uint64_t size = record_size(len);
+    ExponentialBackoff backoff;
+    while (true) {
+      Segment *seg = _active.load(std::memory_order_acquire);
+      // Acquire pairs with the tail reset in roll_over(), after which the
+      // consumer's memset of a recycled segment is visible.
+      uint64_t off = seg->_tail.fetch_add(size, std::memory_order_acquire);
+      if (off + size <= _segmentSize) {
+        Header *h = reinterpret_cast<Header *>(seg->data() + off);
+        h->_length = len;
+        return reinterpret_cast<uint8_t *>(h + 1);
+      }
+
+      if (off <= _segmentSize)
+        roll_over(seg, off);
+      else
+        backoff.pause();
+    }
+  }
+
+  inline void commit(uint8_t *payload) noexcept {
+    Header *h = reinterpret_cast<Header *>(payload) - 1;
+    h->_state.store(COMMITTED, std::memory_order_release);
+  }
+
+  // Returns false, appending nothing, if len is above max_record().
+  inline bool append(const void *data, uint32_t len) {
+    uint8_t *p = reserve(len);
+    if (p == nullptr)
+      return false;
+    std::memcpy(p, data, len);
+    commit(p);
+    return true;
+  }
+
+  // Consumer only. Fills out with up to max committed records following the
+  // previous consume(), stopping at the first uncommitted one. The spans
+  // stay valid until the next consume().
+  size_t peek(LogSpan *out, size_t max) {
+    Segment *seg = _head;
+    uint64_t off = _readOff;
+    size_t n = 0;
+    while (n < max) {
+      if (off == seg->_limit.load(std::memory_order_acquire)) {
+        seg = seg->_next.load(std::memory_order_acquire);
+        off = 0;
+        continue;
+      }
+
+      Header *h = reinterpret_cast<Header *>(seg->data() + off);
+      if (h->_state.load(std::memory_order_acquire) != COMMITTED)
+        break;
+
+      out[n++] = {reinterpret_cast<const uint8_t *>(h + 1), h->_length};
+      off += record_size(h->_length);
+    }
+
+    _peekSeg = seg;
+    _peekOff = off;
+    return n;
+  }
+
+  // Consumer only. Releases the records returned by the last peek().
+  void consume() {
+    while (_head != _peekSeg) {
+      Segment *done = _head;
+      _head = done->_next.load(std::memory_order_relaxed);
+      recycle(done);
+    }
+    _readOff = _peekOff;
+  }
+
+  // Consumer only. Calls f(LogSpan) for every committed record in place and
+  // releases them afterwards. Returns the number of records.
+  template <typename F> size_t drain(F &&f, size_t batch = 64) {
+    std::vector<LogSpan> spans(batch);
+    size_t total = 0;
+    size_t n;
+    while ((n = peek(spans.data(), batch)) > 0) {
+      for (size_t i = 0; i < n; i++)
+        f(spans[i]);
+      consume();
+      total += n;
+    }
+
+    return total;
+  }
+
+protected:
+  static constexpr uint32_t COMMITTED = 1;
+  static constexpr uint64_t NO_LIMIT = UINT64_MAX;
+  // Tail of a segment that is not yet active, past any end.
+  static constexpr uint64_t CLOSED = UINT64_MAX / 2;
+
+  struct Header {
+    std::atomic<uint32_t> _state;
+    uint32_t _length;
+  };
+
+  // Writers that loaded a segment before it was retired still bump its
+  // tail; the tail stays past the end until the segment is active again, so
+  // they just retry.
+  struct Segment {
+    Segment(uint32_t size, uint64_t tail)
+        : _tail(tail), _words(new uint64_t[(size + HEADER_SIZE) / 8]()) {}
+
+    inline uint8_t *data() noexcept {
+      return reinterpret_cast<uint8_t *>(_words.get());
+    }
+
+    alignas(64) std::atomic<uint64_t> _tail;
+    alignas(64) std::atomic<uint64_t> _limit{NO_LIMIT};
+    std::atomic<Segment *> _next{nullptr};
+    std::unique_ptr<uint64_t[]> _words;
+  };
+
+  inline uint64_t record_size(uint32_t len) const noexcept {
+    return (HEADER_SIZE + (uint64_t)len + 7) & ~(uint64_t)7;
+  }
+
+  Segment *new_segment(uint64_t tail) {
+    assert(_segmentSize % 8 == 0);
+    return new Segment(_segmentSize, tail);
+  }
+
+  // Called by the one writer whose reservation crossed the segment end. The
+  // tail of next stays past the end until next is linked and active: reset
+  // earlier, a stale writer could fill a recycled next and roll it over
+  // before it is published, linking a segment behind it and then having
+  // _active moved back to it. A new next therefore starts CLOSED as well.
+  void roll_over(Segment *seg, uint64_t off) {
+    Segment *next = nullptr;
+    {
+      std::lock_guard<SpinMutex> guard(_freeMutex);
+      if (!_free.empty()) {
+        next = _free.back();
+        _free.pop_back();
+      }
+    }
+    if (next == nullptr)
+      next = new_segment(CLOSED);
+
+    next->_limit.store(NO_LIMIT, std::memory_order_relaxed);
+    next->_next.store(nullptr, std::memory_order_relaxed);
+    seg->_next.store(next, std::memory_order_release);
+    _active.store(next, std::memory_order_release);
+    seg->_limit.store(off, std::memory_order_release);
+    next->_tail.store(0, std::memory_order_release);
+  }
+
+  void recycle(Segment *seg) {
+    std::memset(seg->data(), 0,
+                (size_t)seg->_limit.load(std::memory_order_relaxed));
+    std::lock_guard<SpinMutex> guard(_freeMutex);
+    _free.push_back(seg);
+  }
+
+  const uint32_t _segmentSize;
+  alignas(64) std::atomic<Segment *> _active;
+  SpinMutex _freeMutex;
+  std::vector<Segment *> _free;
+
+  alignas(64) Segment *_head;
+  uint64_t _readOff = 0;
+  Segment *_peekSeg = nullptr;
+  uint64_t _peekOff = 0;
+};
+} // namespace utils
@@ -0,0 +1,100 @@
+#pragma once
+#include "SpinMutex.h"
+#include <cassert>
+#include <chrono>
+#include <cstdint>
+#include <thread>
+#include <type_traits>
+#include <utility>
+
+namespace utils {
+template <typename Mutex, typename = void>
+struct HasWaitersMethod : std::false_type {};
+
+template <typename Mutex>
+struct HasWaitersMethod<
+    Mutex, std::void_t<decltype(std::declval<const Mutex &>().has_waiters())>>
+    : std::true_type {};
+
+// Holds a lock across a batch of operations instead of locking per item.
+// step() is called after every item and gives the lock up for a moment after
+// maxOps items, after maxHold, or as soon as the mutex reports a waiter
+// (when it has has_waiters(); only ParkWait locks report them reliably),
+// then takes it again. has_waiters() of a ParkWait lock can report a waiter
+// that has already left, so a batch may be cut short once after it took the
+// lock through the parking path; the relock clears that.
+template <typename Mutex> class BatchLockGuard {
+public:
+  static constexpr uint32_t CLOCK_STRIDE = 16;
+
+  explicit BatchLockGuard(
+      Mutex &mutex, uint32_t maxOps = 64,
+      std::chrono::nanoseconds maxHold = std::chrono::microseconds(20))
+      : _mutex(mutex), _maxOps(maxOps), _maxHold(maxHold) {
+    acquire();
+  }
+
+  BatchLockGuard(const BatchLockGuard &) = delete;
+  BatchLockGuard &operator=(const BatchLockGuard &) = delete;
+
+  ~BatchLockGuard() {
+    if (_owns)
+      _mutex.unlock();
+  }
+
+  inline void step() {
+    assert(_owns);
+    _ops++;
+    if (_ops >= _maxOps || has_waiters() ||
+        (_ops % CLOCK_STRIDE == 0 &&
+         std::chrono::steady_clock::now() - _since >= _maxHold))
+      relock();
+  }
+
+  // Releases the lock and lets other threads in before taking it again.
+  // Always yields: waiters of a spinning mutex leave no trace and may be
+  // sitting in sched_yield themselves, so a short pause would just take the
+  // lock back before any of them runs.
+  inline void relock() {
+    _mutex.unlock();
+    _owns = false;
+    _releases++;
+    std::this_thread::yield();
+    acquire();
+  }
+
+  inline void unlock() {
+    _mutex.unlock();
+    _owns = false;
+  }
+
+  inline void lock() { acquire(); }
+
+  inline bool owns_lock() const { return _owns; }
+
+  inline uint64_t release_count() const { return _releases; }
+
+protected:
+  inline void acquire() {
+    _mutex.lock();
+    _owns = true;
+    _ops = 0;
+    _since = std::chrono::steady_clock::now();
+  }
+
+  inline bool has_waiters() const {
+    if constexpr (HasWaitersMethod<Mutex>::value)
+      return _mutex.has_waiters();
+    else
+      return false;
+  }
+
+  Mutex &_mutex;
+  const uint32_t _maxOps;
+  const std::chrono::nanoseconds _maxHold;
+  std::chrono::steady_clock::time_point _since;
+  uint32_t _ops = 0;
+  uint64_t _releases = 0;
+  bool _owns = false;
+};
+} // namespace utils
@@ -0,0 +1,264 @@
+#pragma once
+#include "SpinMutex.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(__linux__)
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace utils {
+// Where one CPU sits. core is the lowest CPU of its SMT siblings and l3 the
+// lowest CPU sharing its last level cache, so equal values mean shared.
+struct CpuInfo {
+  int32_t core = -1;
+  int32_t package = -1;
+  int32_t l3 = -1;
+  int32_t node = -1;
+};
+
+// CPU topology parsed once from /sys/devices/system/cpu. Without sysfs
+// (other systems, containers hiding it) every CPU is its own core on one
+// package, cache and node.
+class CpuTopology {
+public:
+  static const CpuTopology &get() {
+    static const CpuTopology topology;
+    return topology;
+  }
+
+  // CPU the caller runs on right now, or 0 when unknown. Served from the
+  // vDSO (or rseq) by glibc, no system call.
+  static inline uint32_t current_cpu() noexcept {
+#if defined(__linux__)
+    int cpu = sched_getcpu();
+    return cpu < 0 ? 0 : (uint32_t)cpu;
+#else
+    return 0;
+#endif
+  }
+
+  inline uint32_t cpu_count() const noexcept { return (uint32_t)_cpus.size(); }
+
+  inline const CpuInfo &info(uint32_t cpu) const noexcept {
+    static const CpuInfo unknown;
+    return cpu < _cpus.size() ? _cpus[cpu] : unknown;
+  }
+
+  inline bool same_core(uint32_t a, uint32_t b) const noexcept {
+    return info(a).core >= 0 && info(a).core == info(b).core;
+  }
+
+  inline bool same_l3(uint32_t a, uint32_t b) const noexcept {
+    return info(a).l3 >= 0 && info(a).l3 == info(b).l3;
+  }
+
+  inline bool same_node(uint32_t a, uint32_t b) const noexcept {
+    return info(a).node >= 0 && info(a).node == info(b).node;
+  }
+
+  // Whether cpu shares its core with another online CPU.
+  inline bool has_smt_sibling(uint32_t cpu) const noexcept {
+    return cpu < _smt.size() && _smt[cpu];
+  }
+
+  // The other SMT threads of cpu's core.
+  std::vector<uint32_t> siblings(uint32_t cpu) const {
+    return select([&](uint32_t c) { return c != cpu && same_core(c, cpu); });
+  }
+
+  std::vector<uint32_t> l3_domain(uint32_t cpu) const {
+    return select([&](uint32_t c) { return same_l3(c, cpu); });
+  }
+
+  std::vector<uint32_t> node_cpus(int32_t node) const {
+    return select([&](uint32_t c) { return info(c).node == node; });
+  }
+
+  // Affinity helpers, false on failure or outside Linux.
+  static bool pin_current_thread(uint32_t cpu) {
+    return pin_current_thread(std::vector<uint32_t>{cpu});
+  }
+
+  static bool pin_current_thread(const std::vector<uint32_t> &cpus) {
+#if defined(__linux__)
+    return pin(pthread_self(), cpus);
+#else
+    (void)cpus;
+    return false;
+#endif
+  }
+
+  static bool pin_thread(std::thread &thread,
+                         const std::vector<uint32_t> &cpus) {
+#if defined(__linux__)
+    return pin(thread.native_handle(), cpus);
+#else
+    (void)thread;
+    (void)cpus;
+    return false;
+#endif
+  }
+
+protected:
+  CpuTopology() {
+    uint32_t n = std::max(1u, std::thread::hardware_concurrency());
+#if defined(__linux__)
+    std::vector<uint32_t> present;
+    parse_list(read_file("/sys/devices/system/cpu/present"), present);
+    if (!present.empty())
+      n = std::max(n, present.back() + 1);
+#endif
+    _cpus.resize(n);
+    for (uint32_t c = 0; c < n; c++) {
+      CpuInfo &ci = _cpus[c];
+      ci.core = (int32_t)c;
+      ci.package = 0;
+      ci.l3 = 0;
+      ci.node = 0;
+#if defined(__linux__)
+      load_cpu(c, ci);
+#endif
+    }
+
+    _smt.resize(n);
+    for (uint32_t c = 0; c < n; c++) {
+      for (uint32_t o = 0; o < n && !_smt[c]; o++)
+        _smt[c] = o != c && same_core(o, c);
+    }
+  }
+
+  template <typename F> std::vector<uint32_t> select(F &&f) const {
+    std::vector<uint32_t> out;
+    for (uint32_t c = 0; c < cpu_count(); c++) {
+      if (f(c))
+        out.push_back(c);
+    }
+
+    return out;
+  }
+
+#if defined(__linux__)
+  static std::string read_file(const std::string &path) {
+    std::string s;
+    FILE *f = std::fopen(path.c_str(), "r");
+    if (f == nullptr)
+      return s;
+
+    // To EOF: a cpu list on a large machine is longer than any fixed buffer.
+    char buf[256];
+    size_t len;
+    while ((len = std::fread(buf, 1, sizeof(buf), f)) > 0)
+      s.append(buf, len);
+    std::fclose(f);
+    return s;
+  }
+
+  // Parses "0-3,8,10-11".
+  static void parse_list(const std::string &s, std::vector<uint32_t> &out) {
+    const char *p = s.c_str();
+    while (*p >= '0' && *p <= '9') {
+      char *end;
+      uint32_t lo = (uint32_t)std::strtoul(p, &end, 10);
+      uint32_t hi = lo;
+      if (*end == '-')
+        hi = (uint32_t)std::strtoul(end + 1, &end, 10);
+      for (uint32_t c = lo; c <= hi; c++)
+        out.push_back(c);
+      p = *end == ',' ? end + 1 : end;
+    }
+  }
+
+  static int32_t first_of_list(const std::string &s) {
+    std::vector<uint32_t> cpus;
+    parse_list(s, cpus);
+    return cpus.empty() ? -1 : (int32_t)cpus.front();
+  }
+
+  static void load_cpu(uint32_t c, CpuInfo &ci) {
+    std::string base = "/sys/devices/system/cpu/cpu" + std::to_string(c);
+    int32_t core =
+        first_of_list(read_file(base + "/topology/thread_siblings_list"));
+    if (core >= 0)
+      ci.core = core;
+
+    std::string pkg = read_file(base + "/topology/physical_package_id");
+    if (!pkg.empty())
+      ci.package = std::atoi(pkg.c_str());
+
+    int32_t bestLevel = -1;
+    for (uint32_t i = 0;; i++) {
+      std::string idx = base + "/cache/index" + std::to_string(i);
+      std::string level = read_file(idx + "/level");
+      if (level.empty())
+        break;
+      int32_t l = std::atoi(level.c_str());
+      int32_t first = first_of_list(read_file(idx + "/shared_cpu_list"));
+      if (l > bestLevel && first >= 0) {
+        bestLevel = l;
+        ci.l3 = first;
+      }
+    }
+
+    if (DIR *dir = opendir(base.c_str())) {
+      while (dirent *e = readdir(dir)) {
+        if (std::strncmp(e->d_name, "node", 4) == 0 && e->d_name[4] >= '0' &&
+            e->d_name[4] <= '9') {
+          ci.node = std::atoi(e->d_name + 4);
+          break;
+        }
+      }
+      closedir(dir);
+    }
+  }
+
+  static bool pin(pthread_t thread, const std::vector<uint32_t> &cpus) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (uint32_t c : cpus) {
+      if (c < CPU_SETSIZE)
+        CPU_SET(c, &set);
+    }
+    return pthread_setaffinity_np(thread, sizeof(set), &set) == 0;
+  }
+#endif
+
+  std::vector<CpuInfo> _cpus;
+  std::vector<bool> _smt;
+};
+
+// ExponentialBackoff that gives up spinning sooner when the waiter's own CPU
+// has an online SMT sibling, whose pipeline the spinning would share with
+// whatever runs there. It only looks at the waiter: a Backoff policy is not
+// told where the lock owner runs, so this is no owner-aware backoff.
+struct SmtBackoff {
+  static constexpr uint32_t MAX_PAUSES = 64;
+  static constexpr uint32_t SMT_MAX_PAUSES = 8;
+
+  inline void pause() noexcept {
+    if (_max == 0)
+      _max = CpuTopology::get().has_smt_sibling(CpuTopology::current_cpu())
+                 ? SMT_MAX_PAUSES
+                 : MAX_PAUSES;
+
+    if (_pauses <= _max) {
+      for (uint32_t i = 0; i < _pauses; i++)
+        cpu_relax();
+      _pauses <<= 1;
+    } else {
+      std::this_thread::yield();
+    }
+  }
+
+  uint32_t _pauses = 1;
+  uint32_t _max = 0;
+};
+} // namespace utils
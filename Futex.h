@@ -0,0 +1,76 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <cstdint>
+#include <thread>
+
+#if defined(__linux__)
+#include <ctime>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace utils {
+static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t),
+              "futex word must be a plain 32 bits integer");
+
+// Block while word == expected. May return spuriously, callers must recheck.
+inline void futex_wait(std::atomic<uint32_t> &word, uint32_t expected) noexcept {
+#if defined(__linux__)
+  syscall(SYS_futex, reinterpret_cast<uint32_t *>(&word), FUTEX_WAIT_PRIVATE,
+          expected, nullptr, nullptr, 0);
+#else
+  if (word.load(std::memory_order_relaxed) == expected)
+    std::this_thread::yield();
+#endif
+}
+
+// Timed variant of futex_wait, the timeout is relative.
+inline void futex_wait_for(std::atomic<uint32_t> &word, uint32_t expected,
+                           std::chrono::nanoseconds rel) noexcept {
+  if (rel.count() <= 0)
+    return;
+#if defined(__linux__)
+  struct timespec ts;
+  ts.tv_sec = (time_t)(rel.count() / 1000000000);
+  ts.tv_nsec = (long)(rel.count() % 1000000000);
+  syscall(SYS_futex, reinterpret_cast<uint32_t *>(&word), FUTEX_WAIT_PRIVATE,
+          expected, &ts, nullptr, 0);
+#else
+  (void)rel;
+  if (word.load(std::memory_order_relaxed) == expected)
+    std::this_thread::yield();
+#endif
+}
+
+inline void futex_wake(std::atomic<uint32_t> &word, int count) noexcept {
+#if defined(__linux__)
+  syscall(SYS_futex, reinterpret_cast<uint32_t *>(&word), FUTEX_WAKE_PRIVATE,
+          count, nullptr, nullptr, 0);
+#else
+  (void)word;
+  (void)count;
+#endif
+}
+
+// Wakes up to wakeCount waiters of from and moves the rest onto to, as long
+// as from still holds expected. Returns the number of woken plus requeued
+// waiters, or -1 when the value changed and nothing was done.
+inline long futex_requeue(std::atomic<uint32_t> &from, int wakeCount,
+                          std::atomic<uint32_t> &to, uint32_t expected) noexcept {
+#if defined(__linux__)
+  return syscall(SYS_futex, reinterpret_cast<uint32_t *>(&from),
+                 FUTEX_CMP_REQUEUE_PRIVATE, wakeCount,
+                 (unsigned long)INT_MAX, reinterpret_cast<uint32_t *>(&to),
+                 expected);
+#else
+  (void)from;
+  (void)wakeCount;
+  (void)to;
+  (void)expected;
+  return -1;
+#endif
+}
+} // namespace utils
@@ -0,0 +1,135 @@
+#pragma once
+#include "SpinMutex.h"
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <cstdint>
+
+namespace utils {
+// Exclusive lock with two modes. Normally waiters barge like SpinMutex. Once
+// a waiter has waited longer than the starvation threshold it sets STARVING
+// and takes a ticket; from then on new arrivals queue behind it, and
+// unlock() hands the still locked word directly to the oldest ticket until
+// the queue is empty, which returns the lock to barging mode.
+template <typename Backoff = YieldBackoff, typename Owner = TrackOwner>
+class BasicHandoffSpinMutex : protected Owner {
+public:
+  static constexpr uint32_t LOCKED = 1;
+  static constexpr uint32_t STARVING = 2;
+  static constexpr uint32_t CLOCK_ROUNDS = 64;
+
+  explicit BasicHandoffSpinMutex(
+      std::chrono::nanoseconds starvationThreshold = std::chrono::milliseconds(1))
+      : _threshold(starvationThreshold) {}
+  BasicHandoffSpinMutex(const BasicHandoffSpinMutex &) = delete;
+  BasicHandoffSpinMutex &operator=(const BasicHandoffSpinMutex &) = delete;
+
+  inline void lock() noexcept {
+    uint32_t c = 0;
+    if (!_word.compare_exchange_strong(c, LOCKED, std::memory_order_acquire,
+                                       std::memory_order_relaxed))
+      lock_slow(c);
+
+    Owner::set_owner();
+  }
+
+  inline bool try_lock() noexcept {
+    uint32_t c = 0;
+    if (_word.load(std::memory_order_relaxed) != 0 ||
+        !_word.compare_exchange_strong(c, LOCKED, std::memory_order_acquire,
+                                       std::memory_order_relaxed))
+      return false;
+
+    Owner::set_owner();
+    return true;
+  }
+
+  inline void unlock() noexcept {
+    assert(Owner::is_owner());
+    Owner::clear_owner();
+    uint64_t granted = _granted.load(std::memory_order_relaxed);
+    if (_tail.load(std::memory_order_acquire) != granted) {
+      _granted.store(granted + 1, std::memory_order_release);
+      return;
+    }
+
+    _word.store(0, std::memory_order_release);
+  }
+
+  inline bool is_locked() const {
+    return (_word.load(std::memory_order_relaxed) & LOCKED) != 0;
+  }
+
+  inline bool is_starving() const {
+    return (_word.load(std::memory_order_relaxed) & STARVING) != 0;
+  }
+
+  inline bool has_waiters() const {
+    return is_starving() || queue_length() > 0;
+  }
+
+  inline uint64_t queue_length() const {
+    return _tail.load(std::memory_order_relaxed) -
+           _granted.load(std::memory_order_relaxed);
+  }
+
+protected:
+  void lock_slow(uint32_t c) noexcept {
+    Backoff backoff;
+    auto start = std::chrono::steady_clock::now();
+    for (uint32_t i = 1; (c & STARVING) == 0; i++) {
+      backoff.pause();
+      c = _word.load(std::memory_order_relaxed);
+      if (c == 0 &&
+          _word.compare_exchange_strong(c, LOCKED, std::memory_order_acquire,
+                                        std::memory_order_relaxed))
+        return;
+
+      if (i % CLOCK_ROUNDS == 0 &&
+          std::chrono::steady_clock::now() - start > _threshold) {
+        // Only a held word may be marked: if the owner released it in the
+        // meantime, STARVING alone would leave a free word nobody can take.
+        while ((c & (LOCKED | STARVING)) == LOCKED &&
+               !_word.compare_exchange_weak(c, c | STARVING,
+                                            std::memory_order_relaxed))
+          ;
+        if ((c & LOCKED) != 0)
+          break;
+      }
+    }
+
+    lock_queued();
+  }
+
+  // Waits for a direct handoff, or takes the word itself when it is at the
+  // head of the queue and the last owner found the queue empty. A word that
+  // is not LOCKED counts as free whether or not STARVING is still set.
+  void lock_queued() noexcept {
+    uint64_t ticket = _tail.fetch_add(1, std::memory_order_acq_rel);
+    Backoff backoff;
+    while (true) {
+      uint64_t granted = _granted.load(std::memory_order_acquire);
+      if (granted > ticket)
+        return;
+
+      uint32_t c = _word.load(std::memory_order_relaxed);
+      if (granted == ticket && (c & LOCKED) == 0 &&
+          _word.compare_exchange_strong(c, LOCKED | STARVING,
+                                        std::memory_order_acquire,
+                                        std::memory_order_relaxed)) {
+        _granted.store(ticket + 1, std::memory_order_relaxed);
+        return;
+      }
+
+      backoff.pause();
+    }
+  }
+
+  alignas(64) std::atomic<uint32_t> _word{0};
+  std::atomic<uint64_t> _tail{0};
+  std::atomic<uint64_t> _granted{0};
+  const std::chrono::nanoseconds _threshold;
+};
+
+using HandoffSpinMutex = BasicHandoffSpinMutex<>;
+} // namespace utils
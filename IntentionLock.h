@@ -0,0 +1,186 @@
+#pragma once
+#include "SpinMutex.h"
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <initializer_list>
+
+namespace utils {
+enum class IntentionMode : uint8_t { IS, IX, S, SIX, X };
+
+// Multi-granularity lock node. The holders of every mode are counted in one
+// 64 bits word: IS, IX and S have 16 bits counters, SIX and X, which are not
+// compatible with themselves, one bit each. A mode is granted with a single
+// CAS when it is compatible with all the modes held:
+//        IS  IX  S   SIX X
+//   IS   y   y   y   y   n
+//   IX   y   y   n   n   n
+//   S    y   n   y   n   n
+//   SIX  y   n   n   n   n
+//   X    n   n   n   n   n
+template <typename Backoff = YieldBackoff> class BasicIntentionLock {
+public:
+  static constexpr uint64_t IS_ONE = 1ull;
+  static constexpr uint64_t IX_ONE = 1ull << 16;
+  static constexpr uint64_t S_ONE = 1ull << 32;
+  static constexpr uint64_t SIX_BIT = 1ull << 48;
+  static constexpr uint64_t X_BIT = 1ull << 49;
+  static constexpr uint64_t IS_MASK = 0xFFFFull;
+  static constexpr uint64_t IX_MASK = 0xFFFFull << 16;
+  static constexpr uint64_t S_MASK = 0xFFFFull << 32;
+
+  BasicIntentionLock() = default;
+  BasicIntentionLock(const BasicIntentionLock &) = delete;
+  BasicIntentionLock &operator=(const BasicIntentionLock &) = delete;
+
+  inline bool try_lock(IntentionMode mode) noexcept {
+    uint64_t w = _word.load(std::memory_order_relaxed);
+    while ((w & conflicts(mode)) == 0) {
+      assert(counter_room(mode, w));
+      if (_word.compare_exchange_weak(w, w + unit(mode),
+                                      std::memory_order_acquire,
+                                      std::memory_order_relaxed))
+        return true;
+    }
+
+    return false;
+  }
+
+  inline void lock(IntentionMode mode) noexcept {
+    if (try_lock(mode))
+      return;
+
+    SpinnerTicket ticket;
+    Backoff backoff;
+    do {
+      if (ticket.admitted())
+        backoff.pause();
+      else
+        std::this_thread::yield();
+    } while (!try_lock(mode));
+  }
+
+  inline void unlock(IntentionMode mode) noexcept {
+    assert((_word.load(std::memory_order_relaxed) & held_mask(mode)) != 0);
+    _word.fetch_sub(unit(mode), std::memory_order_release);
+  }
+
+  // Lockable and SharedLockable through X and S.
+  inline void lock() noexcept { lock(IntentionMode::X); }
+  inline bool try_lock() noexcept { return try_lock(IntentionMode::X); }
+  inline void unlock() noexcept { unlock(IntentionMode::X); }
+  inline void lock_shared() noexcept { lock(IntentionMode::S); }
+  inline bool try_lock_shared() noexcept { return try_lock(IntentionMode::S); }
+  inline void unlock_shared() noexcept { unlock(IntentionMode::S); }
+
+  inline uint32_t held_count(IntentionMode mode) const noexcept {
+    uint64_t w = _word.load(std::memory_order_relaxed) & held_mask(mode);
+    return (uint32_t)(w / unit(mode));
+  }
+
+  inline bool is_locked() const noexcept {
+    return _word.load(std::memory_order_relaxed) != 0;
+  }
+
+  static constexpr uint64_t unit(IntentionMode mode) noexcept {
+    switch (mode) {
+    case IntentionMode::IS:
+      return IS_ONE;
+    case IntentionMode::IX:
+      return IX_ONE;
+    case IntentionMode::S:
+      return S_ONE;
+    case IntentionMode::SIX:
+      return SIX_BIT;
+    default:
+      return X_BIT;
+    }
+  }
+
+  // Modes held by others that block mode.
+  static constexpr uint64_t conflicts(IntentionMode mode) noexcept {
+    switch (mode) {
+    case IntentionMode::IS:
+      return X_BIT;
+    case IntentionMode::IX:
+      return S_MASK | SIX_BIT | X_BIT;
+    case IntentionMode::S:
+      return IX_MASK | SIX_BIT | X_BIT;
+    case IntentionMode::SIX:
+      return IX_MASK | S_MASK | SIX_BIT | X_BIT;
+    default:
+      return IS_MASK | IX_MASK | S_MASK | SIX_BIT | X_BIT;
+    }
+  }
+
+  // Intention a parent must be held in before mode is taken on a child.
+  static constexpr IntentionMode parent_mode(IntentionMode mode) noexcept {
+    return mode == IntentionMode::IS || mode == IntentionMode::S
+               ? IntentionMode::IS
+               : IntentionMode::IX;
+  }
+
+protected:
+  static constexpr uint64_t held_mask(IntentionMode mode) noexcept {
+    switch (mode) {
+    case IntentionMode::IS:
+      return IS_MASK;
+    case IntentionMode::IX:
+      return IX_MASK;
+    case IntentionMode::S:
+      return S_MASK;
+    case IntentionMode::SIX:
+      return SIX_BIT;
+    default:
+      return X_BIT;
+    }
+  }
+
+  static inline bool counter_room(IntentionMode mode, uint64_t w) noexcept {
+    return (w & held_mask(mode)) != held_mask(mode);
+  }
+
+  std::atomic<uint64_t> _word{0};
+};
+
+using IntentionLock = BasicIntentionLock<>;
+
+// Locks a path of the hierarchy, root first: every ancestor in the intention
+// mode matching mode, the last node in mode. Released bottom-up.
+template <typename Lock = IntentionLock> class HierarchyLockGuard {
+public:
+  static constexpr uint32_t MAX_DEPTH = 8;
+
+  HierarchyLockGuard(std::initializer_list<Lock *> path, IntentionMode mode)
+      : _mode(mode) {
+    // Checked in release builds too: a longer path would overrun _nodes.
+    if (path.size() == 0 || path.size() > MAX_DEPTH) {
+      std::fputs("HierarchyLockGuard: path must hold 1 to MAX_DEPTH locks\n",
+                 stderr);
+      std::abort();
+    }
+    IntentionMode intent = Lock::parent_mode(mode);
+    for (Lock *node : path)
+      _nodes[_depth++] = node;
+
+    for (uint32_t i = 0; i < _depth; i++)
+      _nodes[i]->lock(i + 1 == _depth ? mode : intent);
+  }
+
+  HierarchyLockGuard(const HierarchyLockGuard &) = delete;
+  HierarchyLockGuard &operator=(const HierarchyLockGuard &) = delete;
+
+  ~HierarchyLockGuard() {
+    IntentionMode intent = Lock::parent_mode(_mode);
+    for (uint32_t i = _depth; i > 0; i--)
+      _nodes[i - 1]->unlock(i == _depth ? _mode : intent);
+  }
+
+protected:
+  Lock *_nodes[MAX_DEPTH];
+  uint32_t _depth = 0;
+  IntentionMode _mode;
+};
+} // namespace utils
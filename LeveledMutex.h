@@ -0,0 +1,201 @@
+#pragma once
+#include "SpinMutex.h"
+#include <cassert>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+namespace utils {
+// Levels of the mutexes the calling thread holds, through lock() /
+// lock_shared() or a LevelGuard chain, in acquisition order. Kept in debug
+// builds, and in release builds that define SPIN_MUTEX_CHECK_LEVELS=1.
+class HeldLevels {
+public:
+  static inline uint32_t top() noexcept {
+    return _levels.empty() ? 0 : _levels.back();
+  }
+
+  static inline void add(uint32_t level) { _levels.push_back(level); }
+
+  static inline void remove(uint32_t level) noexcept {
+    for (size_t i = _levels.size(); i > 0; i--) {
+      if (_levels[i - 1] == level) {
+        _levels.erase(_levels.begin() + (i - 1));
+        return;
+      }
+    }
+  }
+
+private:
+  static inline thread_local std::vector<uint32_t> _levels;
+};
+
+// Mutex with a place in the lock hierarchy: while holding level L only
+// levels above L may be taken. Taken through LevelGuard chains the rule is
+// checked at compile time and costs nothing in release builds; plain
+// lock() / unlock() calls (std::lock_guard, std::unique_lock, ...) are
+// checked against HeldLevels at run time, and a violation aborts. That check
+// is debug-only: an NDEBUG build skips it unless SPIN_MUTEX_CHECK_LEVELS=1
+// is defined, which keeps it for one thread-local vector push and pop per
+// lock. Level 0 is reserved for "nothing held".
+template <uint32_t Level, typename Mutex = SpinMutex>
+class LeveledMutex : public Mutex {
+  static_assert(Level > 0, "level 0 means no lock held");
+
+public:
+  static constexpr uint32_t LEVEL = Level;
+  using MutexType = Mutex;
+
+  inline void lock() {
+    check_and_add();
+    Mutex::lock();
+  }
+
+  inline bool try_lock() {
+    if (!Mutex::try_lock())
+      return false;
+    check_and_add();
+    return true;
+  }
+
+  inline void unlock() {
+    Mutex::unlock();
+    remove();
+  }
+
+  inline void lock_shared() {
+    check_and_add();
+    Mutex::lock_shared();
+  }
+
+  inline bool try_lock_shared() {
+    if (!Mutex::try_lock_shared())
+      return false;
+    check_and_add();
+    return true;
+  }
+
+  inline void unlock_shared() {
+    Mutex::unlock_shared();
+    remove();
+  }
+
+protected:
+#if defined(NDEBUG) && !SPIN_MUTEX_CHECK_LEVELS
+  static inline void check_and_add() noexcept {}
+  static inline void remove() noexcept {}
+#else
+  static inline void check_and_add() {
+    if (Level <= HeldLevels::top()) {
+      std::fputs("LeveledMutex: lock hierarchy violation\n", stderr);
+      std::abort();
+    }
+    HeldLevels::add(Level);
+  }
+
+  static inline void remove() noexcept { HeldLevels::remove(Level); }
+#endif
+};
+
+// Start of a guard chain: nothing held.
+struct LevelRoot {
+  static constexpr uint32_t LEVEL = 0;
+
+  template <uint32_t L, typename M>
+  [[nodiscard]] inline auto lock(LeveledMutex<L, M> &mutex) &&;
+
+  template <uint32_t L, typename M>
+  [[nodiscard]] inline auto lock_shared(LeveledMutex<L, M> &mutex) &&;
+
+  inline void unlock() noexcept {}
+};
+
+// Holds one LeveledMutex and, through Parent, everything locked before it;
+// its type records the highest level held so far, so lock() on it only
+// compiles for higher levels. lock() consumes the guard into the new one,
+// so a level can't be skipped back to by locking from an older guard:
+//   auto a = LevelRoot().lock(accounts);
+//   auto b = std::move(a).lock(journal);  // journal's level must be above
+// or in one expression, LevelRoot().lock(accounts).lock(journal). Mutexes
+// are released newest first. Where HeldLevels is kept the holds are also
+// recorded there, so plain lock() calls made inside a chain are checked too.
+// Functions can require a context by taking const LevelGuard<...> &.
+template <uint32_t Held, typename LMutex, bool Shared = false,
+          typename Parent = LevelRoot>
+class LevelGuard {
+public:
+  static constexpr uint32_t LEVEL = Held;
+
+  LevelGuard(Parent &&parent, LMutex &mutex)
+      : _parent(std::move(parent)), _mutex(&mutex) {
+    if constexpr (Shared)
+      _mutex->lock_shared();
+    else
+      _mutex->lock();
+  }
+
+  LevelGuard(LevelGuard &&other) noexcept
+      : _parent(std::move(other._parent)), _mutex(other._mutex) {
+    other._mutex = nullptr;
+  }
+
+  LevelGuard(const LevelGuard &) = delete;
+  LevelGuard &operator=(const LevelGuard &) = delete;
+  LevelGuard &operator=(LevelGuard &&) = delete;
+
+  ~LevelGuard() { release(); }
+
+  template <uint32_t L, typename M>
+  [[nodiscard]] inline LevelGuard<L, LeveledMutex<L, M>, false, LevelGuard>
+  lock(LeveledMutex<L, M> &mutex) && {
+    static_assert(L > Held, "lock hierarchy violation: a level at or below "
+                            "one already held is being locked");
+    assert(_mutex != nullptr && "guard already consumed or unlocked");
+    return {std::move(*this), mutex};
+  }
+
+  template <uint32_t L, typename M>
+  [[nodiscard]] inline LevelGuard<L, LeveledMutex<L, M>, true, LevelGuard>
+  lock_shared(LeveledMutex<L, M> &mutex) && {
+    static_assert(L > Held, "lock hierarchy violation: a level at or below "
+                            "one already held is being locked");
+    assert(_mutex != nullptr && "guard already consumed or unlocked");
+    return {std::move(*this), mutex};
+  }
+
+  // Releases this mutex and everything below it in the chain.
+  inline void unlock() noexcept {
+    release();
+    _parent.unlock();
+  }
+
+  inline bool owns_lock() const noexcept { return _mutex != nullptr; }
+
+protected:
+  inline void release() noexcept {
+    if (_mutex == nullptr)
+      return;
+    if constexpr (Shared)
+      _mutex->unlock_shared();
+    else
+      _mutex->unlock();
+    _mutex = nullptr;
+  }
+
+  Parent _parent;
+  LMutex *_mutex;
+};
+
+template <uint32_t L, typename M>
+inline auto LevelRoot::lock(LeveledMutex<L, M> &mutex) && {
+  return LevelGuard<L, LeveledMutex<L, M>>(LevelRoot(), mutex);
+}
+
+template <uint32_t L, typename M>
+inline auto LevelRoot::lock_shared(LeveledMutex<L, M> &mutex) && {
+  return LevelGuard<L, LeveledMutex<L, M>, true>(LevelRoot(), mutex);
+}
+} // namespace utils
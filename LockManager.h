@@ -0,0 +1,579 @@
+#pragma once
+#include "Futex.h"
+#include "SpinEvent.h"
+#include "SpinMutex.h"
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace utils {
+enum class KeyLockMode : uint8_t { SHARED, UPGRADE, EXCLUSIVE };
+enum class LockStatus : uint8_t { GRANTED, TIMEOUT, DEADLOCK };
+
+// Locks arbitrary hashable keys. Entries exist only while a key is held or
+// waited for; they are created on demand in a bucket array with one
+// SpinMutex per bucket and recycled through a free list afterwards.
+// SHARED is compatible with SHARED and UPGRADE, UPGRADE with SHARED only and
+// EXCLUSIVE with nothing; an UPGRADE holder may upgrade() to EXCLUSIVE.
+// Requests are granted FIFO per key. Waits can time out, and when detector
+// interval is not zero a background thread periodically searches the
+// wait-for graph for cycles and aborts the youngest Txn of each one with
+// LockStatus::DEADLOCK. The detector never touches a Txn directly: waits are
+// registered in a table owned by the manager, keyed by Txn id and stamped
+// with a wait number, and every snapshot is checked against that table under
+// the bucket mutex before anything it names is used.
+template <typename Key, typename Hash = std::hash<Key>,
+          typename KeyEqual = std::equal_to<Key>>
+class LockManager {
+protected:
+  struct Entry;
+  struct Waiter;
+
+public:
+  static constexpr uint32_t SPIN_ROUNDS = 64;
+  static constexpr uint32_t POOL_CHUNK = 256;
+
+  // One lock owner. Younger transactions have larger ids. A Txn is used by
+  // one thread at a time and must outlive its waits.
+  class Txn {
+  public:
+    explicit Txn(LockManager &manager)
+        : _id(manager._nextTxnId.fetch_add(1, std::memory_order_relaxed)) {}
+    Txn(const Txn &) = delete;
+    Txn &operator=(const Txn &) = delete;
+
+    inline uint64_t id() const { return _id; }
+
+  protected:
+    friend class LockManager;
+    const uint64_t _id;
+  };
+
+  explicit LockManager(
+      size_t buckets = 1 << 16,
+      std::chrono::milliseconds detectInterval = std::chrono::milliseconds(0))
+      : _mask(round_up(buckets) - 1), _buckets(new Bucket[_mask + 1]) {
+    if (detectInterval.count() > 0) {
+      _detector = create_thread([this, detectInterval] {
+        while (!_stop.wait_for(detectInterval))
+          detect_deadlocks();
+      });
+    }
+  }
+
+  LockManager(const LockManager &) = delete;
+  LockManager &operator=(const LockManager &) = delete;
+
+  ~LockManager() {
+    if (_detector.joinable()) {
+      _stop.set();
+      _detector.join();
+    }
+  }
+
+  LockStatus lock(Txn &txn, const Key &key, KeyLockMode mode,
+                  std::chrono::nanoseconds timeout =
+                      std::chrono::nanoseconds::max()) {
+    size_t hash = _hash(key);
+    size_t idx = hash & _mask;
+    Bucket &b = _buckets[idx];
+    Waiter w(txn, (uint8_t)mode);
+    Entry *e;
+    {
+      std::lock_guard<SpinMutex> guard(b._mutex);
+      e = find(b, hash, key);
+      if (e == nullptr)
+        e = create(b, hash, key);
+
+      if (e->_waitHead == nullptr && compatible(*e, w._mode)) {
+        grant(*e, txn, w._mode);
+        return LockStatus::GRANTED;
+      }
+
+      push_waiter(*e, w, false);
+      begin_wait(txn, w, e, idx);
+    }
+
+    return wait(txn, w, idx, timeout);
+  }
+
+  // Turns the UPGRADE lock txn holds on key into EXCLUSIVE once the SHARED
+  // holders are gone. Upgrades wait ahead of all other requests.
+  LockStatus upgrade(Txn &txn, const Key &key,
+                     std::chrono::nanoseconds timeout =
+                         std::chrono::nanoseconds::max()) {
+    size_t hash = _hash(key);
+    size_t idx = hash & _mask;
+    Bucket &b = _buckets[idx];
+    Waiter w(txn, TO_EXCLUSIVE);
+    {
+      std::lock_guard<SpinMutex> guard(b._mutex);
+      Entry *e = find(b, hash, key);
+      assert(e != nullptr && e->_upgrader == &txn);
+      if (compatible(*e, TO_EXCLUSIVE)) {
+        grant(*e, txn, TO_EXCLUSIVE);
+        return LockStatus::GRANTED;
+      }
+
+      push_waiter(*e, w, true);
+      begin_wait(txn, w, e, idx);
+    }
+
+    return wait(txn, w, idx, timeout);
+  }
+
+  void unlock(Txn &txn, const Key &key, KeyLockMode mode) {
+    size_t hash = _hash(key);
+    Bucket &b = _buckets[hash & _mask];
+    std::lock_guard<SpinMutex> guard(b._mutex);
+    Entry *e = find(b, hash, key);
+    assert(e != nullptr);
+    switch (mode) {
+    case KeyLockMode::SHARED: {
+      auto it = std::find(e->_holders.begin(), e->_holders.end(), &txn);
+      assert(it != e->_holders.end());
+      *it = e->_holders.back();
+      e->_holders.pop_back();
+      break;
+    }
+    case KeyLockMode::UPGRADE:
+      assert(e->_upgrader == &txn);
+      e->_upgrader = nullptr;
+      break;
+    case KeyLockMode::EXCLUSIVE:
+      assert(e->_exclusive == &txn);
+      e->_exclusive = nullptr;
+      break;
+    }
+
+    grant_waiters(*e);
+    release_if_idle(b, e);
+  }
+
+  // Searches the wait-for graph for cycles and aborts the youngest waiter
+  // of each. Returns the number of aborted waits.
+  size_t detect_deadlocks() {
+    std::vector<Snapshot> snaps;
+    {
+      std::lock_guard<SpinMutex> guard(_waitMutex);
+      for (auto &w : _waits)
+        snaps.push_back({w.first, w.second._seq, w.second._bucket});
+    }
+
+    std::unordered_map<uint64_t, size_t> index;
+    for (size_t i = 0; i < snaps.size(); i++)
+      index.emplace(snaps[i]._txnId, i);
+
+    std::vector<std::vector<size_t>> edges(snaps.size());
+    std::vector<uint64_t> blockers;
+    for (size_t i = 0; i < snaps.size(); i++) {
+      blockers.clear();
+      if (!blocking_txns(snaps[i], blockers))
+        continue;
+      for (uint64_t t : blockers) {
+        auto it = index.find(t);
+        if (it != index.end())
+          edges[i].push_back(it->second);
+      }
+    }
+
+    size_t aborted = 0;
+    std::vector<uint8_t> removed(snaps.size(), 0);
+    std::vector<size_t> cycle;
+    while (find_cycle(edges, removed, cycle)) {
+      size_t victim = cycle[0];
+      for (size_t v : cycle) {
+        if (snaps[v]._txnId > snaps[victim]._txnId)
+          victim = v;
+      }
+
+      removed[victim] = 1;
+      if (cycle_still_holds(snaps, cycle) && abort_wait(snaps[victim]))
+        aborted++;
+    }
+
+    return aborted;
+  }
+
+  // Number of entries currently in use, for diagnostics.
+  inline size_t entry_count() const {
+    return _entries.load(std::memory_order_relaxed);
+  }
+
+protected:
+  static constexpr uint8_t TO_EXCLUSIVE = 3;
+  static constexpr uint32_t WAITING = 0;
+  static constexpr uint32_t GRANTED = 1;
+  static constexpr uint32_t PARKED = 2;
+  static constexpr uint32_t ABORTED = 3;
+
+  struct Waiter {
+    Waiter(Txn &txn, uint8_t mode) : _txn(&txn), _mode(mode) {}
+    Txn *_txn;
+    uint8_t _mode;
+    Entry *_entry = nullptr;
+    Waiter *_prev = nullptr;
+    Waiter *_next = nullptr;
+    std::atomic<uint32_t> _state{WAITING};
+  };
+
+  struct Entry {
+    Key _key{};
+    size_t _hash = 0;
+    Entry *_next = nullptr;
+    std::vector<Txn *> _holders;
+    Txn *_upgrader = nullptr;
+    Txn *_exclusive = nullptr;
+    Waiter *_waitHead = nullptr;
+    Waiter *_waitTail = nullptr;
+  };
+
+  struct alignas(64) Bucket {
+    SpinMutex _mutex;
+    Entry *_head = nullptr;
+  };
+
+  // A registered wait. _seq is unique per wait, so a record that was
+  // replaced by a later wait of the same Txn does not match an old snapshot.
+  struct WaitRecord {
+    Waiter *_waiter;
+    size_t _bucket;
+    uint64_t _seq;
+  };
+
+  // Plain values only; see find_wait().
+  struct Snapshot {
+    uint64_t _txnId;
+    uint64_t _seq;
+    size_t _bucket;
+  };
+
+  static inline size_t round_up(size_t n) {
+    size_t r = 1;
+    while (r < n)
+      r <<= 1;
+    return r;
+  }
+
+  inline Entry *find(Bucket &b, size_t hash, const Key &key) {
+    for (Entry *e = b._head; e != nullptr; e = e->_next) {
+      if (e->_hash == hash && _equal(e->_key, key))
+        return e;
+    }
+
+    return nullptr;
+  }
+
+  Entry *create(Bucket &b, size_t hash, const Key &key) {
+    Entry *e;
+    {
+      std::lock_guard<SpinMutex> guard(_poolMutex);
+      if (_free == nullptr) {
+        std::unique_ptr<Entry[]> chunk(new Entry[POOL_CHUNK]);
+        for (uint32_t i = 0; i < POOL_CHUNK; i++) {
+          chunk[i]._next = _free;
+          _free = &chunk[i];
+        }
+        _chunks.push_back(std::move(chunk));
+      }
+
+      e = _free;
+      _free = e->_next;
+    }
+
+    e->_key = key;
+    e->_hash = hash;
+    e->_next = b._head;
+    b._head = e;
+    _entries.fetch_add(1, std::memory_order_relaxed);
+    return e;
+  }
+
+  void release_if_idle(Bucket &b, Entry *e) {
+    if (!e->_holders.empty() || e->_upgrader != nullptr ||
+        e->_exclusive != nullptr || e->_waitHead != nullptr)
+      return;
+
+    Entry **p = &b._head;
+    while (*p != e)
+      p = &(*p)->_next;
+    *p = e->_next;
+
+    e->_key = Key{};
+    std::lock_guard<SpinMutex> guard(_poolMutex);
+    e->_next = _free;
+    _free = e;
+    _entries.fetch_sub(1, std::memory_order_relaxed);
+  }
+
+  static inline bool compatible(const Entry &e, uint8_t mode) {
+    switch (mode) {
+    case (uint8_t)KeyLockMode::SHARED:
+      return e._exclusive == nullptr;
+    case (uint8_t)KeyLockMode::UPGRADE:
+      return e._exclusive == nullptr && e._upgrader == nullptr;
+    case (uint8_t)KeyLockMode::EXCLUSIVE:
+      return e._exclusive == nullptr && e._upgrader == nullptr &&
+             e._holders.empty();
+    default:
+      return e._holders.empty();
+    }
+  }
+
+  static inline void grant(Entry &e, Txn &txn, uint8_t mode) {
+    switch (mode) {
+    case (uint8_t)KeyLockMode::SHARED:
+      e._holders.push_back(&txn);
+      break;
+    case (uint8_t)KeyLockMode::UPGRADE:
+      e._upgrader = &txn;
+      break;
+    case (uint8_t)KeyLockMode::EXCLUSIVE:
+      e._exclusive = &txn;
+      break;
+    default:
+      e._upgrader = nullptr;
+      e._exclusive = &txn;
+      break;
+    }
+  }
+
+  static inline void push_waiter(Entry &e, Waiter &w, bool front) {
+    if (e._waitHead == nullptr) {
+      e._waitHead = e._waitTail = &w;
+    } else if (front) {
+      w._next = e._waitHead;
+      e._waitHead->_prev = &w;
+      e._waitHead = &w;
+    } else {
+      w._prev = e._waitTail;
+      e._waitTail->_next = &w;
+      e._waitTail = &w;
+    }
+  }
+
+  static inline void remove_waiter(Entry &e, Waiter &w) {
+    if (w._prev != nullptr)
+      w._prev->_next = w._next;
+    else
+      e._waitHead = w._next;
+    if (w._next != nullptr)
+      w._next->_prev = w._prev;
+    else
+      e._waitTail = w._prev;
+    w._prev = w._next = nullptr;
+  }
+
+  // Called with the bucket locked; _waitMutex nests inside bucket mutexes.
+  // A wait is only ended with its bucket locked, so while that bucket is
+  // locked a matching record's Waiter, Entry and Txn are all alive.
+  void begin_wait(Txn &txn, Waiter &w, Entry *e, size_t bucket) {
+    w._entry = e;
+    std::lock_guard<SpinMutex> guard(_waitMutex);
+    _waits[txn._id] = {&w, bucket, ++_waitSeq};
+  }
+
+  void end_wait(Txn &txn) {
+    std::lock_guard<SpinMutex> guard(_waitMutex);
+    _waits.erase(txn._id);
+  }
+
+  // The Waiter of the wait s was taken from, or nullptr when that wait has
+  // ended. The caller holds the bucket mutex of s.
+  Waiter *find_wait(const Snapshot &s) {
+    std::lock_guard<SpinMutex> guard(_waitMutex);
+    auto it = _waits.find(s._txnId);
+    if (it == _waits.end() || it->second._seq != s._seq)
+      return nullptr;
+    return it->second._waiter;
+  }
+
+  static inline void wake(Waiter &w, uint32_t state) {
+    if (w._state.exchange(state, std::memory_order_release) == PARKED)
+      futex_wake(w._state, 1);
+  }
+
+  // Grants from the head of the queue while the head is compatible.
+  void grant_waiters(Entry &e) {
+    while (e._waitHead != nullptr && compatible(e, e._waitHead->_mode)) {
+      Waiter &w = *e._waitHead;
+      remove_waiter(e, w);
+      grant(e, *w._txn, w._mode);
+      end_wait(*w._txn);
+      wake(w, GRANTED);
+    }
+  }
+
+  LockStatus wait(Txn &txn, Waiter &w, size_t idx,
+                  std::chrono::nanoseconds timeout) {
+    auto deadline = std::chrono::steady_clock::time_point::max();
+    if (timeout != std::chrono::nanoseconds::max())
+      deadline = std::chrono::steady_clock::now() + timeout;
+
+    ExponentialBackoff backoff;
+    uint32_t s = w._state.load(std::memory_order_acquire);
+    for (uint32_t i = 0; s == WAITING && i < SPIN_ROUNDS; i++) {
+      backoff.pause();
+      s = w._state.load(std::memory_order_acquire);
+    }
+
+    if (s == WAITING && w._state.compare_exchange_strong(
+                            s, PARKED, std::memory_order_acquire)) {
+      s = PARKED;
+      while (s == PARKED) {
+        auto now = std::chrono::steady_clock::now();
+        if (now >= deadline)
+          break;
+        if (deadline == std::chrono::steady_clock::time_point::max())
+          futex_wait(w._state, PARKED);
+        else
+          futex_wait_for(w._state, PARKED, deadline - now);
+        s = w._state.load(std::memory_order_acquire);
+      }
+    }
+
+    if (s == WAITING || s == PARKED) {
+      Bucket &b = _buckets[idx];
+      std::lock_guard<SpinMutex> guard(b._mutex);
+      s = w._state.load(std::memory_order_acquire);
+      if (s == WAITING || s == PARKED) {
+        Entry *e = w._entry;
+        remove_waiter(*e, w);
+        end_wait(txn);
+        grant_waiters(*e);
+        release_if_idle(b, e);
+        return LockStatus::TIMEOUT;
+      }
+    }
+
+    return s == GRANTED ? LockStatus::GRANTED : LockStatus::DEADLOCK;
+  }
+
+  // Holders of the awaited entry and the waiters queued ahead of the txn,
+  // or false when the snapshot is out of date.
+  bool blocking_txns(const Snapshot &s, std::vector<uint64_t> &out) {
+    std::lock_guard<SpinMutex> guard(_buckets[s._bucket]._mutex);
+    Waiter *waiter = find_wait(s);
+    if (waiter == nullptr)
+      return false;
+
+    Txn *t = waiter->_txn;
+    Entry *e = waiter->_entry;
+    for (Txn *h : e->_holders) {
+      if (h != t)
+        out.push_back(h->_id);
+    }
+    if (e->_upgrader != nullptr && e->_upgrader != t)
+      out.push_back(e->_upgrader->_id);
+    if (e->_exclusive != nullptr && e->_exclusive != t)
+      out.push_back(e->_exclusive->_id);
+    for (Waiter *w = waiter->_prev; w != nullptr; w = w->_prev) {
+      if (w->_txn != t)
+        out.push_back(w->_txn->_id);
+    }
+
+    return true;
+  }
+
+  // Iterative DFS over the nodes not yet removed; fills cycle on success.
+  static bool find_cycle(const std::vector<std::vector<size_t>> &edges,
+                         const std::vector<uint8_t> &removed,
+                         std::vector<size_t> &cycle) {
+    size_t n = edges.size();
+    std::vector<uint8_t> color(n, 0);
+    std::vector<std::pair<size_t, size_t>> stack;
+    for (size_t root = 0; root < n; root++) {
+      if (color[root] != 0 || removed[root])
+        continue;
+
+      stack.push_back({root, 0});
+      color[root] = 1;
+      while (!stack.empty()) {
+        size_t v = stack.back().first;
+        size_t &next = stack.back().second;
+        if (next == edges[v].size()) {
+          color[v] = 2;
+          stack.pop_back();
+          continue;
+        }
+
+        size_t u = edges[v][next++];
+        if (removed[u] || color[u] == 2)
+          continue;
+        if (color[u] == 1) {
+          cycle.clear();
+          size_t i = stack.size();
+          while (stack[i - 1].first != u)
+            i--;
+          for (; i <= stack.size(); i++)
+            cycle.push_back(stack[i - 1].first);
+          return true;
+        }
+
+        color[u] = 1;
+        stack.push_back({u, 0});
+      }
+    }
+
+    return false;
+  }
+
+  // Rechecks every edge of the cycle, the snapshot is not taken atomically.
+  bool cycle_still_holds(const std::vector<Snapshot> &snaps,
+                         const std::vector<size_t> &cycle) {
+    std::vector<uint64_t> blockers;
+    for (size_t i = 0; i < cycle.size(); i++) {
+      blockers.clear();
+      const Snapshot &from = snaps[cycle[i]];
+      uint64_t to = snaps[cycle[(i + 1) % cycle.size()]]._txnId;
+      if (!blocking_txns(from, blockers) ||
+          std::find(blockers.begin(), blockers.end(), to) == blockers.end())
+        return false;
+    }
+
+    return true;
+  }
+
+  bool abort_wait(const Snapshot &s) {
+    Bucket &b = _buckets[s._bucket];
+    std::lock_guard<SpinMutex> guard(b._mutex);
+    Waiter *waiter = find_wait(s);
+    if (waiter == nullptr)
+      return false;
+
+    Waiter &w = *waiter;
+    Entry *e = w._entry;
+    remove_waiter(*e, w);
+    end_wait(*w._txn);
+    wake(w, ABORTED);
+    grant_waiters(*e);
+    return true;
+  }
+
+  const size_t _mask;
+  std::unique_ptr<Bucket[]> _buckets;
+  Hash _hash;
+  KeyEqual _equal;
+  std::atomic<uint64_t> _nextTxnId{1};
+  std::atomic<size_t> _entries{0};
+
+  SpinMutex _poolMutex;
+  Entry *_free = nullptr;
+  std::vector<std::unique_ptr<Entry[]>> _chunks;
+
+  SpinMutex _waitMutex;
+  std::unordered_map<uint64_t, WaitRecord> _waits;
+  uint64_t _waitSeq = 0;
+
+  SpinEvent _stop;
+  std::thread _detector;
+};
+} // namespace utils
@@ -0,0 +1,190 @@
+#pragma once
+#include "SpinMutex.h"
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <new>
+#include <shared_mutex>
+
+// Set to 1 (SpinMutex), 2 (futex hybrid) or 3 (std::mutex) to pin the
+// backend at compile time; Mutex and SharedMutex then become plain aliases.
+#ifndef UTILS_MUTEX_PIN
+#define UTILS_MUTEX_PIN 0
+#endif
+
+namespace utils {
+using HybridSpinMutex =
+    BasicSpinMutex<ExclusiveMode, NonReentrant, YieldBackoff, ParkWait>;
+using HybridSharedSpinMutex =
+    BasicSpinMutex<SharedMode, NonReentrant, YieldBackoff, ParkWait>;
+
+// Process-wide backend of Mutex and SharedMutex. It is fixed by the first
+// Mutex constructed: select() before that, or set UTILS_MUTEX_BACKEND to
+// spin, hybrid or std. Defaults to spin.
+class MutexBackend {
+public:
+  enum Kind : uint8_t { UNSET = 0, SPIN = 1, HYBRID = 2, STD = 3 };
+
+  // Returns false when the backend was already fixed to something else.
+  static inline bool select(Kind kind) noexcept {
+    assert(kind != UNSET);
+    Kind expected = UNSET;
+    return _kind.compare_exchange_strong(expected, kind,
+                                         std::memory_order_relaxed) ||
+           expected == kind;
+  }
+
+  static inline Kind kind() noexcept {
+    Kind k = _kind.load(std::memory_order_relaxed);
+    if (k != UNSET)
+      return k;
+
+    select(from_env());
+    return _kind.load(std::memory_order_relaxed);
+  }
+
+protected:
+  static Kind from_env() noexcept {
+    const char *v = std::getenv("UTILS_MUTEX_BACKEND");
+    if (v != nullptr && std::strcmp(v, "hybrid") == 0)
+      return HYBRID;
+    if (v != nullptr && std::strcmp(v, "std") == 0)
+      return STD;
+    return SPIN;
+  }
+
+  static inline std::atomic<Kind> _kind{UNSET};
+};
+
+// Holds one of three mutexes picked at construction; every call is a switch
+// on a byte that never changes, so the branch is always predicted.
+template <typename Spin, typename Hybrid, typename Std> class DispatchMutex {
+public:
+  DispatchMutex() : _kind(MutexBackend::kind()) {
+    switch (_kind) {
+    case MutexBackend::SPIN:
+      new (_storage) Spin();
+      break;
+    case MutexBackend::HYBRID:
+      new (_storage) Hybrid();
+      break;
+    default:
+      new (_storage) Std();
+      break;
+    }
+  }
+
+  DispatchMutex(const DispatchMutex &) = delete;
+  DispatchMutex &operator=(const DispatchMutex &) = delete;
+
+  ~DispatchMutex() {
+    switch (_kind) {
+    case MutexBackend::SPIN:
+      as<Spin>().~Spin();
+      break;
+    case MutexBackend::HYBRID:
+      as<Hybrid>().~Hybrid();
+      break;
+    default:
+      as<Std>().~Std();
+      break;
+    }
+  }
+
+  inline void lock() {
+    switch (_kind) {
+    case MutexBackend::SPIN:
+      return as<Spin>().lock();
+    case MutexBackend::HYBRID:
+      return as<Hybrid>().lock();
+    default:
+      return as<Std>().lock();
+    }
+  }
+
+  inline bool try_lock() {
+    switch (_kind) {
+    case MutexBackend::SPIN:
+      return as<Spin>().try_lock();
+    case MutexBackend::HYBRID:
+      return as<Hybrid>().try_lock();
+    default:
+      return as<Std>().try_lock();
+    }
+  }
+
+  inline void unlock() {
+    switch (_kind) {
+    case MutexBackend::SPIN:
+      return as<Spin>().unlock();
+    case MutexBackend::HYBRID:
+      return as<Hybrid>().unlock();
+    default:
+      return as<Std>().unlock();
+    }
+  }
+
+  inline void lock_shared() {
+    switch (_kind) {
+    case MutexBackend::SPIN:
+      return as<Spin>().lock_shared();
+    case MutexBackend::HYBRID:
+      return as<Hybrid>().lock_shared();
+    default:
+      return as<Std>().lock_shared();
+    }
+  }
+
+  inline bool try_lock_shared() {
+    switch (_kind) {
+    case MutexBackend::SPIN:
+      return as<Spin>().try_lock_shared();
+    case MutexBackend::HYBRID:
+      return as<Hybrid>().try_lock_shared();
+    default:
+      return as<Std>().try_lock_shared();
+    }
+  }
+
+  inline void unlock_shared() {
+    switch (_kind) {
+    case MutexBackend::SPIN:
+      return as<Spin>().unlock_shared();
+    case MutexBackend::HYBRID:
+      return as<Hybrid>().unlock_shared();
+    default:
+      return as<Std>().unlock_shared();
+    }
+  }
+
+  inline MutexBackend::Kind backend() const noexcept { return _kind; }
+
+protected:
+  template <typename M> inline M &as() noexcept {
+    return *std::launder(reinterpret_cast<M *>(_storage));
+  }
+
+  alignas(Spin) alignas(Hybrid) alignas(Std) unsigned char _storage[std::max(
+      {sizeof(Spin), sizeof(Hybrid), sizeof(Std)})];
+  const MutexBackend::Kind _kind;
+};
+
+#if UTILS_MUTEX_PIN == 1
+using Mutex = SpinMutex;
+using SharedMutex = SharedSpinMutex;
+#elif UTILS_MUTEX_PIN == 2
+using Mutex = HybridSpinMutex;
+using SharedMutex = HybridSharedSpinMutex;
+#elif UTILS_MUTEX_PIN == 3
+using Mutex = std::mutex;
+using SharedMutex = std::shared_mutex;
+#else
+using Mutex = DispatchMutex<SpinMutex, HybridSpinMutex, std::mutex>;
+using SharedMutex = DispatchMutex<SharedSpinMutex, HybridSharedSpinMutex,
+                                  std::shared_mutex>;
+#endif
+} // namespace utils
@@ -0,0 +1,310 @@
+#pragma once
+#include "SpinMutex.h"
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <utility>
+
+#if defined(__linux__)
+#include <linux/membarrier.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace utils {
+// Store-load fence split between a hot and a rare side: a store before
+// either call is seen by a load after the other. light() is only a compiler
+// barrier where heavy() can make every running thread of the process run a
+// full fence (Linux membarrier); elsewhere both are std::atomic_thread_fence.
+class AsymmetricFence {
+public:
+  static inline void light() noexcept {
+    if (expedited())
+      std::atomic_signal_fence(std::memory_order_seq_cst);
+    else
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+  }
+
+  static inline void heavy() noexcept {
+#if defined(__linux__)
+    if (expedited()) {
+      syscall(SYS_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED, 0, 0);
+      return;
+    }
+#endif
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+  }
+
+private:
+  static inline bool expedited() noexcept {
+#if defined(__linux__)
+    static const bool registered =
+        syscall(SYS_membarrier, MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED, 0,
+                0) == 0;
+    return registered;
+#else
+    return false;
+#endif
+  }
+};
+
+// Object pool after Bonwick's magazine allocator. Every thread (by
+// ThreadSlot) caches up to two magazines, fixed size LIFO stacks of free
+// objects, so allocate() and deallocate() take no lock and make no atomic
+// read-modify-write; the central depot of full and empty magazines is only
+// locked when a thread swaps a whole magazine. Objects may be freed by any
+// thread, they simply join that thread's cache. trim() returns the depot's
+// memory and empties every cache itself, including those of idle and exited
+// threads.
+template <typename T, uint32_t MAGAZINE = 64> class ObjectPool {
+public:
+  ObjectPool() : _caches(new std::atomic<Cache *>[ThreadSlot::MAX_SLOTS]) {
+    for (uint32_t i = 0; i < ThreadSlot::MAX_SLOTS; i++)
+      _caches[i].store(nullptr, std::memory_order_relaxed);
+  }
+
+  ObjectPool(const ObjectPool &) = delete;
+  ObjectPool &operator=(const ObjectPool &) = delete;
+
+  ~ObjectPool() {
+    trim();
+    for (uint32_t i = 0; i < ThreadSlot::MAX_SLOTS; i++) {
+      Cache *c = _caches[i].load(std::memory_order_relaxed);
+      if (c == nullptr)
+        continue;
+      free_objects(c->_loaded);
+      free_objects(c->_previous);
+      delete c->_loaded;
+      delete c->_previous;
+      delete c;
+    }
+    free_magazines(_empty);
+  }
+
+  template <typename... Args> T *create(Args &&...args) {
+    void *p = allocate();
+    return new (p) T(std::forward<Args>(args)...);
+  }
+
+  inline void destroy(T *obj) {
+    obj->~T();
+    deallocate(obj);
+  }
+
+  // Raw storage for one T.
+  void *allocate() {
+    Cache *c = cache();
+    if (c == nullptr)
+      return new_object();
+
+    Claim claim(c);
+    return take(c);
+  }
+
+  void deallocate(void *p) {
+    Cache *c = cache();
+    if (c == nullptr) {
+      delete_object(p);
+      return;
+    }
+
+    Claim claim(c);
+    put(c, p);
+  }
+
+  // Frees the objects in the depot and in every thread's cache. Every cache
+  // is flagged first, then after one heavy fence each is emptied once its
+  // owner is outside allocate() / deallocate(); an owner inside one is
+  // waited for, which is at most one magazine swap, and an owner entering
+  // waits until its cache is done.
+  void trim() {
+    std::lock_guard<SpinMutex> trimGuard(_trimMutex);
+    for (uint32_t i = 0; i < ThreadSlot::MAX_SLOTS; i++) {
+      Cache *c = _caches[i].load(std::memory_order_acquire);
+      if (c != nullptr)
+        c->_trimming.store(true, std::memory_order_relaxed);
+    }
+    AsymmetricFence::heavy();
+    for (uint32_t i = 0; i < ThreadSlot::MAX_SLOTS; i++) {
+      // Caches created since the first pass are not flagged and left alone.
+      Cache *c = _caches[i].load(std::memory_order_acquire);
+      if (c == nullptr || !c->_trimming.load(std::memory_order_relaxed))
+        continue;
+      YieldBackoff backoff;
+      while (c->_busy.load(std::memory_order_acquire))
+        backoff.pause();
+      free_objects(c->_loaded);
+      free_objects(c->_previous);
+      c->_trimming.store(false, std::memory_order_release);
+    }
+
+    Magazine *full;
+    {
+      std::lock_guard<SpinMutex> guard(_depotMutex);
+      full = _full;
+      _full = nullptr;
+      _fullCount = 0;
+    }
+
+    while (full != nullptr) {
+      Magazine *next = full->_next;
+      free_objects(full);
+      std::lock_guard<SpinMutex> guard(_depotMutex);
+      full->_next = _empty;
+      _empty = full;
+      full = next;
+    }
+  }
+
+  // Full magazines waiting in the depot.
+  inline size_t depot_size() const {
+    std::lock_guard<SpinMutex> guard(_depotMutex);
+    return _fullCount;
+  }
+
+protected:
+  struct Magazine {
+    uint32_t _count = 0;
+    Magazine *_next = nullptr;
+    void *_items[MAGAZINE];
+  };
+
+  // Used by its owner thread while _busy and by trim() while _trimming; the
+  // two flags form a Dekker handshake whose owner side has only the light
+  // fence.
+  struct alignas(64) Cache {
+    std::atomic<bool> _busy{false};
+    std::atomic<bool> _trimming{false};
+    Magazine *_loaded = new Magazine();
+    Magazine *_previous = new Magazine();
+  };
+
+  // The owner's side of the handshake: holds the cache for one allocate() or
+  // deallocate(), backing off while a trim() empties it.
+  class Claim {
+  public:
+    explicit Claim(Cache *c) noexcept : _cache(c) {
+      while (true) {
+        c->_busy.store(true, std::memory_order_relaxed);
+        AsymmetricFence::light();
+        if (!c->_trimming.load(std::memory_order_acquire))
+          return;
+        c->_busy.store(false, std::memory_order_release);
+        YieldBackoff backoff;
+        while (c->_trimming.load(std::memory_order_acquire))
+          backoff.pause();
+      }
+    }
+
+    Claim(const Claim &) = delete;
+    Claim &operator=(const Claim &) = delete;
+
+    ~Claim() { _cache->_busy.store(false, std::memory_order_release); }
+
+  private:
+    Cache *_cache;
+  };
+
+  inline void *take(Cache *c) {
+    if (c->_loaded->_count == 0) {
+      if (c->_previous->_count > 0) {
+        std::swap(c->_loaded, c->_previous);
+      } else {
+        Magazine *full = exchange(c->_previous, true);
+        if (full == nullptr)
+          return new_object();
+        c->_previous = c->_loaded;
+        c->_loaded = full;
+      }
+    }
+
+    return c->_loaded->_items[--c->_loaded->_count];
+  }
+
+  inline void put(Cache *c, void *p) {
+    if (c->_loaded->_count == MAGAZINE) {
+      if (c->_previous->_count == 0) {
+        std::swap(c->_loaded, c->_previous);
+      } else {
+        Magazine *empty = exchange(c->_previous, false);
+        c->_previous = c->_loaded;
+        c->_loaded = empty != nullptr ? empty : new Magazine();
+      }
+    }
+
+    c->_loaded->_items[c->_loaded->_count++] = p;
+  }
+
+  static inline void *new_object() {
+    return ::operator new(sizeof(T), std::align_val_t(alignof(T)));
+  }
+
+  static inline void delete_object(void *p) noexcept {
+    ::operator delete(p, std::align_val_t(alignof(T)));
+  }
+
+  static inline void free_objects(Magazine *m) noexcept {
+    for (uint32_t i = 0; i < m->_count; i++)
+      delete_object(m->_items[i]);
+    m->_count = 0;
+  }
+
+  static inline void free_magazines(Magazine *m) noexcept {
+    while (m != nullptr) {
+      Magazine *next = m->_next;
+      delete m;
+      m = next;
+    }
+  }
+
+  inline Cache *cache() {
+    uint32_t slot = ThreadSlot::get();
+    if (slot == ThreadSlot::INVALID_SLOT)
+      return nullptr;
+
+    Cache *c = _caches[slot].load(std::memory_order_acquire);
+    if (c == nullptr) {
+      c = new Cache();
+      _caches[slot].store(c, std::memory_order_release);
+    }
+    return c;
+  }
+
+  // Hands m to the depot and takes a full (wantFull) or an empty magazine
+  // back, or nullptr when there is none.
+  Magazine *exchange(Magazine *m, bool wantFull) {
+    std::lock_guard<SpinMutex> guard(_depotMutex);
+    Magazine *&from = wantFull ? _full : _empty;
+    Magazine *got = from;
+    if (got == nullptr && wantFull)
+      return nullptr;
+    if (got != nullptr) {
+      from = got->_next;
+      got->_next = nullptr;
+      if (wantFull)
+        _fullCount--;
+    }
+
+    if (wantFull) {
+      m->_next = _empty;
+      _empty = m;
+    } else {
+      m->_next = _full;
+      _full = m;
+      _fullCount++;
+    }
+
+    return got;
+  }
+
+  std::unique_ptr<std::atomic<Cache *>[]> _caches;
+  SpinMutex _trimMutex;
+  mutable SpinMutex _depotMutex;
+  Magazine *_full = nullptr;
+  Magazine *_empty = nullptr;
+  size_t _fullCount = 0;
+};
+} // namespace utils
@@ -0,0 +1,284 @@
+#pragma once
+#include "SpinMutex.h"
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+namespace utils {
+// Contention profile of one named lock. Counters only move while
+// LockProfiler::recording() is on.
+class LockProfile {
+public:
+  static constexpr uint32_t HOLD_BUCKETS = 32;
+
+  inline void on_acquire(bool contended, bool shared) noexcept {
+    _acquired.fetch_add(1, std::memory_order_relaxed);
+    if (contended)
+      _contended.fetch_add(1, std::memory_order_relaxed);
+    if (shared)
+      _shared.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  // Hold times go into log2 buckets of nanoseconds.
+  inline void on_hold(std::chrono::nanoseconds hold) noexcept {
+    uint64_t ns = (uint64_t)hold.count();
+    uint32_t b = 0;
+    while (ns > 1 && b < HOLD_BUCKETS - 1) {
+      ns >>= 1;
+      b++;
+    }
+    _hold[b].fetch_add(1, std::memory_order_relaxed);
+  }
+
+  inline void on_waiters(uint32_t n) noexcept {
+    uint32_t m = _maxWaiters.load(std::memory_order_relaxed);
+    while (n > m && !_maxWaiters.compare_exchange_weak(
+                        m, n, std::memory_order_relaxed))
+      ;
+  }
+
+  inline LockPolicy policy() const noexcept {
+    LockPolicy p;
+    uint32_t bits = _policy.load(std::memory_order_relaxed);
+    p.spinRounds = bits >> 2;
+    p.backoff = (bits & BACKOFF) != 0;
+    p.park = (bits & PARK) != 0;
+    return p;
+  }
+
+  inline void set_policy(const LockPolicy &p) noexcept {
+    _policy.store(p.spinRounds << 2 | (p.backoff ? BACKOFF : 0) |
+                      (p.park ? PARK : 0),
+                  std::memory_order_relaxed);
+  }
+
+  // Short holds spin long, medium holds spin a little and park, long holds
+  // park right away. Spinning only parks once more threads waited than
+  // there are CPUs to spin on.
+  LockPolicy derive_policy() const noexcept {
+    LockPolicy p;
+    uint64_t acquired = _acquired.load(std::memory_order_relaxed);
+    if (acquired == 0)
+      return p;
+
+    uint64_t holds = 0;
+    for (uint32_t i = 0; i < HOLD_BUCKETS; i++)
+      holds += _hold[i].load(std::memory_order_relaxed);
+    uint32_t median = 0;
+    for (uint64_t seen = 0; median < HOLD_BUCKETS; median++) {
+      seen += _hold[median].load(std::memory_order_relaxed);
+      if (seen * 2 >= holds)
+        break;
+    }
+
+    uint64_t contended = _contended.load(std::memory_order_relaxed);
+    if (contended * 100 < acquired) {
+      p.spinRounds = 16;
+    } else if (median < 10) {
+      p.spinRounds = 256;
+      p.park = _maxWaiters.load(std::memory_order_relaxed) >=
+               std::max(1u, std::thread::hardware_concurrency());
+    } else if (median < 15) {
+      p.spinRounds = 32;
+      p.backoff = false;
+    } else {
+      p.spinRounds = 0;
+    }
+
+    return p;
+  }
+
+protected:
+  friend class LockProfiler;
+
+  static constexpr uint32_t BACKOFF = 1;
+  static constexpr uint32_t PARK = 2;
+
+  std::atomic<uint64_t> _acquired{0};
+  std::atomic<uint64_t> _contended{0};
+  std::atomic<uint64_t> _shared{0};
+  std::atomic<uint32_t> _maxWaiters{0};
+  std::atomic<uint64_t> _hold[HOLD_BUCKETS] = {};
+  std::atomic<uint32_t> _policy{ParkWait::SPIN_ROUNDS << 2 | BACKOFF | PARK};
+};
+
+// Registry of named lock profiles. A profile file holds one line per lock:
+//   name acquired contended shared maxWaiters hold0 ... hold31
+// load() adds it to the counters and derives each lock's policy from it;
+// open() loads and, unless frozen, saves the merged profile at exit.
+// Frozen policies never change for the run and the file is left alone, so
+// runs are reproducible.
+class LockProfiler {
+public:
+  static LockProfile &get(const std::string &name) {
+    assert(name.find_first_of(" \t\n") == std::string::npos);
+    std::lock_guard<SpinMutex> guard(_mutex);
+    std::unique_ptr<LockProfile> &p = profiles()[name];
+    if (!p)
+      p.reset(new LockProfile());
+    return *p;
+  }
+
+  static inline bool recording() noexcept {
+    return _recording.load(std::memory_order_relaxed);
+  }
+
+  static inline void set_recording(bool on) noexcept {
+    _recording.store(on, std::memory_order_relaxed);
+  }
+
+  static inline bool frozen() noexcept {
+    return _frozen.load(std::memory_order_relaxed);
+  }
+
+  static inline void freeze(bool on = true) noexcept {
+    _frozen.store(on, std::memory_order_relaxed);
+  }
+
+  static bool load(const std::string &path) {
+    std::ifstream in(path);
+    if (!in)
+      return false;
+
+    std::string line;
+    while (std::getline(in, line)) {
+      std::istringstream fields(line);
+      std::string name;
+      uint64_t acquired, contended, shared, hold;
+      uint32_t maxWaiters;
+      if (!(fields >> name >> acquired >> contended >> shared >> maxWaiters))
+        continue;
+
+      LockProfile &p = get(name);
+      p._acquired.fetch_add(acquired, std::memory_order_relaxed);
+      p._contended.fetch_add(contended, std::memory_order_relaxed);
+      p._shared.fetch_add(shared, std::memory_order_relaxed);
+      p.on_waiters(maxWaiters);
+      for (uint32_t i = 0; i < LockProfile::HOLD_BUCKETS && fields >> hold;
+           i++)
+        p._hold[i].fetch_add(hold, std::memory_order_relaxed);
+      p.set_policy(p.derive_policy());
+    }
+
+    return true;
+  }
+
+  static bool save(const std::string &path) {
+    std::ofstream out(path, std::ios::trunc);
+    if (!out)
+      return false;
+
+    std::lock_guard<SpinMutex> guard(_mutex);
+    for (auto &kv : profiles()) {
+      const LockProfile &p = *kv.second;
+      out << kv.first << ' ' << p._acquired.load(std::memory_order_relaxed)
+          << ' ' << p._contended.load(std::memory_order_relaxed) << ' '
+          << p._shared.load(std::memory_order_relaxed) << ' '
+          << p._maxWaiters.load(std::memory_order_relaxed);
+      for (uint32_t i = 0; i < LockProfile::HOLD_BUCKETS; i++)
+        out << ' ' << p._hold[i].load(std::memory_order_relaxed);
+      out << '\n';
+    }
+
+    return (bool)out;
+  }
+
+  // Loads path if it exists, turns recording on unless frozen and saves
+  // back to path at exit. Call once at startup.
+  static void open(const std::string &path) {
+    load(path);
+    if (frozen())
+      return;
+
+    _path = path;
+    set_recording(true);
+    // The registry must outlive the handler, so construct it first.
+    profiles();
+    std::atexit([] {
+      if (!frozen())
+        save(_path);
+    });
+  }
+
+protected:
+  static std::unordered_map<std::string, std::unique_ptr<LockProfile>> &
+  profiles() {
+    static std::unordered_map<std::string, std::unique_ptr<LockProfile>> p;
+    return p;
+  }
+
+  static inline SpinMutex _mutex;
+  static inline std::atomic<bool> _recording{false};
+  static inline std::atomic<bool> _frozen{false};
+  static inline std::string _path;
+};
+
+// Stats policy of BasicSpinMutex that feeds the profile of a named lock:
+// with recording on, acquisitions, contention, waiters and exclusive hold
+// times. With ProfiledWait the slow paths follow the profile's LockPolicy.
+class ProfileStats {
+public:
+  static constexpr bool ENABLED = true;
+
+  explicit ProfileStats(const std::string &name)
+      : _profile(LockProfiler::get(name)) {}
+
+  inline void on_acquire(bool contended) noexcept {
+    if (LockProfiler::recording()) {
+      _profile.on_acquire(contended, false);
+      _since = std::chrono::steady_clock::now();
+    }
+  }
+
+  inline void on_acquire_shared(bool contended) noexcept {
+    if (LockProfiler::recording())
+      _profile.on_acquire(contended, true);
+  }
+
+  inline void on_release() noexcept {
+    if (_since != std::chrono::steady_clock::time_point()) {
+      _profile.on_hold(std::chrono::steady_clock::now() - _since);
+      _since = std::chrono::steady_clock::time_point();
+    }
+  }
+
+  inline void on_wait_begin() noexcept {
+    uint32_t n = _waiting.fetch_add(1, std::memory_order_relaxed) + 1;
+    if (LockProfiler::recording())
+      _profile.on_waiters(n);
+  }
+
+  inline void on_wait_end() noexcept {
+    _waiting.fetch_sub(1, std::memory_order_relaxed);
+  }
+
+  inline LockPolicy wait_policy() const noexcept { return _profile.policy(); }
+
+  inline const LockProfile &profile() const noexcept { return _profile; }
+
+protected:
+  LockProfile &_profile;
+  std::atomic<uint32_t> _waiting{0};
+  std::chrono::steady_clock::time_point _since;
+};
+
+// Named futex spin mutexes whose slow paths follow the LockPolicy of their
+// profile. The fast path is the one of ParkWait.
+template <typename Mode = ExclusiveMode>
+using BasicProfiledMutex =
+    BasicSpinMutex<Mode, NonReentrant, ExponentialBackoff, ProfiledWait,
+                   ProfileStats>;
+
+using ProfiledMutex = BasicProfiledMutex<>;
+using ProfiledSharedMutex = BasicProfiledMutex<SharedMode>;
+} // namespace utils
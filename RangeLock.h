@@ -0,0 +1,295 @@
+#pragma once
+#include "Futex.h"
+#include "SpinMutex.h"
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <mutex>
+
+namespace utils {
+// Locks half-open ranges [begin, end) of one object. Requests only conflict
+// when they overlap and one of them is exclusive. All requests, granted or
+// waiting, are numbered in arrival order and kept under a SpinMutex in an
+// interval tree (a treap ordered by begin, each node caching the largest end
+// below it). A request is granted only when no earlier request conflicts with
+// it, so overlapping requests are served FIFO. Locking and unlocking only
+// visit the requests that overlap the range plus O(log n) others, so
+// disjoint requests do not slow each other down. Waiters spin on their own
+// request and then park on it with futex.
+template <typename Backoff = ExponentialBackoff> class BasicRangeLock {
+public:
+  static constexpr uint32_t SPIN_ROUNDS = 64;
+
+  // Lives with the caller for as long as the range is locked or waited for.
+  class Request {
+  public:
+    Request() = default;
+    Request(const Request &) = delete;
+    Request &operator=(const Request &) = delete;
+
+    inline bool granted() const noexcept {
+      return _state.load(std::memory_order_acquire) == GRANTED;
+    }
+
+  protected:
+    friend class BasicRangeLock;
+    uint64_t _begin = 0;
+    uint64_t _end = 0;
+    uint64_t _seq = 0;
+    uint64_t _priority = 0;
+    uint64_t _maxEnd = 0;
+    bool _shared = false;
+    Request *_left = nullptr;
+    Request *_right = nullptr;
+    std::atomic<uint32_t> _state{WAITING};
+  };
+
+  BasicRangeLock() = default;
+  BasicRangeLock(const BasicRangeLock &) = delete;
+  BasicRangeLock &operator=(const BasicRangeLock &) = delete;
+
+  inline void lock(Request &req, uint64_t begin, uint64_t end) noexcept {
+    enqueue(req, begin, end, false);
+    wait(req);
+  }
+
+  inline void lock_shared(Request &req, uint64_t begin,
+                          uint64_t end) noexcept {
+    enqueue(req, begin, end, true);
+    wait(req);
+  }
+
+  inline bool try_lock(Request &req, uint64_t begin, uint64_t end) noexcept {
+    return try_enqueue(req, begin, end, false);
+  }
+
+  inline bool try_lock_shared(Request &req, uint64_t begin,
+                              uint64_t end) noexcept {
+    return try_enqueue(req, begin, end, true);
+  }
+
+  void unlock(Request &req) noexcept {
+    assert(req.granted());
+    std::lock_guard<SpinMutex> guard(_mutex);
+    unlink(req);
+    // Only requests overlapping req can have been blocked by it.
+    visit(_root, req._begin, req._end, [&](Request &r) {
+      if (r._state.load(std::memory_order_relaxed) != GRANTED && grantable(r))
+        grant(r);
+      return true;
+    });
+  }
+
+  inline uint32_t request_count() const {
+    std::lock_guard<SpinMutex> guard(_mutex);
+    return _count;
+  }
+
+protected:
+  static constexpr uint32_t WAITING = 0;
+  static constexpr uint32_t GRANTED = 1;
+  static constexpr uint32_t PARKED = 2;
+
+  static inline bool overlaps(const Request &a, const Request &b) noexcept {
+    return a._begin < b._end && b._begin < a._end;
+  }
+
+  static inline bool conflicts(const Request &a, const Request &b) noexcept {
+    return overlaps(a, b) && !(a._shared && b._shared);
+  }
+
+  static inline void prepare(Request &req, uint64_t begin, uint64_t end,
+                             bool shared) noexcept {
+    assert(begin < end);
+    req._begin = begin;
+    req._end = end;
+    req._shared = shared;
+    req._state.store(WAITING, std::memory_order_relaxed);
+  }
+
+  // Tree order: by begin, ties broken by arrival.
+  static inline bool before(const Request &a, const Request &b) noexcept {
+    return a._begin < b._begin || (a._begin == b._begin && a._seq < b._seq);
+  }
+
+  static inline void update(Request *t) noexcept {
+    uint64_t e = t->_end;
+    if (t->_left != nullptr && t->_left->_maxEnd > e)
+      e = t->_left->_maxEnd;
+    if (t->_right != nullptr && t->_right->_maxEnd > e)
+      e = t->_right->_maxEnd;
+    t->_maxEnd = e;
+  }
+
+  // Splits t into the nodes ordered before req and the rest.
+  static void split(Request *t, const Request &req, Request *&left,
+                    Request *&right) noexcept {
+    if (t == nullptr) {
+      left = right = nullptr;
+    } else if (before(*t, req)) {
+      split(t->_right, req, t->_right, right);
+      left = t;
+      update(t);
+    } else {
+      split(t->_left, req, left, t->_left);
+      right = t;
+      update(t);
+    }
+  }
+
+  static Request *merge(Request *left, Request *right) noexcept {
+    if (left == nullptr)
+      return right;
+    if (right == nullptr)
+      return left;
+    if (left->_priority > right->_priority) {
+      left->_right = merge(left->_right, right);
+      update(left);
+      return left;
+    }
+
+    right->_left = merge(left, right->_left);
+    update(right);
+    return right;
+  }
+
+  static Request *erase(Request *t, const Request &req) noexcept {
+    assert(t != nullptr);
+    if (t == &req)
+      return merge(t->_left, t->_right);
+    if (before(req, *t))
+      t->_left = erase(t->_left, req);
+    else
+      t->_right = erase(t->_right, req);
+    update(t);
+    return t;
+  }
+
+  // Calls f on every request overlapping [begin, end) until f returns false.
+  template <typename F>
+  static bool visit(Request *t, uint64_t begin, uint64_t end, F &&f) {
+    if (t == nullptr || t->_maxEnd <= begin)
+      return true;
+    if (!visit(t->_left, begin, end, f))
+      return false;
+    if (t->_begin >= end)
+      return true;
+    if (t->_end > begin && !f(*t))
+      return false;
+    return visit(t->_right, begin, end, f);
+  }
+
+  // An earlier request, granted or still waiting, that conflicts blocks req.
+  inline bool grantable(const Request &req) const noexcept {
+    return visit(_root, req._begin, req._end, [&](const Request &r) {
+      return r._seq >= req._seq || !conflicts(r, req);
+    });
+  }
+
+  // The splitmix64 finalizer of the arrival number keeps the treap balanced
+  // whatever order the ranges come in.
+  static inline uint64_t priority(uint64_t seq) noexcept {
+    seq = (seq ^ (seq >> 30)) * 0xBF58476D1CE4E5B9ull;
+    seq = (seq ^ (seq >> 27)) * 0x94D049BB133111EBull;
+    return seq ^ (seq >> 31);
+  }
+
+  inline void link(Request &req) noexcept {
+    req._seq = _nextSeq++;
+    req._priority = priority(req._seq);
+    req._left = req._right = nullptr;
+    req._maxEnd = req._end;
+    Request *left;
+    Request *right;
+    split(_root, req, left, right);
+    _root = merge(merge(left, &req), right);
+    _count++;
+  }
+
+  inline void unlink(Request &req) noexcept {
+    _root = erase(_root, req);
+    _count--;
+  }
+
+  static inline void grant(Request &req) noexcept {
+    if (req._state.exchange(GRANTED, std::memory_order_release) == PARKED)
+      futex_wake(req._state, 1);
+  }
+
+  void enqueue(Request &req, uint64_t begin, uint64_t end,
+               bool shared) noexcept {
+    prepare(req, begin, end, shared);
+    std::lock_guard<SpinMutex> guard(_mutex);
+    link(req);
+    if (grantable(req))
+      req._state.store(GRANTED, std::memory_order_relaxed);
+  }
+
+  bool try_enqueue(Request &req, uint64_t begin, uint64_t end,
+                   bool shared) noexcept {
+    prepare(req, begin, end, shared);
+    std::lock_guard<SpinMutex> guard(_mutex);
+    link(req);
+    if (grantable(req)) {
+      req._state.store(GRANTED, std::memory_order_relaxed);
+      return true;
+    }
+
+    unlink(req);
+    return false;
+  }
+
+  void wait(Request &req) noexcept {
+    Backoff backoff;
+    for (uint32_t i = 0; i < SPIN_ROUNDS; i++) {
+      if (req._state.load(std::memory_order_acquire) == GRANTED)
+        return;
+      backoff.pause();
+    }
+
+    uint32_t s = WAITING;
+    if (!req._state.compare_exchange_strong(s, PARKED,
+                                            std::memory_order_acquire))
+      return;
+
+    while (req._state.load(std::memory_order_acquire) != GRANTED)
+      futex_wait(req._state, PARKED);
+  }
+
+  mutable SpinMutex _mutex;
+  Request *_root = nullptr;
+  uint64_t _nextSeq = 0;
+  uint32_t _count = 0;
+};
+
+using RangeLock = BasicRangeLock<>;
+
+template <typename Lock = RangeLock> class RangeLockGuard {
+public:
+  RangeLockGuard(Lock &lock, uint64_t begin, uint64_t end) : _lock(lock) {
+    _lock.lock(_req, begin, end);
+  }
+  RangeLockGuard(const RangeLockGuard &) = delete;
+  RangeLockGuard &operator=(const RangeLockGuard &) = delete;
+  ~RangeLockGuard() { _lock.unlock(_req); }
+
+protected:
+  Lock &_lock;
+  typename Lock::Request _req;
+};
+
+template <typename Lock = RangeLock> class SharedRangeLockGuard {
+public:
+  SharedRangeLockGuard(Lock &lock, uint64_t begin, uint64_t end)
+      : _lock(lock) {
+    _lock.lock_shared(_req, begin, end);
+  }
+  SharedRangeLockGuard(const SharedRangeLockGuard &) = delete;
+  SharedRangeLockGuard &operator=(const SharedRangeLockGuard &) = delete;
+  ~SharedRangeLockGuard() { _lock.unlock(_req); }
+
+protected:
+  Lock &_lock;
+  typename Lock::Request _req;
+};
+} // namespace utils
@@ -0,0 +1,192 @@
+#pragma once
+#include "Futex.h"
+#include "SpinMutex.h"
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <climits>
+#include <cstdint>
+#include <memory>
+#include <utility>
+
+namespace utils {
+struct NoCompletion {
+  inline void operator()() noexcept {}
+};
+
+// Sense-reversing central barrier. The phase word plays the role of the
+// sense: every arriver remembers it and waits for it to change, the last one
+// resets the counter, runs the completion function and advances the phase.
+// With PARK the waiters park on the phase word with futex after SPIN_ROUNDS.
+template <typename CompletionFunction = NoCompletion,
+          typename Backoff = ExponentialBackoff, bool PARK = false>
+class CentralBarrier {
+public:
+  static constexpr uint32_t SPIN_ROUNDS = 128;
+
+  explicit CentralBarrier(uint32_t participants,
+                          CompletionFunction completion = CompletionFunction())
+      : _count((int32_t)participants), _expected((int32_t)participants),
+        _completion(std::move(completion)) {}
+  CentralBarrier(const CentralBarrier &) = delete;
+  CentralBarrier &operator=(const CentralBarrier &) = delete;
+
+  inline void arrive_and_wait() noexcept {
+    uint32_t phase = _phase.load(std::memory_order_acquire);
+    if (arrive())
+      return;
+
+    Backoff backoff;
+    for (uint32_t i = 0; !PARK || i < SPIN_ROUNDS; i++) {
+      if (_phase.load(std::memory_order_acquire) != phase)
+        return;
+      backoff.pause();
+    }
+
+    if constexpr (PARK) {
+      _waiters.fetch_add(1, std::memory_order_seq_cst);
+      while (_phase.load(std::memory_order_acquire) == phase)
+        futex_wait(_phase, phase);
+      _waiters.fetch_sub(1, std::memory_order_relaxed);
+    }
+  }
+
+  // Arrives for the current phase and leaves the barrier for good.
+  inline void arrive_and_drop() noexcept {
+    _expected.fetch_sub(1, std::memory_order_relaxed);
+    arrive();
+  }
+
+  inline uint32_t phase() const noexcept {
+    return _phase.load(std::memory_order_relaxed);
+  }
+
+protected:
+  inline bool arrive() noexcept {
+    if (_count.fetch_sub(1, std::memory_order_acq_rel) != 1)
+      return false;
+
+    _count.store(_expected.load(std::memory_order_relaxed),
+                 std::memory_order_relaxed);
+    _completion();
+    _phase.fetch_add(1, std::memory_order_seq_cst);
+    if constexpr (PARK) {
+      if (_waiters.load(std::memory_order_seq_cst) > 0)
+        futex_wake(_phase, INT_MAX);
+    }
+
+    return true;
+  }
+
+  alignas(64) std::atomic<int32_t> _count;
+  std::atomic<int32_t> _expected;
+  alignas(64) std::atomic<uint32_t> _phase{0};
+  std::atomic<uint32_t> _waiters{0};
+  CompletionFunction _completion;
+};
+
+template <typename CompletionFunction = NoCompletion>
+using SpinBarrier = CentralBarrier<CompletionFunction, ExponentialBackoff, false>;
+
+template <typename CompletionFunction = NoCompletion>
+using HybridBarrier = CentralBarrier<CompletionFunction, ExponentialBackoff, true>;
+
+// Combining tree barrier: participants arrive at a leaf shared by at most
+// FANOUT of them, and only the last arriver of every node goes on to its
+// parent, so no counter sees more than FANOUT concurrent updates. The last
+// arriver at the root runs the completion function and advances the phase.
+// Every participant needs a fixed id in [0, participants).
+template <typename CompletionFunction = NoCompletion,
+          typename Backoff = ExponentialBackoff>
+class TreeBarrier {
+public:
+  static constexpr uint32_t FANOUT = 4;
+
+  explicit TreeBarrier(uint32_t participants,
+                       CompletionFunction completion = CompletionFunction())
+      : _participants(participants), _completion(std::move(completion)) {
+    assert(participants > 0);
+    uint32_t total = 0;
+    for (uint32_t n = participants; n > 1; n = (n + FANOUT - 1) / FANOUT)
+      total += (n + FANOUT - 1) / FANOUT;
+    if (total == 0)
+      total = 1;
+    _nodes.reset(new Node[total]);
+
+    uint32_t first = 0;
+    uint32_t children = participants;
+    do {
+      uint32_t width = (children + FANOUT - 1) / FANOUT;
+      for (uint32_t i = 0; i < width; i++) {
+        Node &nd = _nodes[first + i];
+        int32_t expected = (int32_t)std::min(FANOUT, children - i * FANOUT);
+        nd._expected = expected;
+        nd._count.store(expected, std::memory_order_relaxed);
+        nd._parent = width == 1 ? -1 : (int32_t)(first + width + i / FANOUT);
+      }
+      first += width;
+      children = width;
+    } while (children > 1);
+  }
+
+  TreeBarrier(const TreeBarrier &) = delete;
+  TreeBarrier &operator=(const TreeBarrier &) = delete;
+
+  inline void arrive_and_wait(uint32_t id) noexcept {
+    assert(id < _participants);
+    uint32_t phase = _phase.load(std::memory_order_acquire);
+    if (arrive(id / FANOUT, false))
+      return;
+
+    Backoff backoff;
+    while (_phase.load(std::memory_order_acquire) == phase)
+      backoff.pause();
+  }
+
+  inline void arrive_and_drop(uint32_t id) noexcept {
+    assert(id < _participants);
+    arrive(id / FANOUT, true);
+  }
+
+  inline uint32_t phase() const noexcept {
+    return _phase.load(std::memory_order_relaxed);
+  }
+
+protected:
+  struct alignas(64) Node {
+    std::atomic<int32_t> _count{0};
+    std::atomic<int32_t> _dropped{0};
+    int32_t _expected = 0;
+    int32_t _parent = -1;
+  };
+
+  // Returns true for the thread that completed the phase. A node whose
+  // children all dropped out drops itself from its parent.
+  bool arrive(uint32_t idx, bool drop) noexcept {
+    while (true) {
+      Node &nd = _nodes[idx];
+      if (drop)
+        nd._dropped.fetch_add(1, std::memory_order_relaxed);
+      if (nd._count.fetch_sub(1, std::memory_order_acq_rel) != 1)
+        return false;
+
+      nd._expected -= nd._dropped.exchange(0, std::memory_order_relaxed);
+      nd._count.store(nd._expected, std::memory_order_relaxed);
+      if (nd._parent < 0)
+        break;
+
+      drop = nd._expected == 0;
+      idx = (uint32_t)nd._parent;
+    }
+
+    _completion();
+    _phase.fetch_add(1, std::memory_order_release);
+    return true;
+  }
+
+  std::unique_ptr<Node[]> _nodes;
+  uint32_t _participants;
+  alignas(64) std::atomic<uint32_t> _phase{0};
+  CompletionFunction _completion;
+};
+} // namespace utils
@@ -0,0 +1,150 @@
+#pragma once
+#include "Futex.h"
+#include "SpinMutex.h"
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <condition_variable>
+#include <cstdint>
+#include <thread>
+#include <utility>
+
+namespace utils {
+// Condition variable for the spin mutexes. Lock is any BasicLockable guard
+// over them, e.g. std::unique_lock<SpinMutex> or
+// std::shared_lock<SharedSpinMutex>. Waiters spin on a sequence word for a
+// while before parking on it with futex.
+// notify_all() wakes one waiter and requeues the others onto a relay word.
+// Every waiter that got the mutex back wakes the next one from the relay, so
+// the mutex is handed along instead of being stormed by all of them at once.
+// notify_all() itself wakes the first relay waiter too, in case the waiter it
+// woke finished before the relay count was published.
+class SpinConditionVariable {
+public:
+  static constexpr uint32_t SPIN_ROUNDS = 64;
+
+  SpinConditionVariable() = default;
+  SpinConditionVariable(const SpinConditionVariable &) = delete;
+  SpinConditionVariable &operator=(const SpinConditionVariable &) = delete;
+
+  inline void notify_one() noexcept {
+    _seq.fetch_add(1, std::memory_order_seq_cst);
+    if (_waiters.load(std::memory_order_seq_cst) > 0)
+      futex_wake(_seq, 1);
+  }
+
+  inline void notify_all() noexcept {
+    uint32_t seq = _seq.fetch_add(1, std::memory_order_seq_cst) + 1;
+    if (_waiters.load(std::memory_order_seq_cst) == 0)
+      return;
+
+    long n = futex_requeue(_seq, 1, _relay, seq);
+    if (n < 0) {
+      futex_wake(_seq, INT_MAX);
+    } else if (n > 1) {
+      // The woken waiter may already have looked at _relayPending and found
+      // nothing, so start the relay chain once the count is published.
+      _relayPending.fetch_add((uint32_t)(n - 1), std::memory_order_seq_cst);
+      relay_next();
+    }
+  }
+
+  template <typename Lock> void wait(Lock &lock) {
+    uint32_t seq = _seq.load(std::memory_order_relaxed);
+    lock.unlock();
+    if (!spin(seq)) {
+      _waiters.fetch_add(1, std::memory_order_seq_cst);
+      while (_seq.load(std::memory_order_acquire) == seq)
+        futex_wait(_seq, seq);
+      _waiters.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    lock.lock();
+    relay_next();
+  }
+
+  template <typename Lock, typename Predicate>
+  void wait(Lock &lock, Predicate pred) {
+    while (!pred())
+      wait(lock);
+  }
+
+  template <typename Lock, typename Clock, typename Duration>
+  std::cv_status
+  wait_until(Lock &lock,
+             const std::chrono::time_point<Clock, Duration> &absTime) {
+    uint32_t seq = _seq.load(std::memory_order_relaxed);
+    lock.unlock();
+    bool woken = spin(seq);
+    if (!woken) {
+      _waiters.fetch_add(1, std::memory_order_seq_cst);
+      while (!(woken = _seq.load(std::memory_order_acquire) != seq)) {
+        auto rel = absTime - Clock::now();
+        if (rel <= rel.zero())
+          break;
+        futex_wait_for(
+            _seq, seq,
+            std::chrono::duration_cast<std::chrono::nanoseconds>(rel));
+      }
+      _waiters.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    lock.lock();
+    relay_next();
+    return woken ? std::cv_status::no_timeout : std::cv_status::timeout;
+  }
+
+  template <typename Lock, typename Clock, typename Duration,
+            typename Predicate>
+  bool wait_until(Lock &lock,
+                  const std::chrono::time_point<Clock, Duration> &absTime,
+                  Predicate pred) {
+    while (!pred()) {
+      if (wait_until(lock, absTime) == std::cv_status::timeout)
+        return pred();
+    }
+
+    return true;
+  }
+
+  template <typename Lock, typename Rep, typename Period>
+  std::cv_status wait_for(Lock &lock,
+                          const std::chrono::duration<Rep, Period> &relTime) {
+    return wait_until(lock, std::chrono::steady_clock::now() + relTime);
+  }
+
+  template <typename Lock, typename Rep, typename Period, typename Predicate>
+  bool wait_for(Lock &lock, const std::chrono::duration<Rep, Period> &relTime,
+                Predicate pred) {
+    return wait_until(lock, std::chrono::steady_clock::now() + relTime,
+                      std::move(pred));
+  }
+
+protected:
+  inline bool spin(uint32_t seq) const noexcept {
+    for (uint32_t i = 0; i < SPIN_ROUNDS; i++) {
+      if (_seq.load(std::memory_order_acquire) != seq)
+        return true;
+      std::this_thread::yield();
+    }
+
+    return false;
+  }
+
+  inline void relay_next() noexcept {
+    uint32_t pending = _relayPending.load(std::memory_order_seq_cst);
+    while (pending > 0) {
+      if (_relayPending.compare_exchange_weak(pending, pending - 1,
+                                              std::memory_order_seq_cst)) {
+        futex_wake(_relay, 1);
+        return;
+      }
+    }
+  }
+
+  std::atomic<uint32_t> _seq{0};
+  std::atomic<uint32_t> _waiters{0};
+  std::atomic<uint32_t> _relay{0};
+  std::atomic<uint32_t> _relayPending{0};
+};
+} // namespace utils
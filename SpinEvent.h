@@ -0,0 +1,98 @@
+#pragma once
+#include "Futex.h"
+#include "SpinMutex.h"
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <cstdint>
+
+namespace utils {
+// Event with set/reset/wait. A manual reset event stays set and releases
+// every waiter until reset(); an auto reset event releases exactly one
+// waiter per set() and clears itself. Waiters spin SPIN_ROUNDS times with
+// Backoff before they park on the state word with futex.
+template <typename Backoff = ExponentialBackoff> class BasicSpinEvent {
+public:
+  static constexpr uint32_t SPIN_ROUNDS = 32;
+
+  explicit BasicSpinEvent(bool autoReset = false, bool initialSet = false)
+      : _state(initialSet ? 1 : 0), _autoReset(autoReset) {}
+  BasicSpinEvent(const BasicSpinEvent &) = delete;
+  BasicSpinEvent &operator=(const BasicSpinEvent &) = delete;
+
+  inline void set() noexcept {
+    if (_state.exchange(1, std::memory_order_seq_cst) == 1)
+      return;
+
+    if (_waiters.load(std::memory_order_seq_cst) > 0)
+      futex_wake(_state, _autoReset ? 1 : INT_MAX);
+  }
+
+  inline void reset() noexcept { _state.store(0, std::memory_order_relaxed); }
+
+  inline bool is_set() const noexcept {
+    return _state.load(std::memory_order_relaxed) == 1;
+  }
+
+  inline bool try_wait() noexcept {
+    if (!_autoReset)
+      return _state.load(std::memory_order_acquire) == 1;
+
+    uint32_t s = 1;
+    return _state.compare_exchange_strong(s, 0, std::memory_order_acquire,
+                                          std::memory_order_relaxed);
+  }
+
+  inline void wait() noexcept {
+    if (try_wait() || spin())
+      return;
+
+    _waiters.fetch_add(1, std::memory_order_seq_cst);
+    while (!try_wait())
+      futex_wait(_state, 0);
+    _waiters.fetch_sub(1, std::memory_order_relaxed);
+  }
+
+  template <typename Clock, typename Duration>
+  bool wait_until(
+      const std::chrono::time_point<Clock, Duration> &absTime) noexcept {
+    if (try_wait() || spin())
+      return true;
+
+    bool got = false;
+    _waiters.fetch_add(1, std::memory_order_seq_cst);
+    while (!(got = try_wait())) {
+      auto rel = absTime - Clock::now();
+      if (rel <= rel.zero())
+        break;
+      futex_wait_for(_state, 0,
+                     std::chrono::duration_cast<std::chrono::nanoseconds>(rel));
+    }
+    _waiters.fetch_sub(1, std::memory_order_relaxed);
+    return got;
+  }
+
+  template <typename Rep, typename Period>
+  bool wait_for(const std::chrono::duration<Rep, Period> &relTime) noexcept {
+    return wait_until(std::chrono::steady_clock::now() + relTime);
+  }
+
+protected:
+  inline bool spin() noexcept {
+    Backoff backoff;
+    for (uint32_t i = 0; i < SPIN_ROUNDS; i++) {
+      backoff.pause();
+      if (try_wait())
+        return true;
+    }
+
+    return false;
+  }
+
+  std::atomic<uint32_t> _state;
+  std::atomic<uint32_t> _waiters{0};
+  const bool _autoReset;
+};
+
+using SpinEvent = BasicSpinEvent<>;
+} // namespace utils
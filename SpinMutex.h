@@ -1,312 +1,1057 @@
-﻿#pragma once
-#include <atomic>
-#include <cassert>
-#include <sstream>
-#include <thread>
-
-namespace utils {
-static inline size_t get_thread_id() {
-  std::stringstream ss;
-  ss << std::this_thread::get_id();
-  return atoi(ss.str().c_str());
-}
-static thread_local size_t g_threadId = get_thread_id();
-
-class SpinMutex {
-public:
-  SpinMutex() = default;
-  SpinMutex(const SpinMutex &) = delete;
-  SpinMutex &operator=(const SpinMutex &) = delete;
-  inline void lock() noexcept {
-    while (_flag.exchange(true, std::memory_order_acquire)) {
-      std::this_thread::yield();
-    }
-
-    _owner = g_threadId;
-  }
-
-  inline bool try_lock() noexcept {
-    bool b = !_flag.load(std::memory_order_relaxed) &&
-             !_flag.exchange(true, std::memory_order_acquire);
-    if (b)
-      _owner = g_threadId;
-    return b;
-  }
-
-  inline void unlock() noexcept {
-    assert(_owner == g_threadId);
-    _owner = 0;
-    _flag.store(false, std::memory_order_release);
-  }
-
-  inline bool is_locked() const {
-    return _flag.load(std::memory_order_relaxed);
-  }
-
-  inline size_t owner() const { return _owner; }
-
-protected:
-  std::atomic<bool> _flag = ATOMIC_VAR_INIT(false);
-  size_t _owner = 0;
-};
-
-class SharedSpinMutex {
-public:
-  SharedSpinMutex() = default;
-  SharedSpinMutex(const SharedSpinMutex &) = delete;
-  SharedSpinMutex &operator=(const SharedSpinMutex &) = delete;
-
-  inline void lock() noexcept {
-    while (_writeFlag.exchange(true, std::memory_order_acquire)) {
-      std::this_thread::yield();
-    }
-
-    while (_readCount.load(std::memory_order_relaxed) > 0) {
-      std::this_thread::yield();
-    }
-
-    _owner = g_threadId;
-  }
-
-  inline bool try_lock() noexcept {
-    if (_readCount.load(std::memory_order_relaxed) == 0 &&
-        !_writeFlag.exchange(true, std::memory_order_acquire)) {
-      if (_readCount.load(std::memory_order_relaxed) > 0) {
-        _writeFlag.store(false, std::memory_order_relaxed);
-        return false;
-      }
-
-      _owner = g_threadId;
-      return true;
-    }
-
-    return false;
-  }
-
-  void unlock() noexcept {
-    assert(_owner == g_threadId);
-    _owner = 0;
-    _writeFlag.store(false, std::memory_order_release);
-  }
-
-  inline void lock_shared() noexcept {
-    while (true) {
-      _readCount.fetch_add(1, std::memory_order_acquire);
-      if (!_writeFlag.load(std::memory_order_relaxed))
-        break;
-
-      _readCount.fetch_sub(1, std::memory_order_relaxed);
-      std::this_thread::yield();
-    }
-  }
-
-  inline bool try_lock_shared() noexcept {
-    if (!_writeFlag.load(std::memory_order_relaxed)) {
-      _readCount.fetch_add(1, std::memory_order_acquire);
-      if (_writeFlag.load(std::memory_order_relaxed)) {
-        _readCount.fetch_sub(1, std::memory_order_relaxed);
-        return false;
-      }
-
-      return true;
-    }
-
-    return false;
-  }
-
-  inline void unlock_shared() noexcept {
-    assert(_owner == 0);
-    _readCount.fetch_sub(1, std::memory_order_relaxed);
-  }
-
-  inline bool is_write_locked() const {
-    return _writeFlag.load(std::memory_order_relaxed);
-  }
-
-  inline uint32_t read_locked_count() const {
-    return _readCount.load(std::memory_order_relaxed);
-  }
-
-  inline bool is_locked() const {
-    return _writeFlag.load(std::memory_order_relaxed) ||
-           _readCount.load(std::memory_order_relaxed) > 0;
-  }
-
-protected:
-  std::atomic<int32_t> _readCount{0};
-  std::atomic<bool> _writeFlag{false};
-  size_t _owner = 0;
-};
-
-class ReentrantSpinMutex {
-public:
-  ReentrantSpinMutex() = default;
-  ReentrantSpinMutex(const ReentrantSpinMutex &) = delete;
-  ReentrantSpinMutex &operator=(const ReentrantSpinMutex &) = delete;
-
-  inline void lock() noexcept {
-    if (_owner == g_threadId) {
-      _reenCount++;
-      return;
-    }
-
-    while (_flag.exchange(true, std::memory_order_acquire)) {
-      std::this_thread::yield();
-    }
-
-    assert(_reenCount == 0 && _owner == 0);
-    _owner = g_threadId;
-    _reenCount = 1;
-  }
-
-  bool try_lock() noexcept {
-    size_t currId = g_threadId;
-    if (_owner == currId) {
-      _reenCount++;
-      return true;
-    }
-
-    if (!_flag.load(std::memory_order_relaxed) &&
-        !_flag.exchange(true, std::memory_order_acquire)) {
-      assert(_reenCount == 0);
-      _owner = currId;
-      _reenCount = 1;
-      return true;
-    }
-
-    return false;
-  }
-
-  inline void unlock() noexcept {
-    assert(_owner == g_threadId);
-    _reenCount--;
-    if (_reenCount == 0) {
-      _owner = 0;
-      _flag.store(false, std::memory_order_release);
-    }
-  }
-
-  inline bool is_locked() const {
-    return _flag.load(std::memory_order_relaxed);
-  }
-
-  inline int32_t reentrant_count() const { return _reenCount; }
-
-protected:
-  std::atomic<bool> _flag = ATOMIC_VAR_INIT(false);
-  size_t _owner = 0;
-  int32_t _reenCount = 0;
-};
-
-class ReentrantSharedSpinMutex {
-public:
-  ReentrantSharedSpinMutex() = default;
-  ReentrantSharedSpinMutex(const ReentrantSharedSpinMutex &) = delete;
-  ReentrantSharedSpinMutex &
-  operator=(const ReentrantSharedSpinMutex &) = delete;
-
-  inline void lock() noexcept {
-    size_t currId = g_threadId;
-    if (_owner == currId) {
-      assert(_reenCount > 0);
-      _reenCount++;
-      return;
-    }
-
-    while (_writeFlag.exchange(true, std::memory_order_acquire)) {
-      std::this_thread::yield();
-    }
-
-    while (_readCount.load(std::memory_order_relaxed) > 0) {
-      std::this_thread::yield();
-    }
-
-    assert(_reenCount == 0);
-    _owner = currId;
-    _reenCount = 1;
-  }
-
-  inline bool try_lock() noexcept {
-    size_t currId = g_threadId;
-    if (_owner == currId) {
-      assert(_reenCount > 0);
-      _reenCount++;
-      return true;
-    }
-
-    if (_readCount.load(std::memory_order_relaxed) == 0 &&
-        !_writeFlag.exchange(true, std::memory_order_acquire)) {
-      if (_readCount.load(std::memory_order_relaxed) > 0) {
-        _writeFlag.store(false, std::memory_order_relaxed);
-        return false;
-      }
-
-      assert(_reenCount == 0);
-      _owner = currId;
-      _reenCount = 1;
-      return true;
-    }
-
-    return false;
-  }
-
-  void unlock() noexcept {
-    assert(_owner == g_threadId);
-    _reenCount--;
-    if (_reenCount == 0) {
-      _owner = 0;
-      _writeFlag.store(false, std::memory_order_release);
-    }
-  }
-
-  inline void lock_shared() noexcept {
-    while (true) {
-      _readCount.fetch_add(1, std::memory_order_acquire);
-      if (!_writeFlag.load(std::memory_order_relaxed))
-        break;
-
-      _readCount.fetch_sub(1, std::memory_order_relaxed);
-      std::this_thread::yield();
-    }
-  }
-
-  inline bool try_lock_shared() noexcept {
-    if (!_writeFlag.load(std::memory_order_relaxed)) {
-      _readCount.fetch_add(1, std::memory_order_acquire);
-      if (_writeFlag.load(std::memory_order_relaxed)) {
-        _readCount.fetch_sub(1, std::memory_order_relaxed);
-        return false;
-      }
-
-      return true;
-    }
-
-    return false;
-  }
-
-  inline void unlock_shared() noexcept {
-    _readCount.fetch_sub(1, std::memory_order_relaxed);
-  }
-
-  inline bool is_write_locked() const {
-    return _writeFlag.load(std::memory_order_relaxed);
-  }
-
-  inline uint32_t read_locked_count() const {
-    return _readCount.load(std::memory_order_relaxed);
-  }
-
-  inline bool is_locked() const {
-    return _writeFlag.load(std::memory_order_relaxed) ||
-           _readCount.load(std::memory_order_relaxed) > 0;
-  }
-
-  inline int32_t reentrant_count() const { return _reenCount; }
-
-protected:
-  std::atomic<int32_t> _readCount{0};
-  std::atomic<bool> _writeFlag{false};
-  size_t _owner = 0;
-  int32_t _reenCount = 0;
-};
-} // namespace utils
+#pragma once
+#include "Futex.h"
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <climits>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#if defined(_M_X64) || defined(_M_IX86)
+#include <intrin.h>
+#endif
+
+#if __cplusplus >= 202002L && __has_include(<stop_token>)
+#include <optional>
+#include <stop_token>
+#endif
+
+// Set to 1 to compile in the checks of SingleThreadMode.
+#ifndef SPIN_MUTEX_SINGLE_THREAD_MODE
+#define SPIN_MUTEX_SINGLE_THREAD_MODE 0
+#endif
+
+namespace utils {
+static inline size_t get_thread_id() {
+  std::stringstream ss;
+  ss << std::this_thread::get_id();
+  return atoi(ss.str().c_str());
+}
+static thread_local size_t g_threadId = get_thread_id();
+
+// Dense per-thread index in [0, MAX_SLOTS), reused after a thread exits, so
+// per-thread state can live in plain arrays instead of maps keyed by id.
+class ThreadSlot {
+public:
+  static constexpr uint32_t MAX_SLOTS = 1024;
+  static constexpr uint32_t INVALID_SLOT = UINT32_MAX;
+
+  static inline uint32_t get() noexcept { return _holder._slot; }
+
+  static inline uint32_t high_water() noexcept {
+    return _highWater.load(std::memory_order_relaxed);
+  }
+
+private:
+  struct Holder {
+    Holder() noexcept : _slot(acquire()) {}
+    ~Holder() { release(_slot); }
+    uint32_t _slot;
+  };
+
+  static uint32_t acquire() noexcept {
+    for (uint32_t w = 0; w < WORDS; w++) {
+      uint64_t bits = _bitmap[w].load(std::memory_order_relaxed);
+      while (bits != UINT64_MAX) {
+        uint32_t bit = 0;
+        while (bits & (1ull << bit))
+          bit++;
+
+        if (_bitmap[w].compare_exchange_weak(bits, bits | (1ull << bit),
+                                             std::memory_order_acq_rel)) {
+          uint32_t slot = w * 64 + bit;
+          uint32_t hw = _highWater.load(std::memory_order_relaxed);
+          while (hw <= slot && !_highWater.compare_exchange_weak(
+                                   hw, slot + 1, std::memory_order_relaxed)) {
+          }
+          return slot;
+        }
+      }
+    }
+
+    return INVALID_SLOT;
+  }
+
+  static void release(uint32_t slot) noexcept {
+    if (slot == INVALID_SLOT)
+      return;
+    _bitmap[slot / 64].fetch_and(~(1ull << (slot % 64)),
+                                 std::memory_order_release);
+  }
+
+  static constexpr uint32_t WORDS = MAX_SLOTS / 64;
+  static inline std::atomic<uint64_t> _bitmap[WORDS];
+  static inline std::atomic<uint32_t> _highWater{0};
+  static inline thread_local Holder _holder;
+};
+
+// Opt-in process mode in which the spin locks use plain loads and stores
+// instead of atomic read-modify-writes. enable() may only be called while
+// the process runs a single thread, and every thread after that must be
+// started by create_thread(), which leaves the mode for good before the
+// thread exists. A lock used while the mode is on by any thread but the
+// enabling one (a plain std::thread, a third-party pool) could not be made
+// safe any more, so the process is stopped with a message, in release
+// builds too. Needs SPIN_MUTEX_SINGLE_THREAD_MODE.
+class SingleThreadMode {
+public:
+  static inline void enable() noexcept {
+    _isEnabler = true;
+    _active.store(true, std::memory_order_relaxed);
+  }
+
+  static inline bool active() noexcept {
+    return _active.load(std::memory_order_relaxed);
+  }
+
+  static inline bool is_enabler() noexcept { return _isEnabler; }
+
+  // Called by the locks while the mode is on; one thread-local load.
+  static inline void check_thread() noexcept {
+    if (!_isEnabler) {
+      std::fputs("SingleThreadMode: lock used by a thread that was not "
+                 "started with create_thread()\n",
+                 stderr);
+      std::abort();
+    }
+  }
+
+  static inline void before_thread_create() noexcept {
+    if (_active.load(std::memory_order_relaxed)) {
+      _active.store(false, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+    }
+  }
+
+private:
+  static inline std::atomic<bool> _active{false};
+  static inline thread_local bool _isEnabler = false;
+};
+
+template <typename... Args> inline std::thread create_thread(Args &&...args) {
+  SingleThreadMode::before_thread_create();
+  return std::thread(std::forward<Args>(args)...);
+}
+
+inline void cpu_relax() noexcept {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(_M_X64) || defined(_M_IX86)
+  _mm_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+  asm volatile("yield" ::: "memory");
+#endif
+}
+
+// Backoff policies shared by the spin locks and the blocking primitives built
+// on them. pause() is called once per failed attempt.
+struct YieldBackoff {
+  inline void pause() noexcept { std::this_thread::yield(); }
+};
+
+// Doubles the number of cpu_relax() per attempt up to MAX_PAUSES, then yields.
+struct ExponentialBackoff {
+  static constexpr uint32_t MAX_PAUSES = 64;
+
+  inline void pause() noexcept {
+    if (_pauses <= MAX_PAUSES) {
+      for (uint32_t i = 0; i < _pauses; i++)
+        cpu_relax();
+      _pauses <<= 1;
+    } else {
+      std::this_thread::yield();
+    }
+  }
+
+  uint32_t _pauses = 1;
+};
+
+// Global cap on the number of threads spinning in the lock slow paths,
+// defaulting to the online CPUs minus one. Waiters that are not admitted yield
+// or park right away. The count is sharded by ThreadSlot so admission never
+// touches a single hot counter. Disabled until enable() is called.
+class SpinnerBudget {
+public:
+  static constexpr uint32_t SHARDS = 8;
+  static constexpr int32_t UNCOUNTED = -1;
+  static constexpr int32_t DENIED = -2;
+
+  static inline uint32_t default_budget() noexcept {
+    uint32_t n = std::thread::hardware_concurrency();
+    return n > 1 ? n - 1 : 1;
+  }
+
+  static inline void enable(uint32_t budget = default_budget()) noexcept {
+    set_budget(budget);
+    _enabled.store(true, std::memory_order_release);
+  }
+
+  static inline void disable() noexcept {
+    _enabled.store(false, std::memory_order_release);
+  }
+
+  static inline bool enabled() noexcept {
+    return _enabled.load(std::memory_order_relaxed);
+  }
+
+  // May be changed at any time, the shards follow the new limits as soon as
+  // the spinners admitted under the old ones leave.
+  static inline void set_budget(uint32_t budget) noexcept {
+    uint32_t active = budget < SHARDS ? budget : SHARDS;
+    for (uint32_t i = 0; i < SHARDS; i++) {
+      int32_t limit = 0;
+      if (i < active)
+        limit = (int32_t)(budget / active + (i < budget % active ? 1 : 0));
+      _shards[i]._limit.store(limit, std::memory_order_relaxed);
+    }
+
+    _budget.store(budget, std::memory_order_relaxed);
+    _activeShards.store(active, std::memory_order_release);
+  }
+
+  static inline uint32_t budget() noexcept {
+    return _budget.load(std::memory_order_relaxed);
+  }
+
+  static inline uint32_t spinning() noexcept {
+    int32_t n = 0;
+    for (uint32_t i = 0; i < SHARDS; i++)
+      n += _shards[i]._count.load(std::memory_order_relaxed);
+    return n > 0 ? (uint32_t)n : 0;
+  }
+
+  // Returns the shard the caller was admitted to, UNCOUNTED when the budget
+  // is disabled or DENIED.
+  static inline int32_t try_enter() noexcept {
+    if (!_enabled.load(std::memory_order_relaxed))
+      return UNCOUNTED;
+
+    uint32_t active = _activeShards.load(std::memory_order_acquire);
+    if (active == 0)
+      return DENIED;
+
+    uint32_t idx = ThreadSlot::get() % active;
+    Shard &shard = _shards[idx];
+    if (shard._count.fetch_add(1, std::memory_order_relaxed) <
+        shard._limit.load(std::memory_order_relaxed))
+      return (int32_t)idx;
+
+    shard._count.fetch_sub(1, std::memory_order_relaxed);
+    return DENIED;
+  }
+
+  static inline void leave(int32_t shard) noexcept {
+    if (shard >= 0)
+      _shards[shard]._count.fetch_sub(1, std::memory_order_relaxed);
+  }
+
+private:
+  // Only used with static storage, which zero initializes it.
+  struct alignas(64) Shard {
+    std::atomic<int32_t> _count;
+    std::atomic<int32_t> _limit;
+  };
+
+  static inline Shard _shards[SHARDS];
+  static inline std::atomic<bool> _enabled{false};
+  static inline std::atomic<uint32_t> _budget{0};
+  static inline std::atomic<uint32_t> _activeShards{0};
+};
+
+// Admission to the SpinnerBudget for the spinning part of one slow path.
+// A waiter that goes on to park or yield calls leave() first, so a sleeping
+// thread never holds a place another waiter could spin in.
+class SpinnerTicket {
+public:
+  SpinnerTicket() noexcept : _shard(SpinnerBudget::try_enter()) {}
+  SpinnerTicket(const SpinnerTicket &) = delete;
+  SpinnerTicket &operator=(const SpinnerTicket &) = delete;
+  ~SpinnerTicket() { SpinnerBudget::leave(_shard); }
+
+  inline bool admitted() const noexcept {
+    return _shard != SpinnerBudget::DENIED;
+  }
+
+  // Gives the place back early; admitted() keeps its answer.
+  inline void leave() noexcept {
+    if (_shard >= 0) {
+      SpinnerBudget::leave(_shard);
+      _shard = SpinnerBudget::UNCOUNTED;
+    }
+  }
+
+private:
+  int32_t _shard;
+};
+
+// Policies of BasicSpinMutex, all resolved at compile time.
+struct ExclusiveMode {
+  static constexpr bool SHARED = false;
+};
+
+struct SharedMode {
+  static constexpr bool SHARED = true;
+};
+
+struct NonReentrant {
+  static constexpr bool REENTRANT = false;
+};
+
+struct Reentrant {
+  static constexpr bool REENTRANT = true;
+};
+
+// Retry with the backoff policy until the lock is free.
+struct SpinWait {
+  static constexpr bool PARK = false;
+  static constexpr bool PROFILED = false;
+};
+
+// Retry SPIN_ROUNDS times, then sleep on the lock word with futex.
+struct ParkWait {
+  static constexpr bool PARK = true;
+  static constexpr bool PROFILED = false;
+  static constexpr uint32_t SPIN_ROUNDS = 64;
+};
+
+// ParkWait whose LockPolicy is picked at run time by the Stats policy's
+// wait_policy(), e.g. ProfileStats in ProfiledMutex.h.
+struct ProfiledWait {
+  static constexpr bool PARK = true;
+  static constexpr bool PROFILED = true;
+};
+
+// How a ParkWait slow path waits: spinRounds attempts with the Backoff
+// policy (or yield without backoff), then futex parking, or more yielding
+// without park.
+struct LockPolicy {
+  uint32_t spinRounds = ParkWait::SPIN_ROUNDS;
+  bool backoff = true;
+  bool park = true;
+};
+
+// Stats policies see every acquisition, the exclusive releases and the
+// waiters of the slow paths.
+struct NoStats {
+  static constexpr bool ENABLED = false;
+  inline void on_acquire(bool) noexcept {}
+  inline void on_acquire_shared(bool) noexcept {}
+  inline void on_release() noexcept {}
+  inline void on_wait_begin() noexcept {}
+  inline void on_wait_end() noexcept {}
+};
+
+// Counts the exclusive acquisitions.
+struct CountStats {
+  static constexpr bool ENABLED = true;
+
+  inline void on_acquire(bool contended) noexcept {
+    _acquired.fetch_add(1, std::memory_order_relaxed);
+    if (contended)
+      _contended.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  inline void on_acquire_shared(bool) noexcept {}
+  inline void on_release() noexcept {}
+  inline void on_wait_begin() noexcept {}
+  inline void on_wait_end() noexcept {}
+
+  inline uint64_t acquired_count() const noexcept {
+    return _acquired.load(std::memory_order_relaxed);
+  }
+
+  inline uint64_t contended_count() const noexcept {
+    return _contended.load(std::memory_order_relaxed);
+  }
+
+  std::atomic<uint64_t> _acquired{0};
+  std::atomic<uint64_t> _contended{0};
+};
+
+// Where BasicSpinMutex keeps its words and how it sleeps and spins on them.
+// test/ModelChecker.h provides ModelAtomics, which runs these same lock paths
+// under the model checker's scheduler.
+struct StdAtomics {
+  template <typename T> using Atomic = std::atomic<T>;
+
+  static inline void futex_wait(std::atomic<uint32_t> &word,
+                                uint32_t expected) noexcept {
+    utils::futex_wait(word, expected);
+  }
+
+  static inline void futex_wait_for(std::atomic<uint32_t> &word,
+                                    uint32_t expected,
+                                    std::chrono::nanoseconds rel) noexcept {
+    utils::futex_wait_for(word, expected, rel);
+  }
+
+  static inline void futex_wake(std::atomic<uint32_t> &word,
+                                int count) noexcept {
+    utils::futex_wake(word, count);
+  }
+
+  // One round of a spin wait on word; pause() runs the Backoff policy.
+  template <typename T, typename Pause>
+  static inline void pause_on(const std::atomic<T> &word,
+                              Pause &&pause) noexcept {
+    (void)word;
+    pause();
+  }
+};
+
+// Keeps the owner's thread id next to the lock word; needed by reentrancy.
+struct TrackOwner {
+  static constexpr bool TRACKED = true;
+
+  inline void set_owner() noexcept { _owner = g_threadId; }
+  inline void clear_owner() noexcept { _owner = 0; }
+  inline bool is_owner() const noexcept { return _owner == g_threadId; }
+  inline bool no_owner() const noexcept { return _owner == 0; }
+
+  size_t _owner = 0;
+};
+
+// Locks held by the current thread, only maintained in debug builds so the
+// ownership asserts of CompactOwner locks keep working.
+class HeldLocks {
+public:
+  static inline void add(const void *lock) { _locks.push_back(lock); }
+
+  static inline void remove(const void *lock) noexcept {
+    for (size_t i = _locks.size(); i > 0; i--) {
+      if (_locks[i - 1] == lock) {
+        _locks.erase(_locks.begin() + (i - 1));
+        return;
+      }
+    }
+  }
+
+  static inline bool contains(const void *lock) noexcept {
+    for (const void *l : _locks) {
+      if (l == lock)
+        return true;
+    }
+
+    return false;
+  }
+
+private:
+  static inline thread_local std::vector<const void *> _locks;
+};
+
+// Keeps nothing but the lock word: owner tracking moves to HeldLocks in
+// debug builds and disappears in release builds. Not for Reentrant.
+struct CompactOwner {
+  static constexpr bool TRACKED = false;
+
+#ifdef NDEBUG
+  inline void set_owner() noexcept {}
+  inline void clear_owner() noexcept {}
+  inline bool is_owner() const noexcept { return true; }
+  inline bool no_owner() const noexcept { return true; }
+#else
+  inline void set_owner() noexcept {
+    assert(!HeldLocks::contains(this));
+    HeldLocks::add(this);
+  }
+
+  inline void clear_owner() noexcept { HeldLocks::remove(this); }
+  inline bool is_owner() const noexcept { return HeldLocks::contains(this); }
+  inline bool no_owner() const noexcept { return !HeldLocks::contains(this); }
+#endif
+};
+
+namespace detail {
+template <bool, typename Atomics> struct ReadCountField {};
+template <typename Atomics> struct ReadCountField<true, Atomics> {
+  typename Atomics::template Atomic<int32_t> _readCount{0};
+};
+
+template <bool> struct ReenCountField {};
+template <> struct ReenCountField<true> {
+  int32_t _reenCount = 0;
+};
+} // namespace detail
+
+template <typename Mode = ExclusiveMode, typename Reentrancy = NonReentrant,
+          typename Backoff = YieldBackoff, typename Wait = SpinWait,
+          typename Stats = NoStats, typename Owner = TrackOwner,
+          typename Atomics = StdAtomics>
+class BasicSpinMutex : protected detail::ReadCountField<Mode::SHARED, Atomics>,
+                       protected detail::ReenCountField<Reentrancy::REENTRANT>,
+                       public Stats,
+                       protected Owner {
+  static constexpr bool SHARED = Mode::SHARED;
+  static constexpr bool REENTRANT = Reentrancy::REENTRANT;
+  static constexpr bool PARK = Wait::PARK;
+  using Word = std::conditional_t<PARK, uint32_t, bool>;
+  template <typename T> using Atomic = typename Atomics::template Atomic<T>;
+  static_assert(Owner::TRACKED || !REENTRANT,
+                "Reentrant locks need TrackOwner");
+  // A writer sets _flag and then reads _readCount, a reader increments
+  // _readCount and then reads _flag. Neither store may pass the following
+  // load (store buffering), so both sides use seq_cst; on x86 that is the
+  // same code as acquire. test/spin_mutex_model_test.cpp runs this class
+  // under its model checker: with every seq_cst weakened a reader and a
+  // writer get in together, with these orders no such run is found.
+  static constexpr std::memory_order WORD_ACQUIRE =
+      SHARED ? std::memory_order_seq_cst : std::memory_order_acquire;
+
+public:
+  BasicSpinMutex() = default;
+  // For Stats policies that are kept per name, such as ProfileStats.
+  explicit BasicSpinMutex(const std::string &name) : Stats(name) {}
+  BasicSpinMutex(const BasicSpinMutex &) = delete;
+  BasicSpinMutex &operator=(const BasicSpinMutex &) = delete;
+
+  inline void lock() noexcept {
+    if constexpr (REENTRANT) {
+      if (Owner::is_owner()) {
+        assert(this->_reenCount > 0);
+        this->_reenCount++;
+        return;
+      }
+    }
+
+    bool contended = lock_word();
+    if constexpr (SHARED) {
+      if (this->_readCount.load(std::memory_order_seq_cst) > 0)
+        wait_readers();
+    }
+
+    if constexpr (REENTRANT) {
+      assert(this->_reenCount == 0 && Owner::no_owner());
+      this->_reenCount = 1;
+    }
+
+    Owner::set_owner();
+    Stats::on_acquire(contended);
+  }
+
+  inline bool try_lock() noexcept {
+    if constexpr (REENTRANT) {
+      if (Owner::is_owner()) {
+        assert(this->_reenCount > 0);
+        this->_reenCount++;
+        return true;
+      }
+    }
+
+    if constexpr (SHARED) {
+      if (this->_readCount.load(std::memory_order_relaxed) > 0 ||
+          !try_lock_word())
+        return false;
+
+      if (this->_readCount.load(std::memory_order_seq_cst) > 0) {
+        unlock_word();
+        return false;
+      }
+    } else {
+      if (!try_lock_word())
+        return false;
+    }
+
+    if constexpr (REENTRANT) {
+      assert(this->_reenCount == 0);
+      this->_reenCount = 1;
+    }
+
+    Owner::set_owner();
+    Stats::on_acquire(false);
+    return true;
+  }
+
+  inline void unlock() noexcept {
+    assert(Owner::is_owner());
+    if constexpr (REENTRANT) {
+      if (--this->_reenCount != 0)
+        return;
+    }
+
+    Owner::clear_owner();
+    Stats::on_release();
+    unlock_word();
+  }
+
+  inline void lock_shared() noexcept {
+    static_assert(SHARED, "lock_shared needs SharedMode");
+    if (single_thread()) {
+      assert(!_flag.load(std::memory_order_relaxed));
+      add_read_count(1);
+      Stats::on_acquire_shared(false);
+      return;
+    }
+
+    this->_readCount.fetch_add(1, std::memory_order_seq_cst);
+    bool contended = _flag.load(std::memory_order_seq_cst);
+    if (contended) {
+      this->_readCount.fetch_sub(1, std::memory_order_relaxed);
+      lock_shared_slow();
+    }
+
+    Stats::on_acquire_shared(contended);
+  }
+
+  inline bool try_lock_shared() noexcept {
+    static_assert(SHARED, "try_lock_shared needs SharedMode");
+    if (single_thread()) {
+      if (_flag.load(std::memory_order_relaxed))
+        return false;
+
+      add_read_count(1);
+      Stats::on_acquire_shared(false);
+      return true;
+    }
+
+    if (!_flag.load(std::memory_order_relaxed)) {
+      this->_readCount.fetch_add(1, std::memory_order_seq_cst);
+      if (_flag.load(std::memory_order_seq_cst)) {
+        this->_readCount.fetch_sub(1, std::memory_order_relaxed);
+        return false;
+      }
+
+      Stats::on_acquire_shared(false);
+      return true;
+    }
+
+    return false;
+  }
+
+  inline void unlock_shared() noexcept {
+    static_assert(SHARED, "unlock_shared needs SharedMode");
+    assert(Owner::no_owner());
+    if (single_thread()) {
+      add_read_count(-1);
+      return;
+    }
+
+    this->_readCount.fetch_sub(1, std::memory_order_release);
+  }
+
+#if defined(__cpp_lib_jthread)
+  // Give up and return false once stop is requested. The token is only
+  // polled after the fast path failed; parked waiters are woken by a
+  // stop_callback.
+  inline bool lock(std::stop_token stop) noexcept {
+    if constexpr (REENTRANT) {
+      if (Owner::is_owner()) {
+        assert(this->_reenCount > 0);
+        this->_reenCount++;
+        return true;
+      }
+    }
+
+    bool contended = !try_lock_word();
+    if (contended && !lock_word_until(stop))
+      return false;
+
+    if constexpr (SHARED) {
+      if (this->_readCount.load(std::memory_order_seq_cst) > 0 &&
+          !wait_readers_until(stop)) {
+        unlock_word();
+        return false;
+      }
+    }
+
+    if constexpr (REENTRANT) {
+      assert(this->_reenCount == 0 && Owner::no_owner());
+      this->_reenCount = 1;
+    }
+
+    Owner::set_owner();
+    Stats::on_acquire(contended);
+    return true;
+  }
+
+  inline bool lock_shared(std::stop_token stop) noexcept {
+    static_assert(SHARED, "lock_shared needs SharedMode");
+    if (single_thread()) {
+      lock_shared();
+      return true;
+    }
+
+    this->_readCount.fetch_add(1, std::memory_order_seq_cst);
+    bool contended = _flag.load(std::memory_order_seq_cst);
+    if (contended) {
+      this->_readCount.fetch_sub(1, std::memory_order_relaxed);
+      if (!lock_shared_slow_until(stop))
+        return false;
+    }
+
+    Stats::on_acquire_shared(contended);
+    return true;
+  }
+#endif
+
+  inline bool is_locked() const {
+    if constexpr (SHARED) {
+      return _flag.load(std::memory_order_relaxed) ||
+             this->_readCount.load(std::memory_order_relaxed) > 0;
+    } else {
+      return _flag.load(std::memory_order_relaxed);
+    }
+  }
+
+  // Whether the lock word shows somebody waiting for it. Only ParkWait
+  // sleepers leave a lasting trace. A reader blocked by a SharedMode writer
+  // is visible only between its increment of _readCount and the decrement
+  // it makes before backing off, so it is usually missed.
+  //
+  // With ParkWait the answer is conservative: a thread that took the lock
+  // through the parking path keeps the word at 2 until its unlock, whether
+  // anybody still sleeps or not, so true can mean a waiter that is already
+  // gone. The unlock clears it; the next holder that takes the free word
+  // sees false again.
+  inline bool has_waiters() const {
+    if constexpr (PARK) {
+      if (_flag.load(std::memory_order_relaxed) == 2)
+        return true;
+    }
+
+    if constexpr (SHARED) {
+      return _flag.load(std::memory_order_relaxed) &&
+             this->_readCount.load(std::memory_order_relaxed) > 0;
+    } else {
+      return false;
+    }
+  }
+
+  inline bool is_write_locked() const {
+    static_assert(SHARED, "is_write_locked needs SharedMode");
+    return _flag.load(std::memory_order_relaxed);
+  }
+
+  inline uint32_t read_locked_count() const {
+    static_assert(SHARED, "read_locked_count needs SharedMode");
+    return this->_readCount.load(std::memory_order_relaxed);
+  }
+
+  inline int32_t reentrant_count() const {
+    static_assert(REENTRANT, "reentrant_count needs Reentrant");
+    return this->_reenCount;
+  }
+
+  inline size_t owner() const {
+    static_assert(Owner::TRACKED, "owner needs TrackOwner");
+    return this->_owner;
+  }
+
+protected:
+  static inline bool single_thread() noexcept {
+    if constexpr (SPIN_MUTEX_SINGLE_THREAD_MODE) {
+      if (SingleThreadMode::active()) {
+        SingleThreadMode::check_thread();
+        return true;
+      }
+    }
+
+    return false;
+  }
+
+  inline void add_read_count(int32_t n) noexcept {
+    this->_readCount.store(
+        this->_readCount.load(std::memory_order_relaxed) + n,
+        std::memory_order_relaxed);
+  }
+
+  // Returns true if the lock word was contended.
+  inline bool lock_word() noexcept {
+    if (single_thread()) {
+      assert(!_flag.load(std::memory_order_relaxed));
+      _flag.store(1, std::memory_order_relaxed);
+      return false;
+    }
+
+    if constexpr (PARK) {
+      uint32_t c = 0;
+      if (_flag.compare_exchange_strong(c, 1, WORD_ACQUIRE,
+                                        std::memory_order_relaxed))
+        return false;
+
+      lock_word_park();
+      return true;
+    } else {
+      if (!_flag.exchange(true, WORD_ACQUIRE))
+        return false;
+
+      SpinnerTicket ticket;
+      Backoff backoff;
+      do {
+        pause_on(ticket, backoff, _flag);
+      } while (_flag.exchange(true, WORD_ACQUIRE));
+      return true;
+    }
+  }
+
+  inline bool try_lock_word() noexcept {
+    if (single_thread()) {
+      if (_flag.load(std::memory_order_relaxed))
+        return false;
+
+      _flag.store(1, std::memory_order_relaxed);
+      return true;
+    }
+
+    if constexpr (PARK) {
+      uint32_t c = 0;
+      return _flag.compare_exchange_strong(c, 1, WORD_ACQUIRE,
+                                           std::memory_order_relaxed);
+    } else {
+      return !_flag.load(std::memory_order_relaxed) &&
+             !_flag.exchange(true, WORD_ACQUIRE);
+    }
+  }
+
+  inline void unlock_word() noexcept {
+    if (single_thread()) {
+      _flag.store(0, std::memory_order_relaxed);
+      return;
+    }
+
+    if constexpr (PARK) {
+      if (_flag.exchange(0, std::memory_order_release) == 2)
+        Atomics::futex_wake(_flag, SHARED ? INT_MAX : 1);
+    } else {
+      _flag.store(false, std::memory_order_release);
+    }
+  }
+
+  // The LockPolicy of a ParkWait slow path: fixed by the Wait policy, or
+  // asked from Stats for ProfiledWait. SpinWait never parks.
+  inline LockPolicy wait_policy() const noexcept {
+    if constexpr (Wait::PROFILED) {
+      return Stats::wait_policy();
+    } else if constexpr (PARK) {
+      return LockPolicy{Wait::SPIN_ROUNDS, true, true};
+    } else {
+      return LockPolicy{0, true, false};
+    }
+  }
+
+  // Tells Stats about a thread in a slow path for its whole duration.
+  struct WaitScope {
+    explicit WaitScope(BasicSpinMutex &m) noexcept : _m(m) {
+      _m.Stats::on_wait_begin();
+    }
+    ~WaitScope() { _m.Stats::on_wait_end(); }
+    BasicSpinMutex &_m;
+  };
+
+  // Without backoff, and past the spin rounds of a policy that never parks,
+  // the waiter yields; in the latter case it no longer counts as a spinner.
+  inline void pause_round(const LockPolicy &p, uint32_t round,
+                          SpinnerTicket &ticket, Backoff &backoff) noexcept {
+    if (round < p.spinRounds && p.backoff) {
+      pause_on(ticket, backoff, _flag);
+    } else {
+      if (round >= p.spinRounds)
+        ticket.leave();
+      std::this_thread::yield();
+    }
+  }
+
+  // 0: free, 1: locked, 2: locked and somebody may sleep on the word.
+  void lock_word_park() noexcept {
+    WaitScope scope(*this);
+    LockPolicy p = wait_policy();
+    SpinnerTicket ticket;
+    Backoff backoff;
+    for (uint32_t i = 0; !p.park || (ticket.admitted() && i < p.spinRounds);
+         i++) {
+      pause_round(p, i, ticket, backoff);
+      uint32_t c = 0;
+      if (_flag.load(std::memory_order_relaxed) == 0 &&
+          _flag.compare_exchange_strong(c, 1, WORD_ACQUIRE,
+                                        std::memory_order_relaxed))
+        return;
+    }
+
+    ticket.leave();
+    while (_flag.exchange(2, WORD_ACQUIRE) != 0)
+      Atomics::futex_wait(_flag, 2);
+  }
+
+  // Threads over the SpinnerBudget yield (or park) instead of spinning.
+  static inline void pause(const SpinnerTicket &ticket,
+                           Backoff &backoff) noexcept {
+    if (ticket.admitted())
+      backoff.pause();
+    else
+      std::this_thread::yield();
+  }
+
+  // pause() for a wait on word.
+  template <typename T>
+  static inline void pause_on(const SpinnerTicket &ticket, Backoff &backoff,
+                              const Atomic<T> &word) noexcept {
+    Atomics::pause_on(word, [&] { pause(ticket, backoff); });
+  }
+
+  void wait_readers() noexcept {
+    SpinnerTicket ticket;
+    Backoff backoff;
+    do {
+      pause_on(ticket, backoff, this->_readCount);
+    } while (this->_readCount.load(std::memory_order_acquire) > 0);
+  }
+
+  void lock_shared_slow() noexcept {
+    WaitScope scope(*this);
+    LockPolicy p = wait_policy();
+    SpinnerTicket ticket;
+    Backoff backoff;
+    for (uint32_t rounds = 0;; rounds++) {
+      if constexpr (PARK) {
+        if (p.park && (!ticket.admitted() || rounds >= p.spinRounds)) {
+          ticket.leave();
+          park_reader();
+        } else {
+          pause_round(p, rounds, ticket, backoff);
+        }
+      } else {
+        pause_on(ticket, backoff, _flag);
+      }
+
+      this->_readCount.fetch_add(1, std::memory_order_seq_cst);
+      if (!_flag.load(std::memory_order_seq_cst))
+        break;
+
+      this->_readCount.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    (void)p;
+  }
+
+  void park_reader() noexcept {
+    uint32_t c = _flag.load(std::memory_order_relaxed);
+    if (c == 1 && !_flag.compare_exchange_strong(c, 2, std::memory_order_relaxed))
+      return;
+    if (c != 0)
+      Atomics::futex_wait(_flag, 2);
+  }
+
+#if defined(__cpp_lib_jthread)
+  // A stop requested between the check and futex_wait would lose the
+  // callback's wake-up, so parked waiters also time out and recheck.
+  static constexpr std::chrono::milliseconds STOP_POLL{10};
+
+  struct StopWake {
+    Atomic<Word> *_word;
+    void operator()() const noexcept {
+      Atomics::futex_wake(*_word, INT_MAX);
+    }
+  };
+
+  bool lock_word_until(std::stop_token &stop) noexcept {
+    WaitScope scope(*this);
+    SpinnerTicket ticket;
+    Backoff backoff;
+    if constexpr (PARK) {
+      LockPolicy p = wait_policy();
+      for (uint32_t i = 0; !p.park || (ticket.admitted() && i < p.spinRounds);
+           i++) {
+        if (stop.stop_requested())
+          return false;
+        pause_round(p, i, ticket, backoff);
+        uint32_t c = 0;
+        if (_flag.load(std::memory_order_relaxed) == 0 &&
+            _flag.compare_exchange_strong(c, 1, WORD_ACQUIRE,
+                                          std::memory_order_relaxed))
+          return true;
+      }
+
+      ticket.leave();
+      std::stop_callback<StopWake> wake(stop, StopWake{&_flag});
+      while (_flag.exchange(2, WORD_ACQUIRE) != 0) {
+        if (stop.stop_requested())
+          return false;
+        Atomics::futex_wait_for(_flag, 2, STOP_POLL);
+      }
+
+      return true;
+    } else {
+      do {
+        if (stop.stop_requested())
+          return false;
+        pause_on(ticket, backoff, _flag);
+      } while (_flag.exchange(true, WORD_ACQUIRE));
+      return true;
+    }
+  }
+
+  bool wait_readers_until(std::stop_token &stop) noexcept {
+    SpinnerTicket ticket;
+    Backoff backoff;
+    do {
+      if (stop.stop_requested())
+        return false;
+      pause_on(ticket, backoff, this->_readCount);
+    } while (this->_readCount.load(std::memory_order_acquire) > 0);
+    return true;
+  }
+
+  bool lock_shared_slow_until(std::stop_token &stop) noexcept {
+    WaitScope scope(*this);
+    LockPolicy p = wait_policy();
+    SpinnerTicket ticket;
+    Backoff backoff;
+    std::optional<std::stop_callback<StopWake>> wake;
+    for (uint32_t rounds = 0;; rounds++) {
+      if (stop.stop_requested())
+        return false;
+
+      if constexpr (PARK) {
+        if (p.park && (!ticket.admitted() || rounds >= p.spinRounds)) {
+          ticket.leave();
+          if (!wake)
+            wake.emplace(stop, StopWake{&_flag});
+          uint32_t c = _flag.load(std::memory_order_relaxed);
+          if (c == 1)
+            _flag.compare_exchange_strong(c, 2, std::memory_order_relaxed);
+          if (c != 0)
+            Atomics::futex_wait_for(_flag, 2, STOP_POLL);
+        } else {
+          pause_round(p, rounds, ticket, backoff);
+        }
+      } else {
+        pause_on(ticket, backoff, _flag);
+      }
+
+      this->_readCount.fetch_add(1, std::memory_order_seq_cst);
+      if (!_flag.load(std::memory_order_seq_cst))
+        return true;
+
+      this->_readCount.fetch_sub(1, std::memory_order_relaxed);
+    }
+  }
+#endif
+
+  Atomic<Word> _flag{0};
+};
+
+using SpinMutex = BasicSpinMutex<>;
+using SharedSpinMutex = BasicSpinMutex<SharedMode>;
+using ReentrantSpinMutex = BasicSpinMutex<ExclusiveMode, Reentrant>;
+using ReentrantSharedSpinMutex = BasicSpinMutex<SharedMode, Reentrant>;
+using CompactSpinMutex = BasicSpinMutex<ExclusiveMode, NonReentrant, YieldBackoff,
+                                        SpinWait, NoStats, CompactOwner>;
+using CompactSharedSpinMutex =
+    BasicSpinMutex<SharedMode, NonReentrant, YieldBackoff, SpinWait, NoStats,
+                   CompactOwner>;
+using CompactParkSpinMutex =
+    BasicSpinMutex<ExclusiveMode, NonReentrant, ExponentialBackoff, ParkWait,
+                   NoStats, CompactOwner>;
+
+static_assert(sizeof(CompactSpinMutex) == 1, "compact lock is one byte");
+static_assert(sizeof(CompactParkSpinMutex) == 4,
+              "compact futex lock is one 32 bits word");
+static_assert(sizeof(CompactSharedSpinMutex) == 8,
+              "compact shared lock is the read count and the lock word");
+} // namespace utils
@@ -0,0 +1,96 @@
+#pragma once
+#include "Futex.h"
+#include "SpinMutex.h"
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+namespace utils {
+// Counting semaphore that retries SPIN_ROUNDS times with Backoff before it
+// parks on the counter with futex. release(n) wakes at most n parked threads.
+template <typename Backoff = ExponentialBackoff> class BasicSpinSemaphore {
+public:
+  static constexpr uint32_t SPIN_ROUNDS = 32;
+
+  explicit BasicSpinSemaphore(uint32_t count = 0) : _count(count) {}
+  BasicSpinSemaphore(const BasicSpinSemaphore &) = delete;
+  BasicSpinSemaphore &operator=(const BasicSpinSemaphore &) = delete;
+
+  inline bool try_acquire() noexcept {
+    uint32_t c = _count.load(std::memory_order_relaxed);
+    while (c > 0) {
+      if (_count.compare_exchange_weak(c, c - 1, std::memory_order_acquire,
+                                       std::memory_order_relaxed))
+        return true;
+    }
+
+    return false;
+  }
+
+  inline void acquire() noexcept {
+    if (try_acquire() || spin())
+      return;
+
+    _waiters.fetch_add(1, std::memory_order_seq_cst);
+    while (!try_acquire())
+      futex_wait(_count, 0);
+    _waiters.fetch_sub(1, std::memory_order_relaxed);
+  }
+
+  template <typename Clock, typename Duration>
+  bool try_acquire_until(
+      const std::chrono::time_point<Clock, Duration> &absTime) noexcept {
+    if (try_acquire() || spin())
+      return true;
+
+    bool got = false;
+    _waiters.fetch_add(1, std::memory_order_seq_cst);
+    while (!(got = try_acquire())) {
+      auto rel = absTime - Clock::now();
+      if (rel <= rel.zero())
+        break;
+      futex_wait_for(_count, 0,
+                     std::chrono::duration_cast<std::chrono::nanoseconds>(rel));
+    }
+    _waiters.fetch_sub(1, std::memory_order_relaxed);
+    return got;
+  }
+
+  template <typename Rep, typename Period>
+  bool
+  try_acquire_for(const std::chrono::duration<Rep, Period> &relTime) noexcept {
+    return try_acquire_until(std::chrono::steady_clock::now() + relTime);
+  }
+
+  inline void release(uint32_t n = 1) noexcept {
+    if (n == 0)
+      return;
+
+    _count.fetch_add(n, std::memory_order_seq_cst);
+    uint32_t waiters = _waiters.load(std::memory_order_seq_cst);
+    if (waiters > 0)
+      futex_wake(_count, (int)(n < waiters ? n : waiters));
+  }
+
+  inline uint32_t available() const noexcept {
+    return _count.load(std::memory_order_relaxed);
+  }
+
+protected:
+  inline bool spin() noexcept {
+    Backoff backoff;
+    for (uint32_t i = 0; i < SPIN_ROUNDS; i++) {
+      backoff.pause();
+      if (try_acquire())
+        return true;
+    }
+
+    return false;
+  }
+
+  std::atomic<uint32_t> _count;
+  std::atomic<uint32_t> _waiters{0};
+};
+
+using SpinSemaphore = BasicSpinSemaphore<>;
+} // namespace utils
@@ -0,0 +1,234 @@
+#pragma once
+#include "SpinMutex.h"
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace utils {
+// Transactional variable. Values are stored as 64 bits so every access is a
+// plain atomic load or store.
+template <typename T> class TVar {
+  static_assert(std::is_trivially_copyable<T>::value &&
+                    sizeof(T) <= sizeof(uint64_t),
+                "TVar values must be trivially copyable and at most 64 bits");
+
+public:
+  explicit TVar(T value = T()) : _bits(to_bits(value)) {}
+  TVar(const TVar &) = delete;
+  TVar &operator=(const TVar &) = delete;
+
+  // Value outside of any transaction, e.g. after all writers are done.
+  inline T load() const noexcept {
+    return from_bits(_bits.load(std::memory_order_acquire));
+  }
+
+protected:
+  friend class StmTx;
+
+  static inline uint64_t to_bits(T value) noexcept {
+    uint64_t bits = 0;
+    std::memcpy(&bits, &value, sizeof(T));
+    return bits;
+  }
+
+  static inline T from_bits(uint64_t bits) noexcept {
+    T value;
+    std::memcpy(&value, &bits, sizeof(T));
+    return value;
+  }
+
+  std::atomic<uint64_t> _bits;
+};
+
+class Stm;
+
+// One attempt of a TL2 transaction (Dice, Shalev and Shavit, "Transactional
+// Locking II"). Reads are checked against the read version as they happen,
+// writes are buffered and published at commit under the stripe locks.
+class StmTx {
+public:
+  template <typename T> T read(const TVar<T> &var) {
+    for (const WriteEntry &w : _writes) {
+      if (w._var == &var._bits)
+        return TVar<T>::from_bits(w._bits);
+    }
+
+    std::atomic<uint64_t> &l = lock_of(&var._bits);
+    uint64_t pre = l.load(std::memory_order_acquire);
+    uint64_t bits = var._bits.load(std::memory_order_acquire);
+    uint64_t post = l.load(std::memory_order_acquire);
+    if ((pre & LOCKED) != 0 || pre != post || (pre >> 1) > _readVersion)
+      throw Abort();
+
+    _reads.push_back(&l);
+    return TVar<T>::from_bits(bits);
+  }
+
+  template <typename T> void write(TVar<T> &var, T value) {
+    uint64_t bits = TVar<T>::to_bits(value);
+    for (WriteEntry &w : _writes) {
+      if (w._var == &var._bits) {
+        w._bits = bits;
+        return;
+      }
+    }
+
+    _writes.push_back({&var._bits, &lock_of(&var._bits), bits});
+  }
+
+  // Aborts this attempt, atomically() runs the function again.
+  [[noreturn]] inline void restart() { throw Abort(); }
+
+protected:
+  friend class Stm;
+
+  static constexpr uint64_t LOCKED = 1;
+
+  struct Abort {};
+
+  struct WriteEntry {
+    std::atomic<uint64_t> *_var;
+    std::atomic<uint64_t> *_lock;
+    uint64_t _bits;
+  };
+
+  explicit StmTx(Stm &stm) : _stm(stm) {}
+
+  inline std::atomic<uint64_t> &lock_of(const void *addr) const noexcept;
+
+  inline void begin(uint64_t readVersion) {
+    _readVersion = readVersion;
+    _reads.clear();
+    _writes.clear();
+    _locked.clear();
+  }
+
+  bool commit();
+
+  inline void release_locked() noexcept {
+    for (size_t i = 0; i < _lockedCount; i++)
+      _locked[i]->fetch_sub(LOCKED, std::memory_order_release);
+  }
+
+  Stm &_stm;
+  uint64_t _readVersion = 0;
+  std::vector<std::atomic<uint64_t> *> _reads;
+  std::vector<WriteEntry> _writes;
+  std::vector<std::atomic<uint64_t> *> _locked;
+  size_t _lockedCount = 0;
+};
+
+// Global version clock plus a striped table of versioned lock words; every
+// TVar maps onto a stripe by address. A lock word is version << 1 | LOCKED.
+class Stm {
+public:
+  explicit Stm(size_t stripes = 1 << 16) {
+    size_t n = 1;
+    while (n < stripes)
+      n <<= 1;
+    _mask = n - 1;
+    _locks.reset(new std::atomic<uint64_t>[n]);
+    for (size_t i = 0; i < n; i++)
+      _locks[i].store(0, std::memory_order_relaxed);
+  }
+
+  Stm(const Stm &) = delete;
+  Stm &operator=(const Stm &) = delete;
+
+  // Runs f(StmTx &) until it commits and returns its result. f may run
+  // several times and must not have side effects outside its TVars.
+  template <typename F>
+  auto atomically(F &&f) -> decltype(f(std::declval<StmTx &>())) {
+    StmTx tx(*this);
+    ExponentialBackoff backoff;
+    while (true) {
+      tx.begin(_clock.load(std::memory_order_acquire));
+      try {
+        if constexpr (std::is_void<decltype(f(tx))>::value) {
+          f(tx);
+          if (tx.commit())
+            return;
+        } else {
+          auto result = f(tx);
+          if (tx.commit())
+            return result;
+        }
+      } catch (StmTx::Abort &) {
+      }
+
+      _aborts.fetch_add(1, std::memory_order_relaxed);
+      backoff.pause();
+    }
+  }
+
+  inline uint64_t abort_count() const noexcept {
+    return _aborts.load(std::memory_order_relaxed);
+  }
+
+protected:
+  friend class StmTx;
+
+  inline std::atomic<uint64_t> &lock_of(const void *addr) const noexcept {
+    uint64_t h = (uint64_t)(uintptr_t)addr * 0x9E3779B97F4A7C15ull;
+    return _locks[(size_t)(h >> 32) & _mask];
+  }
+
+  alignas(64) std::atomic<uint64_t> _clock{0};
+  alignas(64) std::atomic<uint64_t> _aborts{0};
+  size_t _mask;
+  std::unique_ptr<std::atomic<uint64_t>[]> _locks;
+};
+
+inline std::atomic<uint64_t> &StmTx::lock_of(const void *addr) const noexcept {
+  return _stm.lock_of(addr);
+}
+
+inline bool StmTx::commit() {
+  if (_writes.empty())
+    return true;
+
+  for (const WriteEntry &w : _writes)
+    _locked.push_back(w._lock);
+  std::sort(_locked.begin(), _locked.end());
+  _locked.erase(std::unique(_locked.begin(), _locked.end()), _locked.end());
+
+  // Writers take the stripes with try-lock and abort on failure, so there
+  // is no ordering to get wrong and no waiting while holding locks.
+  _lockedCount = 0;
+  for (std::atomic<uint64_t> *l : _locked) {
+    uint64_t v = l->load(std::memory_order_relaxed);
+    if ((v & LOCKED) != 0 ||
+        !l->compare_exchange_strong(v, v | LOCKED, std::memory_order_acquire)) {
+      release_locked();
+      return false;
+    }
+    _lockedCount++;
+  }
+
+  uint64_t writeVersion =
+      _stm._clock.fetch_add(1, std::memory_order_acq_rel) + 1;
+  if (writeVersion != _readVersion + 1) {
+    for (std::atomic<uint64_t> *l : _reads) {
+      uint64_t v = l->load(std::memory_order_acquire);
+      if ((v >> 1) > _readVersion ||
+          ((v & LOCKED) != 0 &&
+           !std::binary_search(_locked.begin(), _locked.end(), l))) {
+        release_locked();
+        return false;
+      }
+    }
+  }
+
+  for (const WriteEntry &w : _writes)
+    w._var->store(w._bits, std::memory_order_release);
+  for (std::atomic<uint64_t> *l : _locked)
+    l->store(writeVersion << 1, std::memory_order_release);
+  return true;
+}
+} // namespace utils
@@ -0,0 +1,227 @@
+#pragma once
+#include "SpinMutex.h"
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <functional>
+#include <initializer_list>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace utils {
+// Fixed pool of mutexes that objects are hashed onto, for locking objects
+// that cannot embed a mutex. Pointers are hashed by address. Each stripe
+// sits on its own cache line; with a Stats policy such as CountStats every
+// stripe counts its acquisitions and contended acquisitions so hot stripes
+// can be found with stripe_stats() and hottest_stripe().
+template <typename Mutex = SpinMutex, size_t N = 64, typename Stats = NoStats>
+class StripedLocks {
+public:
+  class alignas(64) Stripe {
+  public:
+    inline void lock() {
+      if constexpr (Stats::ENABLED) {
+        bool contended = !_mutex.try_lock();
+        if (contended)
+          _mutex.lock();
+        _stats.on_acquire(contended);
+      } else {
+        _mutex.lock();
+      }
+    }
+
+    // A successful try counts as an uncontended acquisition; a failed one is
+    // not an acquisition and is not counted.
+    inline bool try_lock() {
+      bool acquired = _mutex.try_lock();
+      if constexpr (Stats::ENABLED) {
+        if (acquired)
+          _stats.on_acquire(false);
+      }
+      return acquired;
+    }
+
+    inline void unlock() { _mutex.unlock(); }
+
+    inline void lock_shared() {
+      if constexpr (Stats::ENABLED) {
+        bool contended = !_mutex.try_lock_shared();
+        if (contended)
+          _mutex.lock_shared();
+        _stats.on_acquire(contended);
+      } else {
+        _mutex.lock_shared();
+      }
+    }
+
+    inline bool try_lock_shared() {
+      bool acquired = _mutex.try_lock_shared();
+      if constexpr (Stats::ENABLED) {
+        if (acquired)
+          _stats.on_acquire(false);
+      }
+      return acquired;
+    }
+
+    inline void unlock_shared() { _mutex.unlock_shared(); }
+
+    inline Mutex &mutex() { return _mutex; }
+
+    inline const Stats &stats() const { return _stats; }
+
+  protected:
+    Mutex _mutex;
+    Stats _stats;
+  };
+
+  // Holds the stripes of several keys, each stripe once, locked in stripe
+  // order so that concurrent multi-key acquisitions cannot deadlock.
+  class MultiGuard {
+  public:
+    MultiGuard(MultiGuard &&other) noexcept
+        : _stripes(std::move(other._stripes)), _shared(other._shared) {
+      other._stripes.clear();
+    }
+
+    MultiGuard(const MultiGuard &) = delete;
+    MultiGuard &operator=(const MultiGuard &) = delete;
+    MultiGuard &operator=(MultiGuard &&) = delete;
+
+    ~MultiGuard() { unlock(); }
+
+    inline void unlock() {
+      for (auto it = _stripes.rbegin(); it != _stripes.rend(); ++it) {
+        if (_shared)
+          (*it)->unlock_shared();
+        else
+          (*it)->unlock();
+      }
+      _stripes.clear();
+    }
+
+    inline size_t stripe_count() const { return _stripes.size(); }
+
+  protected:
+    friend class StripedLocks;
+
+    MultiGuard(std::vector<Stripe *> stripes, bool shared)
+        : _stripes(std::move(stripes)), _shared(shared) {
+      for (Stripe *s : _stripes) {
+        if (_shared)
+          s->lock_shared();
+        else
+          s->lock();
+      }
+    }
+
+    std::vector<Stripe *> _stripes;
+    bool _shared;
+  };
+
+  explicit StripedLocks(size_t stripes = N) {
+    _count = 1;
+    _shift = 64;
+    while (_count < stripes) {
+      _count <<= 1;
+      _shift--;
+    }
+    _stripes.reset(new Stripe[_count]);
+  }
+
+  StripedLocks(const StripedLocks &) = delete;
+  StripedLocks &operator=(const StripedLocks &) = delete;
+
+  template <typename K> inline size_t stripe_of(const K &key) const {
+    size_t h;
+    if constexpr (std::is_pointer<K>::value)
+      h = (size_t)(uintptr_t)key;
+    else
+      h = std::hash<K>()(key);
+    // Fibonacci hashing: the top log2(count) bits of the product are the
+    // best mixed, so the index is taken from those.
+    uint64_t mixed = (uint64_t)h * 0x9E3779B97F4A7C15ull;
+    return _shift == 64 ? 0 : (size_t)(mixed >> _shift);
+  }
+
+  template <typename K> inline Stripe &stripe_for(const K &key) {
+    return _stripes[stripe_of(key)];
+  }
+
+  template <typename K>
+  inline std::unique_lock<Stripe> lock_for(const K &key) {
+    return std::unique_lock<Stripe>(stripe_for(key));
+  }
+
+  template <typename K>
+  inline std::shared_lock<Stripe> shared_for(const K &key) {
+    return std::shared_lock<Stripe>(stripe_for(key));
+  }
+
+  template <typename... Ks> MultiGuard lock_all(const Ks &...keys) {
+    return MultiGuard(collect({stripe_of(keys)...}), false);
+  }
+
+  template <typename... Ks> MultiGuard shared_all(const Ks &...keys) {
+    return MultiGuard(collect({stripe_of(keys)...}), true);
+  }
+
+  template <typename It> MultiGuard lock_range(It first, It last) {
+    return MultiGuard(collect_range(first, last), false);
+  }
+
+  template <typename It> MultiGuard shared_range(It first, It last) {
+    return MultiGuard(collect_range(first, last), true);
+  }
+
+  inline size_t stripe_count() const { return _count; }
+
+  inline const Stats &stripe_stats(size_t idx) const {
+    assert(idx < _count);
+    return _stripes[idx].stats();
+  }
+
+  // Stripe with the most contended acquisitions.
+  size_t hottest_stripe() const {
+    static_assert(Stats::ENABLED, "hottest_stripe() needs a Stats policy");
+    size_t best = 0;
+    for (size_t i = 1; i < _count; i++) {
+      if (_stripes[i].stats().contended_count() >
+          _stripes[best].stats().contended_count())
+        best = i;
+    }
+
+    return best;
+  }
+
+protected:
+  std::vector<Stripe *> collect(std::initializer_list<size_t> idx) {
+    return sorted_unique(std::vector<size_t>(idx));
+  }
+
+  template <typename It>
+  std::vector<Stripe *> collect_range(It first, It last) {
+    std::vector<size_t> idx;
+    for (; first != last; ++first)
+      idx.push_back(stripe_of(*first));
+    return sorted_unique(std::move(idx));
+  }
+
+  std::vector<Stripe *> sorted_unique(std::vector<size_t> idx) {
+    std::sort(idx.begin(), idx.end());
+    idx.erase(std::unique(idx.begin(), idx.end()), idx.end());
+    std::vector<Stripe *> stripes;
+    stripes.reserve(idx.size());
+    for (size_t i : idx)
+      stripes.push_back(&_stripes[i]);
+    return stripes;
+  }
+
+  size_t _count;
+  unsigned _shift; // 64 - log2(_count)
+  std::unique_ptr<Stripe[]> _stripes;
+};
+} // namespace utils
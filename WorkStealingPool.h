@@ -0,0 +1,350 @@
+#pragma once
+#include "Futex.h"
+#include "SpinMutex.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace utils {
+// Chase-Lev deque (Le et al., "Correct and Efficient Work-Stealing for Weak
+// Memory Models"). push()/take() may only be called by the owner thread,
+// steal() by any thread.
+template <typename T> class ChaseLevDeque {
+  static_assert(std::is_trivially_copyable<T>::value,
+                "ChaseLevDeque elements must be trivially copyable");
+
+public:
+  explicit ChaseLevDeque(int64_t capacity = 256)
+      : _array(new Array(capacity)) {}
+  ChaseLevDeque(const ChaseLevDeque &) = delete;
+  ChaseLevDeque &operator=(const ChaseLevDeque &) = delete;
+
+  ~ChaseLevDeque() {
+    delete _array.load(std::memory_order_relaxed);
+    for (Array *a : _retired)
+      delete a;
+  }
+
+  inline void push(T x) noexcept {
+    int64_t b = _bottom.load(std::memory_order_relaxed);
+    int64_t t = _top.load(std::memory_order_acquire);
+    Array *a = _array.load(std::memory_order_relaxed);
+    if (b - t > a->_capacity - 1)
+      a = grow(a, b, t);
+
+    a->put(b, x);
+    _bottom.store(b + 1, std::memory_order_release);
+  }
+
+  inline bool take(T &x) noexcept {
+    int64_t b = _bottom.load(std::memory_order_relaxed) - 1;
+    Array *a = _array.load(std::memory_order_relaxed);
+    _bottom.store(b, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t t = _top.load(std::memory_order_relaxed);
+    if (t > b) {
+      _bottom.store(b + 1, std::memory_order_relaxed);
+      return false;
+    }
+
+    x = a->get(b);
+    if (t == b) {
+      bool won = _top.compare_exchange_strong(
+          t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+      _bottom.store(b + 1, std::memory_order_relaxed);
+      return won;
+    }
+
+    return true;
+  }
+
+  inline bool steal(T &x) noexcept {
+    int64_t t = _top.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t b = _bottom.load(std::memory_order_acquire);
+    if (t >= b)
+      return false;
+
+    Array *a = _array.load(std::memory_order_acquire);
+    x = a->get(t);
+    return _top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                        std::memory_order_relaxed);
+  }
+
+  inline bool empty() const noexcept {
+    return _top.load(std::memory_order_relaxed) >=
+           _bottom.load(std::memory_order_relaxed);
+  }
+
+protected:
+  struct Array {
+    explicit Array(int64_t capacity)
+        : _capacity(capacity), _mask(capacity - 1),
+          _buf(new std::atomic<T>[capacity]) {}
+
+    inline void put(int64_t i, T x) noexcept {
+      _buf[i & _mask].store(x, std::memory_order_relaxed);
+    }
+
+    inline T get(int64_t i) const noexcept {
+      return _buf[i & _mask].load(std::memory_order_relaxed);
+    }
+
+    int64_t _capacity;
+    int64_t _mask;
+    std::unique_ptr<std::atomic<T>[]> _buf;
+  };
+
+  // Stealers may still read the old array, so it is kept until destruction.
+  Array *grow(Array *a, int64_t b, int64_t t) {
+    Array *na = new Array(a->_capacity * 2);
+    for (int64_t i = t; i < b; i++)
+      na->put(i, a->get(i));
+
+    _retired.push_back(a);
+    _array.store(na, std::memory_order_release);
+    return na;
+  }
+
+  alignas(64) std::atomic<int64_t> _top{0};
+  alignas(64) std::atomic<int64_t> _bottom{0};
+  std::atomic<Array *> _array;
+  std::vector<Array *> _retired;
+};
+
+// Fork-join pool: every worker owns a ChaseLevDeque, idle workers steal from
+// random victims, spin for a while and then park on a futex word.
+class WorkStealingPool {
+public:
+  static constexpr uint32_t SPIN_ROUNDS = 64;
+
+  explicit WorkStealingPool(uint32_t threads = 0)
+      : _slotToWorker(new int32_t[ThreadSlot::MAX_SLOTS]) {
+    if (threads == 0)
+      threads = std::max(1u, std::thread::hardware_concurrency());
+
+    for (uint32_t i = 0; i < ThreadSlot::MAX_SLOTS; i++)
+      _slotToWorker[i] = -1;
+
+    _count = threads;
+    _workers.reset(new Worker[threads]);
+    for (uint32_t i = 0; i < threads; i++)
+      _workers[i]._thread = create_thread([this, i] { run_worker(i); });
+  }
+
+  WorkStealingPool(const WorkStealingPool &) = delete;
+  WorkStealingPool &operator=(const WorkStealingPool &) = delete;
+
+  ~WorkStealingPool() {
+    _stop.store(true, std::memory_order_release);
+    _epoch.fetch_add(1, std::memory_order_release);
+    futex_wake(_epoch, INT32_MAX);
+    for (uint32_t i = 0; i < _count; i++)
+      _workers[i]._thread.join();
+  }
+
+  template <typename F> void submit(F &&f) {
+    push(new FuncTask<std::decay_t<F>>(std::forward<F>(f)));
+  }
+
+  // Calls f(i) for every i in [begin, end). The range is split in halves down
+  // to grain, the calling thread executes and steals tasks until all are done.
+  template <typename F>
+  void parallel_for(size_t begin, size_t end, F &&f, size_t grain = 1) {
+    if (begin >= end)
+      return;
+
+    ForState<std::remove_reference_t<F>> state{this, &f, grain < 1 ? 1 : grain};
+    ForTask<std::remove_reference_t<F>> root(&state, begin, end);
+    root.run();
+
+    int32_t self = current_worker();
+    uint64_t rng = seed(self);
+    while (state._pending.load(std::memory_order_acquire) != 0) {
+      Task *t = find_task(self, rng);
+      if (t != nullptr) {
+        t->run();
+        delete t;
+      } else {
+        std::this_thread::yield();
+      }
+    }
+  }
+
+  inline uint32_t thread_count() const { return _count; }
+
+  // Index of the calling thread in this pool, or -1 for outside threads.
+  inline int32_t current_worker() const noexcept {
+    uint32_t slot = ThreadSlot::get();
+    return slot == ThreadSlot::INVALID_SLOT ? -1 : _slotToWorker[slot];
+  }
+
+protected:
+  struct Task {
+    virtual ~Task() = default;
+    virtual void run() noexcept = 0;
+  };
+
+  template <typename F> struct FuncTask : Task {
+    template <typename U> explicit FuncTask(U &&f) : _f(std::forward<U>(f)) {}
+    void run() noexcept override { _f(); }
+    F _f;
+  };
+
+  template <typename F> struct ForState {
+    ForState(WorkStealingPool *pool, F *f, size_t grain)
+        : _pool(pool), _f(f), _grain(grain) {}
+    WorkStealingPool *_pool;
+    F *_f;
+    size_t _grain;
+    std::atomic<size_t> _pending{1};
+  };
+
+  template <typename F> struct ForTask : Task {
+    ForTask(ForState<F> *state, size_t begin, size_t end)
+        : _state(state), _begin(begin), _end(end) {}
+
+    void run() noexcept override;
+
+    ForState<F> *_state;
+    size_t _begin;
+    size_t _end;
+  };
+
+  struct alignas(64) Worker {
+    ChaseLevDeque<Task *> _deque;
+    std::thread _thread;
+  };
+
+  inline void push(Task *t) {
+    int32_t self = current_worker();
+    if (self >= 0) {
+      _workers[self]._deque.push(t);
+    } else {
+      std::lock_guard<SpinMutex> guard(_injectMutex);
+      _injectQueue.push_back(t);
+      _injectSize.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    wake_one();
+  }
+
+  inline void wake_one() noexcept {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (_sleepers.load(std::memory_order_relaxed) > 0) {
+      _epoch.fetch_add(1, std::memory_order_release);
+      futex_wake(_epoch, 1);
+    }
+  }
+
+  inline uint64_t seed(int32_t self) const noexcept {
+    return 0x9E3779B97F4A7C15ull * (uint64_t)(self + 2) ^ (uint64_t)this;
+  }
+
+  Task *find_task(int32_t self, uint64_t &rng) {
+    Task *t = nullptr;
+    if (self >= 0 && _workers[self]._deque.take(t))
+      return t;
+
+    if (_injectSize.load(std::memory_order_relaxed) > 0) {
+      std::lock_guard<SpinMutex> guard(_injectMutex);
+      if (!_injectQueue.empty()) {
+        t = _injectQueue.front();
+        _injectQueue.pop_front();
+        _injectSize.fetch_sub(1, std::memory_order_relaxed);
+        return t;
+      }
+    }
+
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    uint32_t start = (uint32_t)(rng % _count);
+    for (uint32_t i = 0; i < _count; i++) {
+      uint32_t victim = (start + i) % _count;
+      if ((int32_t)victim != self && _workers[victim]._deque.steal(t))
+        return t;
+    }
+
+    return nullptr;
+  }
+
+  void run_worker(uint32_t idx) {
+    uint32_t slot = ThreadSlot::get();
+    if (slot != ThreadSlot::INVALID_SLOT)
+      _slotToWorker[slot] = (int32_t)idx;
+
+    int32_t self = current_worker();
+    uint64_t rng = seed(self);
+    uint32_t spins = 0;
+    while (true) {
+      Task *t = find_task(self, rng);
+      if (t != nullptr) {
+        t->run();
+        delete t;
+        spins = 0;
+        continue;
+      }
+
+      if (_stop.load(std::memory_order_acquire))
+        break;
+
+      if (++spins < SPIN_ROUNDS) {
+        std::this_thread::yield();
+        continue;
+      }
+
+      uint32_t epoch = _epoch.load(std::memory_order_acquire);
+      _sleepers.fetch_add(1, std::memory_order_seq_cst);
+      t = find_task(self, rng);
+      if (t != nullptr) {
+        _sleepers.fetch_sub(1, std::memory_order_relaxed);
+        t->run();
+        delete t;
+        spins = 0;
+        continue;
+      }
+
+      if (!_stop.load(std::memory_order_acquire))
+        futex_wait(_epoch, epoch);
+      _sleepers.fetch_sub(1, std::memory_order_relaxed);
+      spins = 0;
+    }
+
+    if (slot != ThreadSlot::INVALID_SLOT)
+      _slotToWorker[slot] = -1;
+  }
+
+  std::unique_ptr<Worker[]> _workers;
+  uint32_t _count = 0;
+  std::unique_ptr<int32_t[]> _slotToWorker;
+  SpinMutex _injectMutex;
+  std::deque<Task *> _injectQueue;
+  std::atomic<size_t> _injectSize{0};
+  alignas(64) std::atomic<uint32_t> _epoch{0};
+  std::atomic<uint32_t> _sleepers{0};
+  std::atomic<bool> _stop{false};
+};
+
+template <typename F>
+void WorkStealingPool::ForTask<F>::run() noexcept {
+  while (_end - _begin > _state->_grain) {
+    size_t mid = _begin + (_end - _begin) / 2;
+    _state->_pending.fetch_add(1, std::memory_order_relaxed);
+    _state->_pool->push(new ForTask(_state, mid, _end));
+    _end = mid;
+  }
+
+  for (size_t i = _begin; i < _end; i++)
+    (*_state->_f)(i);
+
+  _state->_pending.fetch_sub(1, std::memory_order_acq_rel);
+}
+} // namespace utils
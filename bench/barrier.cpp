@@ -0,0 +1,72 @@
+// Barrier episodes per second against the number of threads for
+// SpinBarrier, HybridBarrier, TreeBarrier and std::barrier (C++20).
+// g++ -std=c++20 -O2 -pthread -I.. barrier.cpp -o barrier_bench
+#include "SpinBarrier.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <thread>
+#include <vector>
+#if __has_include(<barrier>)
+#include <barrier>
+#endif
+
+using namespace utils;
+using Clock = std::chrono::steady_clock;
+
+static constexpr int EPISODES = 10000;
+
+template <typename Barrier> struct Central {
+  explicit Central(int threads) : _barrier(threads) {}
+  void wait(int) { _barrier.arrive_and_wait(); }
+  Barrier _barrier;
+};
+
+struct Tree {
+  explicit Tree(int threads) : _barrier(threads) {}
+  void wait(int id) { _barrier.arrive_and_wait(id); }
+  TreeBarrier<> _barrier;
+};
+
+#if defined(__cpp_lib_barrier)
+struct Std {
+  explicit Std(int threads) : _barrier(threads) {}
+  void wait(int) { _barrier.arrive_and_wait(); }
+  std::barrier<> _barrier;
+};
+#endif
+
+template <typename B> static double episodes_per_sec(int threads) {
+  B barrier(threads);
+  std::vector<std::thread> ts;
+  auto start = Clock::now();
+  for (int t = 0; t < threads; t++) {
+    ts.emplace_back([&, t] {
+      for (int i = 0; i < EPISODES; i++)
+        barrier.wait(t);
+    });
+  }
+  for (auto &t : ts)
+    t.join();
+  return EPISODES /
+         std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+int main() {
+  unsigned hw = std::max(1u, std::thread::hardware_concurrency());
+  std::printf("%u CPUs\n%8s %14s %14s %14s %14s\n", hw, "threads",
+              "SpinBarrier", "HybridBarrier", "TreeBarrier", "std::barrier");
+  for (int threads = 1; threads <= 2 * (int)hw || threads <= 4;
+       threads *= 2) {
+    std::printf("%8d %14.0f %14.0f %14.0f", threads,
+                episodes_per_sec<Central<SpinBarrier<>>>(threads),
+                episodes_per_sec<Central<HybridBarrier<>>>(threads),
+                episodes_per_sec<Tree>(threads));
+#if defined(__cpp_lib_barrier)
+    std::printf(" %14.0f\n", episodes_per_sec<Std>(threads));
+#else
+    std::printf(" %14s\n", "-");
+#endif
+  }
+  return 0;
+}
@@ -0,0 +1,134 @@
+// Mixed partition scans and row updates on a table -> partition -> row
+// hierarchy, locked with IntentionLock (S on the partition, X on the row
+// under IS/IX) or with one coarse SharedSpinMutex. Prints updates and scans
+// per second for several scan ratios and thread counts.
+// g++ -std=c++17 -O2 -pthread -I.. intention_lock.cpp -o intention_bench
+#include "IntentionLock.h"
+#include "SpinMutex.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <shared_mutex>
+#include <thread>
+#include <vector>
+
+using namespace utils;
+using Clock = std::chrono::steady_clock;
+
+static constexpr uint32_t PARTITIONS = 16;
+static constexpr uint32_t ROWS = 256;
+static constexpr auto DURATION = std::chrono::milliseconds(200);
+
+struct Table {
+  struct Partition {
+    IntentionLock lock;
+    IntentionLock rows[ROWS];
+    uint64_t values[ROWS] = {};
+  };
+
+  IntentionLock lock;
+  SharedSpinMutex coarse;
+  std::unique_ptr<Partition[]> parts{new Partition[PARTITIONS]};
+};
+
+struct Intention {
+  static constexpr const char *NAME = "IntentionLock";
+
+  static void update(Table &t, uint32_t p, uint32_t r) {
+    Table::Partition &part = t.parts[p];
+    HierarchyLockGuard<> guard({&t.lock, &part.lock, &part.rows[r]},
+                               IntentionMode::X);
+    part.values[r]++;
+  }
+
+  static uint64_t scan(Table &t, uint32_t p) {
+    Table::Partition &part = t.parts[p];
+    HierarchyLockGuard<> guard({&t.lock, &part.lock}, IntentionMode::S);
+    uint64_t sum = 0;
+    for (uint32_t r = 0; r < ROWS; r++)
+      sum += part.values[r];
+    return sum;
+  }
+};
+
+struct Coarse {
+  static constexpr const char *NAME = "SharedSpinMutex";
+
+  static void update(Table &t, uint32_t p, uint32_t r) {
+    std::lock_guard<SharedSpinMutex> guard(t.coarse);
+    t.parts[p].values[r]++;
+  }
+
+  static uint64_t scan(Table &t, uint32_t p) {
+    std::shared_lock<SharedSpinMutex> guard(t.coarse);
+    uint64_t sum = 0;
+    for (uint32_t r = 0; r < ROWS; r++)
+      sum += t.parts[p].values[r];
+    return sum;
+  }
+};
+
+struct Result {
+  double updates, scans;
+};
+
+// scanPct of the operations scan a random partition, the others update a
+// random row.
+template <typename Locking> static Result run(int threads, uint32_t scanPct) {
+  Table table;
+  std::atomic<bool> stop{false};
+  std::atomic<uint64_t> updates{0}, scans{0}, sink{0};
+  std::vector<std::thread> ts;
+  for (int t = 0; t < threads; t++) {
+    ts.emplace_back([&, t] {
+      std::mt19937 rng(t + 1);
+      uint64_t u = 0, s = 0, sum = 0;
+      while (!stop.load(std::memory_order_relaxed)) {
+        uint32_t x = rng();
+        uint32_t p = x % PARTITIONS;
+        if ((x >> 8) % 100 < scanPct) {
+          sum += Locking::scan(table, p);
+          s++;
+        } else {
+          Locking::update(table, p, (x >> 16) % ROWS);
+          u++;
+        }
+      }
+      updates += u;
+      scans += s;
+      sink += sum;
+    });
+  }
+  auto start = Clock::now();
+  std::this_thread::sleep_for(DURATION);
+  stop = true;
+  for (auto &t : ts)
+    t.join();
+  double secs = std::chrono::duration<double>(Clock::now() - start).count();
+  return Result{updates / secs, scans / secs};
+}
+
+template <typename Locking> static void report(int threads, uint32_t pct) {
+  Result r = run<Locking>(threads, pct);
+  std::printf("%8d %6u%% %16s %14.0f %14.0f\n", threads, pct, Locking::NAME,
+              r.updates, r.scans);
+}
+
+int main() {
+  unsigned hw = std::max(1u, std::thread::hardware_concurrency());
+  std::printf("%u CPUs, %u partitions of %u rows\n", hw, PARTITIONS, ROWS);
+  std::printf("%8s %7s %16s %14s %14s\n", "threads", "scans", "locking",
+              "updates/s", "scans/s");
+  for (int threads = 1; threads <= 2 * (int)hw || threads <= 4;
+       threads *= 2) {
+    for (uint32_t pct : {1u, 10u, 50u}) {
+      report<Intention>(threads, pct);
+      report<Coarse>(threads, pct);
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,140 @@
+// ObjectPool against plain new/delete and a free list behind one SpinMutex:
+// each thread allocates a batch of objects and frees it again, or frees the
+// batches of the thread next to it, handed over through a slot.
+// g++ -std=c++17 -O2 -pthread -I.. object_pool.cpp -o object_pool_bench
+#include "ObjectPool.h"
+#include "SpinMutex.h"
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <vector>
+
+using namespace utils;
+using Clock = std::chrono::steady_clock;
+
+struct Item {
+  uint64_t value[8];
+};
+
+static constexpr int ROUNDS = 50000;
+static constexpr int BATCH = 32;
+
+struct NewDelete {
+  static constexpr const char *NAME = "new/delete";
+  void *allocate() { return ::operator new(sizeof(Item)); }
+  void deallocate(void *p) { ::operator delete(p); }
+};
+
+// One free list shared by all threads, locked on every call.
+struct LockedFreeList {
+  static constexpr const char *NAME = "SpinMutex free list";
+  struct Node {
+    Node *next;
+  };
+
+  ~LockedFreeList() {
+    while (_head != nullptr) {
+      Node *n = _head;
+      _head = n->next;
+      ::operator delete(n);
+    }
+  }
+
+  void *allocate() {
+    {
+      std::lock_guard<SpinMutex> guard(_mutex);
+      if (Node *n = _head) {
+        _head = n->next;
+        return n;
+      }
+    }
+    return ::operator new(sizeof(Item));
+  }
+
+  void deallocate(void *p) {
+    Node *n = (Node *)p;
+    std::lock_guard<SpinMutex> guard(_mutex);
+    n->next = _head;
+    _head = n;
+  }
+
+  SpinMutex _mutex;
+  Node *_head = nullptr;
+};
+
+struct Pool {
+  static constexpr const char *NAME = "ObjectPool";
+  void *allocate() { return _pool.allocate(); }
+  void deallocate(void *p) { _pool.deallocate(p); }
+  ObjectPool<Item> _pool;
+};
+
+// Operations (allocations plus frees) per second. With cross, thread t
+// frees the batches that thread t + 1 leaves in its slot.
+template <typename Allocator> static double run(int threads, bool cross) {
+  Allocator alloc;
+  // Two batches per thread, outliving the threads as the last one handed
+  // over is still being freed by the neighbour.
+  std::vector<std::vector<void *>> batches(2 * threads,
+                                           std::vector<void *>(BATCH));
+  std::vector<std::atomic<void **>> slots(threads);
+  for (auto &s : slots)
+    s.store(nullptr);
+  std::vector<std::thread> ts;
+  auto start = Clock::now();
+  for (int t = 0; t < threads; t++) {
+    ts.emplace_back([&, t] {
+      std::atomic<void **> &mine = slots[t];
+      std::atomic<void **> &next = slots[(t + 1) % threads];
+      for (int r = 0; r < ROUNDS; r++) {
+        void **batch = batches[2 * t + (r & 1)].data();
+        if (!cross) {
+          for (int i = 0; i < BATCH; i++)
+            batch[i] = alloc.allocate();
+          for (int i = 0; i < BATCH; i++)
+            alloc.deallocate(batch[i]);
+          continue;
+        }
+
+        // Once the neighbour took the last batch it is done with the one
+        // before, whose array is refilled and handed over. Then free what
+        // the next thread handed over.
+        while (mine.load(std::memory_order_acquire) != nullptr)
+          std::this_thread::yield();
+        for (int i = 0; i < BATCH; i++)
+          batch[i] = alloc.allocate();
+        mine.store(batch, std::memory_order_release);
+        void **theirs;
+        while ((theirs = next.exchange(nullptr,
+                                       std::memory_order_acq_rel)) == nullptr)
+          std::this_thread::yield();
+        for (int i = 0; i < BATCH; i++)
+          alloc.deallocate(theirs[i]);
+      }
+    });
+  }
+  for (auto &t : ts)
+    t.join();
+  double s = std::chrono::duration<double>(Clock::now() - start).count();
+  return 2.0 * threads * ROUNDS * BATCH / s;
+}
+
+template <typename Allocator> static void report(int threads) {
+  std::printf("%8d %22s %14.0f %14.0f\n", threads, Allocator::NAME,
+              run<Allocator>(threads, false), run<Allocator>(threads, true));
+}
+
+int main() {
+  unsigned hw = std::thread::hardware_concurrency();
+  std::printf("%8s %22s %14s %14s\n", "threads", "allocator", "local ops/s",
+              "cross ops/s");
+  for (int threads = 1; threads <= (int)(hw < 2 ? 2 : hw) * 2; threads *= 2) {
+    report<NewDelete>(threads);
+    report<LockedFreeList>(threads);
+    report<Pool>(threads);
+  }
+  return 0;
+}
@@ -0,0 +1,82 @@
+// RangeLock cost against the number of requests already in the lock, and
+// throughput of threads locking disjoint or overlapping ranges.
+// g++ -std=c++17 -O2 -pthread -I.. range_lock.cpp -o range_lock_bench
+#include "RangeLock.h"
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <random>
+#include <thread>
+#include <vector>
+
+using namespace utils;
+using Clock = std::chrono::steady_clock;
+
+// ns per lock/unlock of a free range while `held` disjoint ranges stay held.
+static double cost_with_held(uint32_t held) {
+  RangeLock lock;
+  std::vector<std::unique_ptr<RangeLock::Request>> reqs;
+  for (uint32_t i = 0; i < held; i++) {
+    reqs.emplace_back(new RangeLock::Request);
+    lock.lock(*reqs.back(), 2 * i, 2 * i + 1);
+  }
+  constexpr int ROUNDS = 200000;
+  std::mt19937 rng(1);
+  auto start = Clock::now();
+  for (int i = 0; i < ROUNDS; i++) {
+    uint64_t k = held == 0 ? 0 : rng() % held;
+    RangeLock::Request req;
+    lock.lock(req, 2 * k + 1, 2 * k + 2);
+    lock.unlock(req);
+  }
+  double ns = std::chrono::duration<double, std::nano>(Clock::now() - start)
+                  .count();
+  for (auto &r : reqs)
+    lock.unlock(*r);
+  return ns / ROUNDS;
+}
+
+// Operations per second with each thread locking ranges of `width` slots
+// inside its own stripe (disjoint) or anywhere in a shared area (overlap).
+static double throughput(int threads, bool disjoint, uint32_t width) {
+  constexpr int OPS = 200000;
+  constexpr uint64_t AREA = 4096;
+  RangeLock lock;
+  std::vector<std::thread> ts;
+  auto start = Clock::now();
+  for (int t = 0; t < threads; t++) {
+    ts.emplace_back([&, t] {
+      std::mt19937 rng(t);
+      uint64_t base = disjoint ? t * AREA : 0;
+      for (int i = 0; i < OPS; i++) {
+        uint64_t begin = base + rng() % (AREA - width);
+        RangeLock::Request req;
+        if (i % 4 == 0)
+          lock.lock(req, begin, begin + width);
+        else
+          lock.lock_shared(req, begin, begin + width);
+        lock.unlock(req);
+      }
+    });
+  }
+  for (auto &t : ts)
+    t.join();
+  double s = std::chrono::duration<double>(Clock::now() - start).count();
+  return threads * OPS / s;
+}
+
+int main() {
+  std::printf("%10s %12s\n", "held", "ns/op");
+  for (uint32_t held : {0u, 10u, 100u, 1000u, 10000u, 100000u})
+    std::printf("%10u %12.1f\n", held, cost_with_held(held));
+
+  unsigned hw = std::thread::hardware_concurrency();
+  std::printf("\n%8s %10s %14s\n", "threads", "ranges", "ops/s");
+  for (int threads = 1; threads <= (int)(hw < 2 ? 2 : hw); threads *= 2) {
+    std::printf("%8d %10s %14.0f\n", threads, "disjoint",
+                throughput(threads, true, 16));
+    std::printf("%8d %10s %14.0f\n", threads, "overlap",
+                throughput(threads, false, 16));
+  }
+  return 0;
+}
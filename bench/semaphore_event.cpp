@@ -0,0 +1,140 @@
+// Handoff latency of SpinSemaphore and SpinEvent against
+// std::counting_semaphore and a std::condition_variable event: pairs of
+// threads ping-pong a signal, with fewer threads than CPUs (under) and more
+// (over). Prints the p50 and p99 of one handoff, half a round trip.
+// g++ -std=c++20 -O2 -pthread -I.. semaphore_event.cpp -o semaphore_bench
+#include "SpinEvent.h"
+#include "SpinSemaphore.h"
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#if __has_include(<semaphore>)
+#include <semaphore>
+#endif
+
+using namespace utils;
+using Clock = std::chrono::steady_clock;
+
+static constexpr int ROUNDS = 20000;
+
+struct SpinSem {
+  static constexpr const char *NAME = "SpinSemaphore";
+  void post() { _sem.release(); }
+  void wait() { _sem.acquire(); }
+  SpinSemaphore _sem;
+};
+
+struct SpinEv {
+  static constexpr const char *NAME = "SpinEvent";
+  void post() { _event.set(); }
+  void wait() { _event.wait(); }
+  SpinEvent _event{true};
+};
+
+#if defined(__cpp_lib_semaphore)
+struct StdSem {
+  static constexpr const char *NAME = "std::counting_semaphore";
+  void post() { _sem.release(); }
+  void wait() { _sem.acquire(); }
+  std::counting_semaphore<> _sem{0};
+};
+#endif
+
+// Auto reset event on std::mutex and std::condition_variable.
+struct CvEvent {
+  static constexpr const char *NAME = "std::condition_variable";
+  void post() {
+    {
+      std::lock_guard<std::mutex> guard(_mutex);
+      _set = true;
+    }
+    _cv.notify_one();
+  }
+
+  void wait() {
+    std::unique_lock<std::mutex> guard(_mutex);
+    _cv.wait(guard, [this] { return _set; });
+    _set = false;
+  }
+
+  std::mutex _mutex;
+  std::condition_variable _cv;
+  bool _set = false;
+};
+
+struct Latency {
+  double p50, p99;
+};
+
+// Each pair: the pinger posts to the ponger and waits for the answer, timing
+// every round trip.
+template <typename Signal> static Latency run(int pairs) {
+  std::vector<std::unique_ptr<Signal>> signals;
+  for (int i = 0; i < 2 * pairs; i++)
+    signals.emplace_back(new Signal);
+  std::vector<std::vector<double>> samples(pairs);
+  std::vector<std::thread> ts;
+  for (int p = 0; p < pairs; p++) {
+    Signal &ping = *signals[2 * p];
+    Signal &pong = *signals[2 * p + 1];
+    ts.emplace_back([&ping, &pong] {
+      for (int i = 0; i < ROUNDS; i++) {
+        ping.wait();
+        pong.post();
+      }
+    });
+    ts.emplace_back([&ping, &pong, &out = samples[p]] {
+      out.reserve(ROUNDS);
+      for (int i = 0; i < ROUNDS; i++) {
+        auto start = Clock::now();
+        ping.post();
+        pong.wait();
+        out.push_back(
+            std::chrono::duration<double, std::nano>(Clock::now() - start)
+                .count() /
+            2);
+      }
+    });
+  }
+  for (auto &t : ts)
+    t.join();
+
+  std::vector<double> all;
+  for (auto &s : samples)
+    all.insert(all.end(), s.begin(), s.end());
+  std::sort(all.begin(), all.end());
+  return Latency{all[all.size() / 2], all[all.size() * 99 / 100]};
+}
+
+template <typename Signal> static void report(int pairs, unsigned cpus) {
+  Latency l = run<Signal>(pairs);
+  std::printf("%8d %6s %26s %12.0f %12.0f\n", 2 * pairs,
+              2 * pairs <= (int)cpus ? "under" : "over", Signal::NAME, l.p50,
+              l.p99);
+}
+
+int main() {
+  unsigned hw = std::max(1u, std::thread::hardware_concurrency());
+  std::vector<int> pairsList = {1};
+  for (int p : {(int)hw / 2, (int)hw, 2 * (int)hw}) {
+    if (p > pairsList.back())
+      pairsList.push_back(p);
+  }
+
+  std::printf("%u CPUs\n%8s %6s %26s %12s %12s\n", hw, "threads", "load",
+              "signal", "p50 ns", "p99 ns");
+  for (int pairs : pairsList) {
+    report<SpinSem>(pairs, hw);
+#if defined(__cpp_lib_semaphore)
+    report<StdSem>(pairs, hw);
+#endif
+    report<SpinEv>(pairs, hw);
+    report<CvEvent>(pairs, hw);
+  }
+  return 0;
+}
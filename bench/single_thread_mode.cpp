@@ -0,0 +1,90 @@
+// Uncontended lock / unlock cost of the spin locks on one thread, with
+// SingleThreadMode off (atomic read-modify-writes) and on (plain loads and
+// stores), next to std::mutex. Prints ns per operation.
+// g++ -std=c++17 -O2 -pthread -I.. single_thread_mode.cpp -o single_bench
+#ifndef NDEBUG
+#define NDEBUG // owner tracking of the compact locks is debug-only
+#endif
+#define SPIN_MUTEX_SINGLE_THREAD_MODE 1
+#include "SpinMutex.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <mutex>
+
+using namespace utils;
+using Clock = std::chrono::steady_clock;
+
+static constexpr int OPS = 10000000;
+
+// Best of a few runs, to keep scheduling noise out of the comparison.
+template <typename F> static double best_ns(F f) {
+  double best = 1e300;
+  for (int run = 0; run < 5; run++) {
+    auto start = Clock::now();
+    f();
+    double ns = std::chrono::duration<double, std::nano>(Clock::now() - start)
+                    .count();
+    best = std::min(best, ns / OPS);
+  }
+  return best;
+}
+
+template <typename Mutex> static double lock_unlock() {
+  Mutex m;
+  return best_ns([&] {
+    for (int i = 0; i < OPS; i++) {
+      std::lock_guard<Mutex> guard(m);
+      asm volatile("" ::: "memory");
+    }
+  });
+}
+
+template <typename Mutex> static double shared_unlock() {
+  Mutex m;
+  return best_ns([&] {
+    for (int i = 0; i < OPS; i++) {
+      m.lock_shared();
+      asm volatile("" ::: "memory");
+      m.unlock_shared();
+    }
+  });
+}
+
+struct Row {
+  const char *name;
+  double (*measure)();
+};
+
+static const Row ROWS[] = {
+    {"SpinMutex lock/unlock", lock_unlock<SpinMutex>},
+    {"SharedSpinMutex lock/unlock", lock_unlock<SharedSpinMutex>},
+    {"SharedSpinMutex lock_shared/unlock", shared_unlock<SharedSpinMutex>},
+    {"ReentrantSpinMutex lock/unlock", lock_unlock<ReentrantSpinMutex>},
+    {"CompactSpinMutex lock/unlock", lock_unlock<CompactSpinMutex>},
+    {"CompactParkSpinMutex lock/unlock", lock_unlock<CompactParkSpinMutex>},
+};
+
+int main() {
+  constexpr size_t N = sizeof(ROWS) / sizeof(ROWS[0]);
+  // The mode can only be entered while the process has one thread and is
+  // not left again without starting one, so every lock is measured off
+  // first.
+  double off[N], on[N];
+  for (size_t i = 0; i < N; i++)
+    off[i] = ROWS[i].measure();
+  double stdMutex = lock_unlock<std::mutex>();
+  SingleThreadMode::enable();
+  for (size_t i = 0; i < N; i++)
+    on[i] = ROWS[i].measure();
+
+  std::printf("%-36s %10s %10s %8s\n", "ns/op", "mode off", "mode on",
+              "ratio");
+  for (size_t i = 0; i < N; i++)
+    std::printf("%-36s %10.2f %10.2f %8.2f\n", ROWS[i].name, off[i], on[i],
+                on[i] / off[i]);
+  std::printf("%-36s %10.2f %10s %8s\n", "std::mutex lock/unlock", stdMutex,
+              "-", "-");
+  std::printf("\nratio: mode on / mode off, below 1 is faster\n");
+  return 0;
+}
@@ -0,0 +1,114 @@
+// Oversubscription: many more threads than CPUs contend on a few spin
+// mutexes next to one unrelated worker per CPU, with the SpinnerBudget off,
+// at its default and at one spinner. Prints lock operations and worker
+// iterations per second.
+// g++ -std=c++17 -O2 -pthread -I.. spinner_budget.cpp -o spinner_budget_bench
+#include "SpinMutex.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace utils;
+using Clock = std::chrono::steady_clock;
+
+static constexpr int LOCKS = 4;
+static constexpr auto DURATION = std::chrono::milliseconds(300);
+
+using ExpSpinMutex = BasicSpinMutex<ExclusiveMode, NonReentrant,
+                                    ExponentialBackoff, SpinWait>;
+using ExpParkMutex = BasicSpinMutex<ExclusiveMode, NonReentrant,
+                                    ExponentialBackoff, ParkWait>;
+
+struct Result {
+  double lockOps;
+  double work;
+};
+
+// A little arithmetic the optimizer cannot drop.
+static inline uint64_t churn(uint64_t x, int n) {
+  for (int i = 0; i < n; i++)
+    x = x * 6364136223846793005ull + 1442695040888963407ull;
+  return x;
+}
+
+template <typename Mutex> static Result run(int threads, unsigned cpus) {
+  struct alignas(64) Slot {
+    Mutex mutex;
+    uint64_t value = 0;
+  };
+  std::unique_ptr<Slot[]> slots(new Slot[LOCKS]);
+  std::atomic<bool> stop{false};
+  std::atomic<uint64_t> lockOps{0}, work{0};
+  std::vector<std::thread> ts;
+  for (int t = 0; t < threads; t++) {
+    ts.emplace_back([&, t] {
+      uint64_t ops = 0, x = t;
+      while (!stop.load(std::memory_order_relaxed)) {
+        Slot &s = slots[(x >> 33) % LOCKS];
+        {
+          std::lock_guard<Mutex> guard(s.mutex);
+          s.value = churn(s.value, 20);
+        }
+        x = churn(x, 50);
+        ops++;
+      }
+      lockOps += ops;
+    });
+  }
+  for (unsigned c = 0; c < cpus; c++) {
+    ts.emplace_back([&, c] {
+      uint64_t n = 0, x = c;
+      while (!stop.load(std::memory_order_relaxed)) {
+        x = churn(x, 100);
+        n++;
+      }
+      work += n + (x == 42);
+    });
+  }
+
+  auto start = Clock::now();
+  std::this_thread::sleep_for(DURATION);
+  stop = true;
+  for (auto &t : ts)
+    t.join();
+  double s = std::chrono::duration<double>(Clock::now() - start).count();
+  return Result{lockOps / s, work / s};
+}
+
+template <typename Mutex>
+static void report(const char *mutex, int threads, unsigned cpus) {
+  struct Setting {
+    const char *name;
+    uint32_t budget;
+  };
+  const Setting settings[] = {{"off", 0},
+                              {"default", SpinnerBudget::default_budget()},
+                              {"1", 1}};
+  for (const Setting &s : settings) {
+    if (s.budget == 0)
+      SpinnerBudget::disable();
+    else
+      SpinnerBudget::enable(s.budget);
+    Result r = run<Mutex>(threads, cpus);
+    std::printf("%8d %14s %8s %14.0f %14.0f\n", threads, mutex, s.name,
+                r.lockOps, r.work);
+  }
+  SpinnerBudget::disable();
+}
+
+int main() {
+  unsigned hw = std::max(1u, std::thread::hardware_concurrency());
+  std::printf("%u CPUs, %d locks, %u worker threads\n", hw, LOCKS, hw);
+  std::printf("%8s %14s %8s %14s %14s\n", "threads", "mutex", "budget",
+              "lock ops/s", "work/s");
+  for (int threads : {(int)hw, 4 * (int)hw, std::max(16, 16 * (int)hw)}) {
+    report<ExpSpinMutex>("spin", threads, hw);
+    report<ExpParkMutex>("spin+park", threads, hw);
+  }
+  return 0;
+}
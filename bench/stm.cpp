@@ -0,0 +1,239 @@
+// Stm against coarse locking on two workloads: bank transfers that move
+// money between several random accounts, and a sorted linked list with
+// inserts, removes and lookups. Transfers are also run with one SpinMutex
+// per account taken in index order. Prints operations per second and, for
+// Stm, aborts per thousand commits.
+// g++ -std=c++17 -O2 -pthread -I.. stm.cpp -o stm_bench
+#include "SpinMutex.h"
+#include "Stm.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <vector>
+
+using namespace utils;
+using Clock = std::chrono::steady_clock;
+
+static constexpr uint32_t ACCOUNTS = 1024;
+static constexpr uint32_t KEYS = 256;
+static constexpr auto DURATION = std::chrono::milliseconds(200);
+
+struct Result {
+  double opsPerSec;
+  double abortsPerK;
+};
+
+struct Run {
+  uint64_t ops;
+  double secs;
+
+  Result result(uint64_t aborts = 0) const {
+    return Result{ops / secs, ops == 0 ? 0 : 1000.0 * aborts / ops};
+  }
+};
+
+// Runs op(rng) on every thread for DURATION.
+template <typename Op> static Run run(int threads, Op op) {
+  std::atomic<bool> stop{false};
+  std::atomic<uint64_t> total{0};
+  std::vector<std::thread> ts;
+  for (int t = 0; t < threads; t++) {
+    ts.emplace_back([&, t] {
+      std::mt19937 rng(t + 1);
+      uint64_t n = 0;
+      while (!stop.load(std::memory_order_relaxed)) {
+        op(rng);
+        n++;
+      }
+      total += n;
+    });
+  }
+  auto start = Clock::now();
+  std::this_thread::sleep_for(DURATION);
+  stop = true;
+  for (auto &t : ts)
+    t.join();
+  return Run{total.load(),
+             std::chrono::duration<double>(Clock::now() - start).count()};
+}
+
+// touched distinct accounts, the first pays one unit to each of the others.
+static void pick(std::mt19937 &rng, uint32_t touched, uint32_t *ids) {
+  for (uint32_t i = 0; i < touched; i++) {
+    do {
+      ids[i] = rng() % ACCOUNTS;
+    } while (std::find(ids, ids + i, ids[i]) != ids + i);
+  }
+}
+
+static Result bank_stm(int threads, uint32_t touched) {
+  Stm stm;
+  std::unique_ptr<TVar<int64_t>[]> accounts(new TVar<int64_t>[ACCOUNTS]);
+  Run r = run(threads, [&](std::mt19937 &rng) {
+    uint32_t ids[16];
+    pick(rng, touched, ids);
+    stm.atomically([&](StmTx &tx) {
+      for (uint32_t i = 1; i < touched; i++) {
+        tx.write(accounts[ids[0]], tx.read(accounts[ids[0]]) - 1);
+        tx.write(accounts[ids[i]], tx.read(accounts[ids[i]]) + 1);
+      }
+    });
+  });
+  int64_t sum = 0;
+  for (uint32_t i = 0; i < ACCOUNTS; i++)
+    sum += accounts[i].load();
+  if (sum != 0)
+    std::printf("bank_stm: money was created\n");
+  return r.result(stm.abort_count());
+}
+
+static Result bank_coarse(int threads, uint32_t touched) {
+  SpinMutex mutex;
+  std::unique_ptr<int64_t[]> accounts(new int64_t[ACCOUNTS]());
+  Run r = run(threads, [&](std::mt19937 &rng) {
+    uint32_t ids[16];
+    pick(rng, touched, ids);
+    std::lock_guard<SpinMutex> guard(mutex);
+    for (uint32_t i = 1; i < touched; i++) {
+      accounts[ids[0]]--;
+      accounts[ids[i]]++;
+    }
+  });
+  return r.result();
+}
+
+static Result bank_ordered(int threads, uint32_t touched) {
+  struct alignas(64) Account {
+    SpinMutex mutex;
+    int64_t balance = 0;
+  };
+  std::unique_ptr<Account[]> accounts(new Account[ACCOUNTS]);
+  Run r = run(threads, [&](std::mt19937 &rng) {
+    uint32_t ids[16], sorted[16];
+    pick(rng, touched, ids);
+    std::copy(ids, ids + touched, sorted);
+    std::sort(sorted, sorted + touched);
+    for (uint32_t i = 0; i < touched; i++)
+      accounts[sorted[i]].mutex.lock();
+    for (uint32_t i = 1; i < touched; i++) {
+      accounts[ids[0]].balance--;
+      accounts[ids[i]].balance++;
+    }
+    for (uint32_t i = touched; i > 0; i--)
+      accounts[sorted[i - 1]].mutex.unlock();
+  });
+  return r.result();
+}
+
+// Sorted list of keys below KEYS: 20% inserts, 20% removes, 60% lookups.
+// Removed nodes are only freed with the list, as readers may still be on
+// them.
+struct StmList {
+  struct Node {
+    uint32_t key;
+    TVar<Node *> next;
+  };
+
+  Stm stm;
+  TVar<Node *> head{nullptr};
+  std::vector<std::unique_ptr<Node>> nodes;
+  SpinMutex nodesMutex;
+
+  Node *new_node(uint32_t key) {
+    Node *n = new Node{key, TVar<Node *>(nullptr)};
+    std::lock_guard<SpinMutex> guard(nodesMutex);
+    nodes.emplace_back(n);
+    return n;
+  }
+
+  void op(std::mt19937 &rng) {
+    uint32_t x = rng(), key = x % KEYS, kind = (x >> 16) % 10;
+    Node *fresh = kind < 2 ? new_node(key) : nullptr;
+    stm.atomically([&](StmTx &tx) {
+      TVar<Node *> *prev = &head;
+      Node *cur = tx.read(*prev);
+      while (cur != nullptr && cur->key < key) {
+        prev = &cur->next;
+        cur = tx.read(*prev);
+      }
+      bool found = cur != nullptr && cur->key == key;
+      if (kind < 2 && !found) {
+        tx.write(fresh->next, cur);
+        tx.write(*prev, fresh);
+      } else if (kind >= 2 && kind < 4 && found) {
+        tx.write(*prev, tx.read(cur->next));
+      }
+    });
+  }
+};
+
+struct CoarseList {
+  struct Node {
+    uint32_t key;
+    Node *next;
+  };
+
+  SpinMutex mutex;
+  Node *head = nullptr;
+  std::vector<std::unique_ptr<Node>> nodes;
+
+  void op(std::mt19937 &rng) {
+    uint32_t x = rng(), key = x % KEYS, kind = (x >> 16) % 10;
+    std::lock_guard<SpinMutex> guard(mutex);
+    Node **prev = &head;
+    while (*prev != nullptr && (*prev)->key < key)
+      prev = &(*prev)->next;
+    bool found = *prev != nullptr && (*prev)->key == key;
+    if (kind < 2 && !found) {
+      nodes.emplace_back(new Node{key, *prev});
+      *prev = nodes.back().get();
+    } else if (kind >= 2 && kind < 4 && found) {
+      *prev = (*prev)->next;
+    }
+  }
+};
+
+static Result list_stm(int threads) {
+  StmList list;
+  Run r = run(threads, [&](std::mt19937 &rng) { list.op(rng); });
+  return r.result(list.stm.abort_count());
+}
+
+static Result list_coarse(int threads) {
+  CoarseList list;
+  return run(threads, [&](std::mt19937 &rng) { list.op(rng); }).result();
+}
+
+static void row(const char *workload, int threads, const char *locking,
+                const Result &r) {
+  std::printf("%-20s %8d %22s %14.0f", workload, threads, locking,
+              r.opsPerSec);
+  if (r.abortsPerK > 0)
+    std::printf(" %10.1f\n", r.abortsPerK);
+  else
+    std::printf(" %10s\n", "-");
+}
+
+int main() {
+  unsigned hw = std::max(1u, std::thread::hardware_concurrency());
+  std::printf("%u CPUs\n%-20s %8s %22s %14s %10s\n", hw, "workload",
+              "threads", "locking", "ops/s", "aborts/1k");
+  for (int threads = 1; threads <= 2 * (int)hw || threads <= 4;
+       threads *= 2) {
+    for (uint32_t touched : {2u, 4u, 10u}) {
+      char name[32];
+      std::snprintf(name, sizeof(name), "bank, %u accounts", touched);
+      row(name, threads, "Stm", bank_stm(threads, touched));
+      row(name, threads, "coarse SpinMutex", bank_coarse(threads, touched));
+      row(name, threads, "ordered SpinMutex", bank_ordered(threads, touched));
+    }
+    row("sorted list", threads, "Stm", list_stm(threads));
+    row("sorted list", threads, "coarse SpinMutex", list_coarse(threads));
+  }
+  return 0;
+}
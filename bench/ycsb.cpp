@@ -0,0 +1,288 @@
+// YCSB core workloads A-F over an in-memory table, with the table protected
+// by a global SharedSpinMutex, StripedLocks<SpinMutex>, one SpinMutex per
+// record or a global std::shared_mutex. Prints ops/s and latency percentiles
+// per workload, configuration and thread count.
+// g++ -std=c++17 -O2 -pthread -I.. ycsb.cpp -o ycsb_bench
+#include "SpinMutex.h"
+#include "StripedLocks.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <shared_mutex>
+#include <thread>
+#include <vector>
+
+using namespace utils;
+using Clock = std::chrono::steady_clock;
+
+static constexpr uint64_t RECORDS = 100000;
+static constexpr uint64_t CAPACITY = 2 * RECORDS;
+static constexpr uint32_t FIELDS = 8;
+static constexpr int OPS = 100000;
+static constexpr uint32_t MAX_SCAN = 100;
+
+struct Record {
+  uint64_t fields[FIELDS];
+};
+
+// Zipfian over [0, n) with YCSB's constant 0.99 (Gray et al., "Quickly
+// generating billion-record synthetic databases").
+class Zipfian {
+public:
+  explicit Zipfian(uint64_t n, double theta = 0.99) : _n(n), _theta(theta) {
+    double zeta2 = 0;
+    for (uint64_t i = 1; i <= 2; i++)
+      zeta2 += 1 / std::pow((double)i, theta);
+    for (uint64_t i = 1; i <= n; i++)
+      _zetan += 1 / std::pow((double)i, theta);
+    _alpha = 1 / (1 - theta);
+    _eta = (1 - std::pow(2.0 / n, 1 - theta)) / (1 - zeta2 / _zetan);
+  }
+
+  template <typename Rng> uint64_t next(Rng &rng) const {
+    double u = std::uniform_real_distribution<double>(0, 1)(rng);
+    double uz = u * _zetan;
+    if (uz < 1)
+      return 0;
+    if (uz < 1 + std::pow(0.5, _theta))
+      return 1;
+    uint64_t k = (uint64_t)(_n * std::pow(_eta * u - _eta + 1, _alpha));
+    return k < _n ? k : _n - 1;
+  }
+
+private:
+  uint64_t _n;
+  double _theta;
+  double _zetan = 0;
+  double _alpha;
+  double _eta;
+};
+
+// Spreads the popular ranks over the key space, like YCSB's
+// ScrambledZipfianGenerator, so that hot keys do not share a stripe.
+static inline uint64_t scramble(uint64_t rank, uint64_t n) {
+  uint64_t h = rank * 0x9E3779B97F4A7C15ull;
+  h ^= h >> 29;
+  return h % n;
+}
+
+// Record index of the n-th key; inserts past CAPACITY reuse the inserted
+// area so the loaded records stay.
+static inline uint64_t slot_of(uint64_t n) {
+  return n < CAPACITY ? n : RECORDS + n % RECORDS;
+}
+
+enum Op { READ, UPDATE, SCAN, INSERT, RMW };
+
+struct Workload {
+  const char *name;
+  // Percentages of read, update, scan, insert and read-modify-write.
+  uint32_t mix[5];
+  // Reads pick recently inserted keys instead of scrambled zipfian ones.
+  bool latest;
+};
+
+static const Workload WORKLOADS[] = {
+    {"A", {50, 50, 0, 0, 0}, false}, {"B", {95, 5, 0, 0, 0}, false},
+    {"C", {100, 0, 0, 0, 0}, false}, {"D", {95, 0, 0, 5, 0}, true},
+    {"E", {0, 0, 95, 5, 0}, false},  {"F", {50, 0, 0, 0, 50}, false},
+};
+
+// The table under each locking configuration. Scans lock one record at a
+// time, as YCSB scans do not need a snapshot.
+struct GlobalSharedSpin {
+  static constexpr const char *NAME = "SharedSpinMutex";
+  Record records[CAPACITY] = {};
+  SharedSpinMutex mutex;
+
+  uint64_t read(uint64_t k) {
+    std::shared_lock<SharedSpinMutex> guard(mutex);
+    return records[k].fields[0];
+  }
+
+  template <typename F> void write(uint64_t k, F f) {
+    std::lock_guard<SharedSpinMutex> guard(mutex);
+    f(records[k]);
+  }
+};
+
+struct Striped {
+  static constexpr const char *NAME = "striped SpinMutex";
+  Record records[CAPACITY] = {};
+  StripedLocks<SpinMutex, 64> locks;
+
+  uint64_t read(uint64_t k) {
+    auto guard = locks.lock_for(k);
+    return records[k].fields[0];
+  }
+
+  template <typename F> void write(uint64_t k, F f) {
+    auto guard = locks.lock_for(k);
+    f(records[k]);
+  }
+};
+
+struct PerRecord {
+  static constexpr const char *NAME = "per-record SpinMutex";
+  struct Slot {
+    SpinMutex mutex;
+    Record record = {};
+  };
+  Slot slots[CAPACITY];
+
+  uint64_t read(uint64_t k) {
+    std::lock_guard<SpinMutex> guard(slots[k].mutex);
+    return slots[k].record.fields[0];
+  }
+
+  template <typename F> void write(uint64_t k, F f) {
+    std::lock_guard<SpinMutex> guard(slots[k].mutex);
+    f(slots[k].record);
+  }
+};
+
+struct GlobalStdShared {
+  static constexpr const char *NAME = "std::shared_mutex";
+  Record records[CAPACITY] = {};
+  std::shared_mutex mutex;
+
+  uint64_t read(uint64_t k) {
+    std::shared_lock<std::shared_mutex> guard(mutex);
+    return records[k].fields[0];
+  }
+
+  template <typename F> void write(uint64_t k, F f) {
+    std::lock_guard<std::shared_mutex> guard(mutex);
+    f(records[k]);
+  }
+};
+
+struct Result {
+  double opsPerSec;
+  double p50, p99, p999;
+};
+
+static std::atomic<uint64_t> g_sink{0};
+
+// Runs OPS operations per thread after loading RECORDS records. Latencies
+// are in nanoseconds.
+template <typename Table>
+static Result run(const Workload &w, int threads, const Zipfian &zipf) {
+  std::unique_ptr<Table> table(new Table);
+  for (uint64_t k = 0; k < RECORDS; k++)
+    table->write(k, [k](Record &r) { r.fields[0] = k; });
+  std::atomic<uint64_t> inserted{RECORDS};
+
+  std::vector<std::vector<uint32_t>> latencies(threads);
+  std::vector<std::thread> ts;
+  std::atomic<int> ready{0};
+  std::atomic<bool> go{false};
+  Clock::time_point start;
+  for (int t = 0; t < threads; t++) {
+    ts.emplace_back([&, t] {
+      std::mt19937_64 rng(t + 1);
+      std::uniform_int_distribution<uint32_t> pct(0, 99);
+      std::uniform_int_distribution<uint32_t> scanLen(1, MAX_SCAN);
+      std::vector<uint32_t> &lat = latencies[t];
+      lat.reserve(OPS);
+      uint64_t sink = 0;
+      ready++;
+      while (!go.load(std::memory_order_acquire))
+        std::this_thread::yield();
+
+      for (int i = 0; i < OPS; i++) {
+        uint32_t p = pct(rng), op = 0;
+        while (p >= w.mix[op]) {
+          p -= w.mix[op];
+          op++;
+        }
+        uint64_t count = inserted.load(std::memory_order_relaxed);
+        uint64_t key;
+        if (w.latest) {
+          uint64_t back = zipf.next(rng);
+          key = slot_of(back < count ? count - 1 - back : 0);
+        } else {
+          key = scramble(zipf.next(rng), RECORDS);
+        }
+
+        auto begin = Clock::now();
+        switch (op) {
+        case READ:
+          sink += table->read(key);
+          break;
+        case UPDATE:
+          table->write(key, [i](Record &r) { r.fields[i % FIELDS] = i; });
+          break;
+        case SCAN:
+          for (uint32_t n = scanLen(rng); n > 0; n--)
+            sink += table->read(key++ % CAPACITY);
+          break;
+        case INSERT: {
+          uint64_t k =
+              slot_of(inserted.fetch_add(1, std::memory_order_relaxed));
+          table->write(k, [k](Record &r) {
+            for (uint32_t f = 0; f < FIELDS; f++)
+              r.fields[f] = k;
+          });
+          break;
+        }
+        case RMW:
+          table->write(key, [](Record &r) { r.fields[1] += r.fields[0]; });
+          break;
+        }
+        lat.push_back((uint32_t)std::min<int64_t>(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() -
+                                                                 begin)
+                .count(),
+            UINT32_MAX));
+      }
+      g_sink += sink;
+    });
+  }
+  while (ready.load() < threads)
+    std::this_thread::yield();
+  start = Clock::now();
+  go.store(true, std::memory_order_release);
+  for (auto &t : ts)
+    t.join();
+  double s = std::chrono::duration<double>(Clock::now() - start).count();
+
+  std::vector<uint32_t> all;
+  all.reserve((size_t)threads * OPS);
+  for (auto &lat : latencies)
+    all.insert(all.end(), lat.begin(), lat.end());
+  std::sort(all.begin(), all.end());
+  auto at = [&](double q) {
+    return (double)all[(size_t)(q * (all.size() - 1))];
+  };
+  return Result{threads * OPS / s, at(0.5), at(0.99), at(0.999)};
+}
+
+template <typename Table>
+static void report(const Workload &w, int threads, const Zipfian &zipf) {
+  Result r = run<Table>(w, threads, zipf);
+  std::printf("%8s %22s %8d %14.0f %10.0f %10.0f %10.0f\n", w.name,
+              Table::NAME, threads, r.opsPerSec, r.p50, r.p99, r.p999);
+}
+
+int main() {
+  Zipfian zipf(RECORDS);
+  unsigned hw = std::thread::hardware_concurrency();
+  int maxThreads = (int)(hw < 2 ? 2 : hw) * 2;
+  std::printf("%8s %22s %8s %14s %10s %10s %10s\n", "workload", "locking",
+              "threads", "ops/s", "p50 ns", "p99 ns", "p99.9 ns");
+  for (const Workload &w : WORKLOADS) {
+    for (int threads = 1; threads <= maxThreads; threads *= 2) {
+      report<GlobalSharedSpin>(w, threads, zipf);
+      report<Striped>(w, threads, zipf);
+      report<PerRecord>(w, threads, zipf);
+      report<GlobalStdShared>(w, threads, zipf);
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,20 @@
+#pragma once
+#include <cstdio>
+
+// Shared by the test programs: CHECK reports a failed condition and carries
+// on, test_result() prints PASS or FAIL at the end of main() and gives its
+// exit code.
+static int failures = 0;
+
+#define CHECK(cond)                                                            \
+  do {                                                                         \
+    if (!(cond)) {                                                             \
+      std::printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond);     \
+      failures++;                                                              \
+    }                                                                          \
+  } while (0)
+
+static inline int test_result() {
+  std::printf("%s\n", failures == 0 ? "PASS" : "FAIL");
+  return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,616 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <memory>
+#include <string>
+#include <ucontext.h>
+#include <utility>
+#include <vector>
+
+namespace utils {
+// Bounded model checker for small lock programs, in the spirit of Relacy and
+// CDSChecker. Every simulated thread runs on its own ucontext fiber and
+// stops before each operation on a ModelAtomic; the scheduler then picks the
+// next step, and a depth-first search over those picks re-runs the program
+// until every interleaving has been seen.
+//
+// Memory is modelled as x86-TSO with weaker read-modify-writes:
+//  - every thread has a FIFO store buffer; plain stores go into it and a
+//    load sees the thread's newest buffered store to that location, else
+//    memory. Draining one buffered store is a separate scheduler step, so
+//    stores can become visible after later loads (store buffering);
+//  - a seq_cst store, RMW or fence drains the buffer first and then writes
+//    memory directly, like the mfence / lock prefix x86 gets for them;
+//  - a weaker RMW reads the latest value but buffers its write, so it can
+//    be passed by later loads as the C++ model allows. To keep it atomic it
+//    only runs while no other thread has a store to the location buffered,
+//    and while its write is buffered no other thread's write to the
+//    location reaches memory;
+//  - load-load and store-store reordering (ARM, POWER) are not modelled.
+// model_pause_on(word), the counterpart of pause_on() in SpinMutex.h, parks
+// a spinning thread until word has changed in memory since the thread first
+// read it after its previous pause, which keeps spin loops finite without
+// losing wake-ups; model_futex_wait() / model_futex_wake() behave like
+// the syscalls. A state where no thread can run is reported as a deadlock,
+// which catches lost wake-ups.
+//
+// Without a bound the search is exhaustive, which is only affordable for two
+// threads and short programs. maxPreemptions bounds it the way CHESS does:
+// switching away from a thread that could go on, or draining a store
+// instead of running it, counts as a preemption; switches at blocking
+// points are free.
+class ModelChecker {
+public:
+  using Body = std::function<void(uint32_t)>;
+
+  struct Result {
+    uint64_t executions = 0;
+    uint64_t cut = 0; // runs stopped at maxSteps
+    bool failed = false;
+    std::string message;
+    std::vector<std::string> trace;
+  };
+
+  static constexpr uint32_t UNBOUNDED = UINT32_MAX;
+
+  // setup() builds the shared state for one run and returns the body of
+  // every simulated thread; it is called again for each run.
+  static Result check(uint32_t threads, std::function<Body()> setup,
+                      uint32_t maxPreemptions = UNBOUNDED,
+                      uint32_t maxSteps = 400) {
+    ModelChecker mc(threads, maxPreemptions, maxSteps);
+    Result r;
+    do {
+      mc.run(setup);
+      r.executions++;
+      if (mc._cut)
+        r.cut++;
+      if (mc._failed) {
+        r.failed = true;
+        r.message = mc._message;
+        r.trace = mc.format_trace();
+        return r;
+      }
+    } while (mc.next_path());
+    return r;
+  }
+
+  static inline ModelChecker &current() { return *_current; }
+
+  // Simulated-thread side.
+  enum class Kind : uint8_t {
+    START,
+    LOAD,
+    STORE,
+    RMW,
+    FENCE,
+    PAUSE,
+    YIELD,
+    FUTEX_WAIT,
+    FUTEX_SLEEP,
+    FUTEX_WAKE,
+    FLUSH
+  };
+
+  uint32_t add_location(const char *name, uint64_t value) {
+    _memory.push_back(value);
+    _names.push_back(name);
+    return (uint32_t)_memory.size() - 1;
+  }
+
+  inline void point(Kind kind, uint32_t loc = NONE, bool seqCst = false) {
+    Thread &t = _threads[_running];
+    t._kind = kind;
+    t._loc = loc;
+    t._seqCst = seqCst;
+    if (kind == Kind::PAUSE) {
+      uint64_t first = t._firstRead[loc];
+      t._pauseVersion = first != 0 ? first - 1 : _versions[loc];
+      std::fill(t._firstRead.begin(), t._firstRead.end(), 0);
+    }
+    swapcontext(&t._context, &_scheduler);
+  }
+
+  uint64_t load(uint32_t loc) {
+    point(Kind::LOAD, loc);
+    observe(loc);
+    uint64_t v = read(_running, loc);
+    log(Kind::LOAD, loc, v, v);
+    return v;
+  }
+
+  void store(uint32_t loc, uint64_t value, bool seqCst) {
+    point(Kind::STORE, loc, seqCst);
+    if (seqCst) {
+      drain(_running);
+      write(loc, value);
+    } else {
+      _threads[_running]._buffer.push_back({loc, value, false});
+    }
+    log(Kind::STORE, loc, value, value);
+  }
+
+  // Applies f to the current value and stores its result when f returns
+  // true; returns the old value.
+  template <typename F> uint64_t rmw(uint32_t loc, bool seqCst, F &&f) {
+    point(Kind::RMW, loc, seqCst);
+    observe(loc);
+    if (seqCst)
+      drain(_running);
+    uint64_t old = read(_running, loc);
+    uint64_t value = old;
+    if (f(value)) {
+      if (seqCst)
+        write(loc, value);
+      else
+        _threads[_running]._buffer.push_back({loc, value, true});
+    }
+    log(Kind::RMW, loc, old, value);
+    return old;
+  }
+
+  void fence() {
+    point(Kind::FENCE);
+    drain(_running);
+    log(Kind::FENCE, NONE, 0, 0);
+  }
+
+  void futex_wait(uint32_t loc, uint64_t expected) {
+    point(Kind::FUTEX_WAIT, loc);
+    observe(loc);
+    drain(_running);
+    uint64_t v = _memory[loc];
+    log(Kind::FUTEX_WAIT, loc, v, expected);
+    if (v != expected)
+      return;
+    Thread &t = _threads[_running];
+    t._sleeping = true;
+    t._sleepOrder = _sleepSeq++;
+    point(Kind::FUTEX_SLEEP, loc);
+  }
+
+  void futex_wake(uint32_t loc, uint32_t n) {
+    point(Kind::FUTEX_WAKE, loc);
+    drain(_running);
+    uint32_t woken = 0;
+    while (woken < n) {
+      Thread *first = nullptr;
+      for (Thread &t : _threads) {
+        if (t._sleeping && t._loc == loc &&
+            (first == nullptr || t._sleepOrder < first->_sleepOrder))
+          first = &t;
+      }
+      if (first == nullptr)
+        break;
+      first->_sleeping = false;
+      woken++;
+    }
+    log(Kind::FUTEX_WAKE, loc, woken, n);
+  }
+
+  // Ends the run as a failure; the calling fiber is never resumed.
+  void fail(const char *message) {
+    _failed = true;
+    _message = message;
+    setcontext(&_scheduler);
+  }
+
+  inline uint32_t thread_id() const { return _running; }
+
+protected:
+  static constexpr uint32_t NONE = UINT32_MAX;
+  static constexpr size_t STACK_SIZE = 256 * 1024;
+
+  struct Store {
+    uint32_t _loc;
+    uint64_t _value;
+    bool _rmw;
+  };
+
+  struct Thread {
+    ucontext_t _context;
+    std::unique_ptr<char[]> _stack;
+    std::vector<Store> _buffer;
+    Kind _kind = Kind::START;
+    uint32_t _loc = NONE;
+    bool _seqCst = false;
+    uint64_t _pauseVersion = 0;
+    // Version + 1 of each location at its first read since the last pause.
+    std::vector<uint64_t> _firstRead;
+    uint64_t _sleepOrder = 0;
+    bool _sleeping = false;
+    bool _done = false;
+  };
+
+  struct Event {
+    uint32_t _thread;
+    Kind _kind;
+    uint32_t _loc;
+    uint64_t _read;
+    uint64_t _written;
+  };
+
+  // A scheduler step: run thread (flush == false) or drain its oldest store.
+  struct Action {
+    uint32_t _thread;
+    bool _flush;
+  };
+
+  struct Choice {
+    uint32_t _taken;
+    uint32_t _count;
+  };
+
+  ModelChecker(uint32_t threads, uint32_t maxPreemptions, uint32_t maxSteps)
+      : _threads(threads), _maxPreemptions(maxPreemptions),
+        _maxSteps(maxSteps) {
+    for (Thread &t : _threads)
+      t._stack.reset(new char[STACK_SIZE]);
+  }
+
+  inline uint64_t read(uint32_t thread, uint32_t loc) const {
+    const std::vector<Store> &b = _threads[thread]._buffer;
+    for (size_t i = b.size(); i > 0; i--) {
+      if (b[i - 1]._loc == loc)
+        return b[i - 1]._value;
+    }
+    return _memory[loc];
+  }
+
+  inline void write(uint32_t loc, uint64_t value) {
+    if (_memory[loc] == value)
+      return;
+    _memory[loc] = value;
+    _versions[loc]++;
+  }
+
+  inline void drain(uint32_t thread) {
+    for (const Store &s : _threads[thread]._buffer)
+      write(s._loc, s._value);
+    _threads[thread]._buffer.clear();
+  }
+
+  inline void observe(uint32_t loc) {
+    uint64_t &first = _threads[_running]._firstRead[loc];
+    if (first == 0)
+      first = _versions[loc] + 1;
+  }
+
+  inline void log(Kind kind, uint32_t loc, uint64_t read, uint64_t written) {
+    _events.push_back({_running, kind, loc, read, written});
+  }
+
+  // Whether another thread has a store (only RMW writes if rmwOnly) to loc
+  // in its buffer.
+  bool buffered_elsewhere(uint32_t thread, uint32_t loc, bool rmwOnly) const {
+    for (uint32_t i = 0; i < _threads.size(); i++) {
+      if (i == thread)
+        continue;
+      for (const Store &s : _threads[i]._buffer) {
+        if (s._loc == loc && (s._rmw || !rmwOnly))
+          return true;
+      }
+    }
+    return false;
+  }
+
+  // A write to loc may reach memory unless another thread's buffered RMW
+  // write to loc, which comes first in modification order, has not yet.
+  inline bool committable(uint32_t thread, uint32_t loc) const {
+    return !buffered_elsewhere(thread, loc, true);
+  }
+
+  bool drainable(uint32_t thread) const {
+    for (const Store &s : _threads[thread]._buffer) {
+      if (!committable(thread, s._loc))
+        return false;
+    }
+    return true;
+  }
+
+  bool runnable(uint32_t i) const {
+    const Thread &t = _threads[i];
+    if (t._done || t._sleeping)
+      return false;
+    switch (t._kind) {
+    case Kind::PAUSE:
+      return _versions[t._loc] != t._pauseVersion;
+    case Kind::STORE:
+      return !t._seqCst || (drainable(i) && committable(i, t._loc));
+    case Kind::RMW:
+      if (t._seqCst)
+        return drainable(i) && committable(i, t._loc);
+      return !buffered_elsewhere(i, t._loc, false);
+    case Kind::FENCE:
+    case Kind::FUTEX_WAIT:
+    case Kind::FUTEX_WAKE:
+      return drainable(i);
+    default:
+      return true;
+    }
+  }
+
+  static void trampoline() {
+    ModelChecker &mc = current();
+    mc._body(mc._running);
+    mc._threads[mc._running]._done = true;
+  }
+
+  uint32_t choose(uint32_t count) {
+    if (count == 1)
+      return 0;
+    if (_depth == _path.size())
+      _path.push_back({0, count});
+    return _path[_depth++]._taken;
+  }
+
+  bool next_path() {
+    while (!_path.empty() && _path.back()._taken + 1 >= _path.back()._count)
+      _path.pop_back();
+    if (_path.empty())
+      return false;
+    _path.back()._taken++;
+    return true;
+  }
+
+  void run(const std::function<Body()> &setup) {
+    _current = this;
+    _memory.clear();
+    _names.clear();
+    _events.clear();
+    _sleepSeq = 0;
+    _depth = 0;
+    _failed = false;
+    _cut = false;
+    _body = setup();
+    _versions.assign(_memory.size(), 0);
+    for (Thread &t : _threads) {
+      t._buffer.clear();
+      t._kind = Kind::START;
+      t._loc = NONE;
+      t._firstRead.assign(_memory.size(), 0);
+      t._sleeping = false;
+      t._done = false;
+      getcontext(&t._context);
+      t._context.uc_stack.ss_sp = t._stack.get();
+      t._context.uc_stack.ss_size = STACK_SIZE;
+      t._context.uc_link = &_scheduler;
+      makecontext(&t._context, trampoline, 0);
+    }
+
+    std::vector<Action> actions;
+    uint32_t last = NONE;
+    uint32_t preemptions = 0;
+    for (uint32_t steps = 0;; steps++) {
+      if (steps == _maxSteps) {
+        _cut = true;
+        return;
+      }
+
+      // Once every thread is done the order of the last flushes can't
+      // change anything a check could see.
+      actions.clear();
+      bool alive = false;
+      for (uint32_t i = 0; i < _threads.size(); i++) {
+        alive |= !_threads[i]._done;
+        if (runnable(i))
+          actions.push_back({i, false});
+        const std::vector<Store> &b = _threads[i]._buffer;
+        if (!b.empty() && committable(i, b.front()._loc))
+          actions.push_back({i, true});
+      }
+      if (!alive)
+        return;
+      if (actions.empty()) {
+        _failed = true;
+        _message = "deadlock: no thread can run";
+        return;
+      }
+
+      // The last thread going on is free; anything else preempts it.
+      bool lastRuns = false;
+      for (size_t i = 0; i < actions.size(); i++) {
+        if (actions[i]._thread == last && !actions[i]._flush) {
+          std::swap(actions[i], actions[0]);
+          lastRuns = true;
+        }
+      }
+      if (lastRuns && preemptions == _maxPreemptions)
+        actions.resize(1);
+
+      Action a = actions[choose((uint32_t)actions.size())];
+      if (lastRuns && (a._flush || a._thread != last))
+        preemptions++;
+      if (a._flush) {
+        Thread &t = _threads[a._thread];
+        Store s = t._buffer.front();
+        t._buffer.erase(t._buffer.begin());
+        _events.push_back(
+            {a._thread, Kind::FLUSH, s._loc, _memory[s._loc], s._value});
+        write(s._loc, s._value);
+        continue;
+      }
+
+      _running = last = a._thread;
+      swapcontext(&_scheduler, &_threads[a._thread]._context);
+      if (_failed)
+        return;
+    }
+  }
+
+  std::vector<std::string> format_trace() const {
+    static const char *const KINDS[] = {
+        "start", "load",       "store",       "rmw",        "fence", "pause",
+        "yield", "futex_wait", "futex_sleep", "futex_wake", "flush"};
+    std::vector<std::string> out;
+    for (const Event &e : _events) {
+      char line[128];
+      char loc[16] = "";
+      if (e._loc != NONE && _names[e._loc] == nullptr)
+        std::snprintf(loc, sizeof(loc), "#%u", e._loc);
+      const char *name = e._loc == NONE || _names[e._loc] == nullptr
+                             ? loc
+                             : _names[e._loc];
+      std::snprintf(line, sizeof(line), "T%u %-10s %-12s %llu -> %llu",
+                    e._thread, KINDS[(int)e._kind], name,
+                    (unsigned long long)e._read,
+                    (unsigned long long)e._written);
+      out.push_back(line);
+    }
+    return out;
+  }
+
+  static inline ModelChecker *_current = nullptr;
+
+  std::vector<Thread> _threads;
+  const uint32_t _maxPreemptions;
+  const uint32_t _maxSteps;
+  ucontext_t _scheduler;
+  Body _body;
+  uint32_t _running = 0;
+
+  std::vector<uint64_t> _memory;
+  std::vector<const char *> _names;
+  std::vector<uint64_t> _versions; // changes of each location
+  uint64_t _sleepSeq = 0;
+  std::vector<Event> _events;
+
+  std::vector<Choice> _path;
+  size_t _depth = 0;
+  bool _failed = false;
+  bool _cut = false;
+  std::string _message;
+};
+
+// An atomic variable inside a model, with the std::atomic interface the
+// locks use. Stores and RMWs only distinguish seq_cst from weaker orders;
+// loads ignore the order, as on x86. WEAK treats seq_cst like the weaker
+// orders too. Unnamed ones show up as #location in traces.
+template <typename T, bool WEAK = false> class ModelAtomic {
+public:
+  explicit ModelAtomic(T value = T()) : ModelAtomic(nullptr, value) {}
+  ModelAtomic(const char *name, T value)
+      : _loc(ModelChecker::current().add_location(name, (uint64_t)value)) {}
+  ModelAtomic(const ModelAtomic &) = delete;
+  ModelAtomic &operator=(const ModelAtomic &) = delete;
+
+  inline T load(std::memory_order = std::memory_order_seq_cst) const {
+    return (T)ModelChecker::current().load(_loc);
+  }
+
+  inline void store(T value,
+                    std::memory_order order = std::memory_order_seq_cst) {
+    ModelChecker::current().store(_loc, (uint64_t)value, sc(order));
+  }
+
+  inline T exchange(T value,
+                    std::memory_order order = std::memory_order_seq_cst) {
+    return (T)ModelChecker::current().rmw(
+        _loc, sc(order), [&](uint64_t &v) {
+          v = (uint64_t)value;
+          return true;
+        });
+  }
+
+  inline bool compare_exchange_strong(
+      T &expected, T desired,
+      std::memory_order order = std::memory_order_seq_cst,
+      std::memory_order = std::memory_order_relaxed) {
+    uint64_t old = ModelChecker::current().rmw(
+        _loc, sc(order), [&](uint64_t &v) {
+          if (v != (uint64_t)expected)
+            return false;
+          v = (uint64_t)desired;
+          return true;
+        });
+    if (old == (uint64_t)expected)
+      return true;
+    expected = (T)old;
+    return false;
+  }
+
+  inline T fetch_add(T n, std::memory_order order = std::memory_order_seq_cst) {
+    return (T)ModelChecker::current().rmw(
+        _loc, sc(order), [&](uint64_t &v) {
+          v = (uint64_t)((T)v + n);
+          return true;
+        });
+  }
+
+  inline T fetch_sub(T n, std::memory_order order = std::memory_order_seq_cst) {
+    return fetch_add((T)-n, order);
+  }
+
+  inline uint32_t location() const { return _loc; }
+
+protected:
+  static constexpr bool sc(std::memory_order order) {
+    return !WEAK && order == std::memory_order_seq_cst;
+  }
+
+  const uint32_t _loc;
+};
+
+inline void model_fence() { ModelChecker::current().fence(); }
+
+// Spin-loop pause: the thread does not run again until word changes.
+template <typename T, bool W>
+inline void model_pause_on(const ModelAtomic<T, W> &word) {
+  ModelChecker::current().point(ModelChecker::Kind::PAUSE, word.location());
+}
+
+// A scheduling point without a memory effect, e.g. inside a critical
+// section so that other threads get to try to enter it.
+inline void model_yield() {
+  ModelChecker::current().point(ModelChecker::Kind::YIELD);
+}
+
+template <typename T, bool W>
+inline void model_futex_wait(const ModelAtomic<T, W> &word, T expected) {
+  ModelChecker::current().futex_wait(word.location(), (uint64_t)expected);
+}
+
+template <typename T, bool W>
+inline void model_futex_wake(const ModelAtomic<T, W> &word, uint32_t n) {
+  ModelChecker::current().futex_wake(word.location(), n);
+}
+
+// Atomics policy of BasicSpinMutex (SpinMutex.h) that runs the header's own
+// lock paths in a model: the words are ModelAtomics, the futex calls the
+// model's, and every spin round is a model_pause_on() instead of the
+// Backoff. A timed wait never times out. WEAK (every seq_cst weakened) and
+// !WAKE (futex_wake dropped) break the lock on purpose, to show that the
+// checker catches it.
+template <bool WEAK = false, bool WAKE = true> struct ModelAtomics {
+  template <typename T> using Atomic = ModelAtomic<T, WEAK>;
+
+  static inline void futex_wait(Atomic<uint32_t> &word, uint32_t expected) {
+    model_futex_wait(word, expected);
+  }
+
+  static inline void futex_wait_for(Atomic<uint32_t> &word, uint32_t expected,
+                                    std::chrono::nanoseconds) {
+    model_futex_wait(word, expected);
+  }
+
+  static inline void futex_wake(Atomic<uint32_t> &word, int count) {
+    if (WAKE)
+      model_futex_wake(word, (uint32_t)count);
+  }
+
+  template <typename T, typename Pause>
+  static inline void pause_on(const Atomic<T> &word, Pause &&) {
+    model_pause_on(word);
+  }
+};
+
+#define MODEL_ASSERT(cond)                                                     \
+  do {                                                                         \
+    if (!(cond))                                                               \
+      ::utils::ModelChecker::current().fail(#cond);                            \
+  } while (0)
+} // namespace utils
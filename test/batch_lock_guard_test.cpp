@@ -0,0 +1,97 @@
+// Regression tests for BatchLockGuard.
+// g++ -std=c++17 -O2 -pthread -I.. batch_lock_guard_test.cpp -o batch_test
+#include "BatchLockGuard.h"
+#include "Check.h"
+#include "SpinMutex.h"
+#include <atomic>
+#include <cstdio>
+#include <thread>
+
+using namespace utils;
+
+// A spinning waiter leaves no trace in the lock word, so only the count
+// release can let it in. The batch gives up after a bounded number of
+// releases; the waiter must have had its turn by then.
+template <typename Mutex> static void count_release_lets_waiter_in() {
+  Mutex m;
+  std::atomic<bool> started{false};
+  std::atomic<bool> got{false};
+  uint64_t releases = 0;
+  std::thread waiter;
+  {
+    BatchLockGuard<Mutex> batch(m, 64, std::chrono::seconds(10));
+    waiter = std::thread([&] {
+      started = true;
+      m.lock();
+      got = true;
+      m.unlock();
+    });
+    while (!started)
+      std::this_thread::yield();
+    while (!got && batch.release_count() < 1000)
+      batch.step();
+    releases = batch.release_count();
+  }
+  waiter.join();
+  CHECK(releases < 1000);
+}
+
+// maxHold alone must also hand the lock over.
+static void time_release_lets_waiter_in() {
+  SpinMutex m;
+  std::atomic<bool> started{false};
+  std::atomic<bool> got{false};
+  uint64_t releases = 0;
+  std::thread waiter;
+  {
+    BatchLockGuard<SpinMutex> batch(m, UINT32_MAX,
+                                    std::chrono::microseconds(50));
+    waiter = std::thread([&] {
+      started = true;
+      m.lock();
+      got = true;
+      m.unlock();
+    });
+    while (!started)
+      std::this_thread::yield();
+    while (!got && batch.release_count() < 1000)
+      batch.step();
+    releases = batch.release_count();
+  }
+  waiter.join();
+  CHECK(releases < 1000);
+}
+
+// A batch that got its ParkWait lock through the parking path sees the word
+// at 2 with nobody left waiting. has_waiters() is conservative there, which
+// may cost one relock, but the relock takes the free word and clears it.
+static void stale_waiter_mark_costs_one_relock() {
+  using ParkMutex = BasicSpinMutex<ExclusiveMode, NonReentrant,
+                                   ExponentialBackoff, ParkWait>;
+  ParkMutex m;
+  std::atomic<bool> started{false};
+  uint64_t releases = 0;
+  m.lock();
+  std::thread holder([&] {
+    started = true;
+    BatchLockGuard<ParkMutex> batch(m, UINT32_MAX, std::chrono::seconds(10));
+    for (int i = 0; i < 1000; i++)
+      batch.step();
+    releases = batch.release_count();
+  });
+  while (!started)
+    std::this_thread::yield();
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  m.unlock();
+  holder.join();
+  CHECK(releases <= 1);
+  CHECK(!m.has_waiters());
+}
+
+int main() {
+  count_release_lets_waiter_in<SpinMutex>();
+  count_release_lets_waiter_in<CompactSpinMutex>();
+  time_release_lets_waiter_in();
+  stale_waiter_mark_costs_one_relock();
+  return test_result();
+}
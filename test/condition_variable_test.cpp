@@ -0,0 +1,108 @@
+// Regression tests for SpinConditionVariable.
+// g++ -std=c++17 -O2 -pthread -I.. condition_variable_test.cpp -o cv_test
+#include "Check.h"
+#include "SpinConditionVariable.h"
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace utils;
+
+// Every waiter must wake from one notify_all(), including the ones that were
+// requeued onto the relay word.
+template <typename Mutex> static void notify_all_wakes_everyone() {
+  const int THREADS = 16;
+  for (int round = 0; round < 200; round++) {
+    Mutex m;
+    SpinConditionVariable cv;
+    bool ready = false;
+    std::atomic<int> waiting{0};
+    std::atomic<int> woken{0};
+    std::vector<std::thread> ts;
+    for (int i = 0; i < THREADS; i++) {
+      ts.emplace_back([&] {
+        std::unique_lock<Mutex> l(m);
+        waiting++;
+        cv.wait(l, [&] { return ready; });
+        woken++;
+      });
+    }
+
+    while (waiting.load() < THREADS)
+      std::this_thread::yield();
+    // Let the waiters get past their spin phase and park.
+    std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    {
+      std::lock_guard<Mutex> g(m);
+      ready = true;
+    }
+    cv.notify_all();
+
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    while (woken.load() < THREADS &&
+           std::chrono::steady_clock::now() < deadline)
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    CHECK(woken.load() == THREADS);
+    if (woken.load() != THREADS) {
+      std::printf("round %d: %d of %d woke\n", round, woken.load(), THREADS);
+      std::fflush(stdout);
+      std::_Exit(1);
+    }
+
+    for (auto &t : ts)
+      t.join();
+  }
+}
+
+static void notify_one_wakes_one() {
+  SpinMutex m;
+  SpinConditionVariable cv;
+  int tokens = 0;
+  std::atomic<int> consumed{0};
+  std::vector<std::thread> ts;
+  for (int i = 0; i < 4; i++) {
+    ts.emplace_back([&] {
+      for (int j = 0; j < 1000; j++) {
+        std::unique_lock<SpinMutex> l(m);
+        cv.wait(l, [&] { return tokens > 0; });
+        tokens--;
+        consumed++;
+      }
+    });
+  }
+
+  for (int j = 0; j < 4000; j++) {
+    {
+      std::lock_guard<SpinMutex> g(m);
+      tokens++;
+    }
+    cv.notify_one();
+  }
+
+  for (auto &t : ts)
+    t.join();
+  CHECK(consumed.load() == 4000);
+}
+
+static void wait_for_times_out() {
+  SpinMutex m;
+  SpinConditionVariable cv;
+  std::unique_lock<SpinMutex> l(m);
+  auto start = std::chrono::steady_clock::now();
+  bool ok = cv.wait_for(l, std::chrono::milliseconds(20), [] { return false; });
+  CHECK(!ok);
+  CHECK(std::chrono::steady_clock::now() - start >=
+        std::chrono::milliseconds(20));
+  CHECK(l.owns_lock());
+}
+
+int main() {
+  notify_all_wakes_everyone<SpinMutex>();
+  notify_all_wakes_everyone<SharedSpinMutex>();
+  notify_one_wakes_one();
+  wait_for_times_out();
+  return test_result();
+}
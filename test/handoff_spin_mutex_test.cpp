@@ -0,0 +1,85 @@
+// Regression tests for HandoffSpinMutex.
+// g++ -std=c++17 -O2 -pthread -I.. handoff_spin_mutex_test.cpp -o handoff_test
+#include "Check.h"
+#include "HandoffSpinMutex.h"
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+
+using namespace utils;
+
+struct Probe : HandoffSpinMutex {
+  using HandoffSpinMutex::HandoffSpinMutex;
+  void force_word(uint32_t w) { _word.store(w); }
+};
+
+// Runs f on a thread and fails if it has not finished within 5 seconds.
+template <typename F> static bool finishes(F f) {
+  std::atomic<bool> done{false};
+  std::thread t([&] {
+    f();
+    done = true;
+  });
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+  while (!done && std::chrono::steady_clock::now() < deadline)
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  if (!done) {
+    std::printf("hung\n");
+    std::fflush(stdout);
+    std::_Exit(1);
+  }
+  t.join();
+  return true;
+}
+
+// The state a lost STARVING mark used to leave behind: free, starving, no
+// queue. lock() must still get the word.
+static void stray_starving_word() {
+  Probe m;
+  m.force_word(HandoffSpinMutex::STARVING);
+  CHECK(finishes([&] {
+    m.lock();
+    m.unlock();
+  }));
+  CHECK(!m.is_locked());
+  CHECK(m.queue_length() == 0);
+}
+
+// Tiny threshold so that waiters keep flipping into starvation mode while
+// owners release, which used to race the STARVING mark against unlock().
+static void starvation_stress() {
+  HandoffSpinMutex m(std::chrono::nanoseconds(1));
+  long counter = 0;
+  std::atomic<int> inside{0};
+  std::atomic<int> overlaps{0};
+  CHECK(finishes([&] {
+    std::vector<std::thread> ts;
+    for (int t = 0; t < 8; t++) {
+      ts.emplace_back([&] {
+        for (int i = 0; i < 20000; i++) {
+          m.lock();
+          if (inside.fetch_add(1) != 0)
+            overlaps++;
+          counter++;
+          inside.fetch_sub(1);
+          m.unlock();
+        }
+      });
+    }
+    for (auto &t : ts)
+      t.join();
+  }));
+  CHECK(counter == 8 * 20000);
+  CHECK(overlaps.load() == 0);
+  CHECK(!m.is_locked() && !m.is_starving() && m.queue_length() == 0);
+}
+
+int main() {
+  stray_starving_word();
+  for (int i = 0; i < 20; i++)
+    starvation_stress();
+  return test_result();
+}
@@ -0,0 +1,90 @@
+// Tests for LeveledMutex and LevelGuard chains.
+// g++ -std=c++17 -O2 -pthread -I.. leveled_mutex_test.cpp -o leveled_test
+// The run-time check is kept in release builds too, so these tests cover it
+// with or without NDEBUG.
+#define SPIN_MUTEX_CHECK_LEVELS 1
+#include "Check.h"
+#include "LeveledMutex.h"
+#include <csignal>
+#include <cstdio>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <utility>
+
+using namespace utils;
+
+static LeveledMutex<1> accounts;
+static LeveledMutex<2, SharedSpinMutex> index_;
+static LeveledMutex<3> journal;
+
+// Only callable from a chain whose newest hold is index_, shared.
+template <typename P>
+static uint32_t held_level(const LevelGuard<2, decltype(index_), true, P> &) {
+  return HeldLevels::top();
+}
+
+// A chain holds every mutex locked through it and releases them newest
+// first; each hold shows up in HeldLevels.
+static void chain_holds_and_records() {
+  {
+    auto a = LevelRoot().lock(accounts);
+    CHECK(HeldLevels::top() == 1);
+    auto b = std::move(a).lock_shared(index_);
+    CHECK(!a.owns_lock());
+    CHECK(b.owns_lock());
+    CHECK(held_level(b) == 2);
+    auto c = std::move(b).lock(journal);
+    CHECK(HeldLevels::top() == 3);
+    CHECK(!accounts.try_lock());
+    CHECK(!journal.try_lock());
+  }
+  CHECK(HeldLevels::top() == 0);
+  CHECK(accounts.try_lock());
+  accounts.unlock();
+}
+
+// unlock() releases the whole chain, and the guards' destructors are then
+// no-ops.
+static void unlock_releases_chain() {
+  auto c = LevelRoot().lock(accounts).lock(journal);
+  c.unlock();
+  CHECK(!c.owns_lock());
+  CHECK(HeldLevels::top() == 0);
+  CHECK(accounts.try_lock());
+  CHECK(journal.try_lock());
+  journal.unlock();
+  accounts.unlock();
+}
+
+// Plain locks taken inside a chain are checked against the typed holds.
+static void plain_lock_sees_chain() {
+  auto a = LevelRoot().lock(accounts);
+  {
+    std::lock_guard<LeveledMutex<3>> guard(journal);
+    CHECK(HeldLevels::top() == 3);
+  }
+  CHECK(HeldLevels::top() == 1);
+}
+
+// A plain lock below a held level stops the process. Run in a forked child.
+static bool violation_aborts() {
+  std::fflush(stdout);
+  pid_t pid = fork();
+  if (pid == 0) {
+    std::freopen("/dev/null", "w", stderr);
+    auto c = LevelRoot().lock(journal);
+    accounts.lock();
+    _exit(0);
+  }
+  int status = 0;
+  waitpid(pid, &status, 0);
+  return WIFSIGNALED(status) && WTERMSIG(status) == SIGABRT;
+}
+
+int main() {
+  chain_holds_and_records();
+  unlock_releases_chain();
+  plain_lock_sees_chain();
+  CHECK(violation_aborts());
+  return test_result();
+}
@@ -0,0 +1,81 @@
+// Regression tests for LockManager.
+// g++ -std=c++17 -O2 -pthread -I.. lock_manager_test.cpp -o lock_manager_test
+#include "Check.h"
+#include "LockManager.h"
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <random>
+#include <thread>
+#include <vector>
+
+using namespace utils;
+using Manager = LockManager<int>;
+
+// Two transactions lock two keys in opposite order; the younger one must be
+// aborted and the older one granted.
+static void detects_two_cycle() {
+  Manager m(64);
+  Manager::Txn a(m), b(m);
+  CHECK(m.lock(a, 1, KeyLockMode::EXCLUSIVE) == LockStatus::GRANTED);
+  CHECK(m.lock(b, 2, KeyLockMode::EXCLUSIVE) == LockStatus::GRANTED);
+  LockStatus sa = LockStatus::TIMEOUT;
+  std::thread t([&] { sa = m.lock(a, 2, KeyLockMode::EXCLUSIVE); });
+  std::atomic<bool> detecting{true};
+  std::thread d([&] {
+    while (detecting) {
+      m.detect_deadlocks();
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+  });
+  LockStatus sb = m.lock(b, 1, KeyLockMode::EXCLUSIVE);
+  CHECK(sb == LockStatus::DEADLOCK);
+  m.unlock(b, 2, KeyLockMode::EXCLUSIVE);
+  t.join();
+  detecting = false;
+  d.join();
+  CHECK(sa == LockStatus::GRANTED);
+  m.unlock(a, 1, KeyLockMode::EXCLUSIVE);
+  m.unlock(a, 2, KeyLockMode::EXCLUSIVE);
+  CHECK(m.entry_count() == 0);
+}
+
+// Short-lived heap Txns that time out, deadlock and are freed right away
+// while the detector runs every millisecond. Under ASan this used to report
+// the detector reading freed Txns.
+static void detector_vs_freed_txns() {
+  Manager m(64, std::chrono::milliseconds(1));
+  std::vector<std::thread> ts;
+  for (int t = 0; t < 4; t++) {
+    ts.emplace_back([&, t] {
+      std::mt19937 rng(t);
+      auto deadline =
+          std::chrono::steady_clock::now() + std::chrono::milliseconds(500);
+      while (std::chrono::steady_clock::now() < deadline) {
+        std::unique_ptr<Manager::Txn> txn(new Manager::Txn(m));
+        int keys[2] = {(int)(rng() % 4), (int)(rng() % 4)};
+        if (keys[0] == keys[1])
+          continue;
+        int held = 0;
+        for (int k : keys) {
+          if (m.lock(*txn, k, KeyLockMode::EXCLUSIVE,
+                     std::chrono::microseconds(200)) != LockStatus::GRANTED)
+            break;
+          held++;
+        }
+        for (int i = 0; i < held; i++)
+          m.unlock(*txn, keys[i], KeyLockMode::EXCLUSIVE);
+      }
+    });
+  }
+  for (auto &t : ts)
+    t.join();
+  CHECK(m.entry_count() == 0);
+}
+
+int main() {
+  detects_two_cycle();
+  detector_vs_freed_txns();
+  return test_result();
+}
@@ -0,0 +1,118 @@
+// Regression tests for Mutex, SharedMutex and MutexBackend. The backend is
+// fixed once per process, so every backend is tested in a forked child.
+// g++ -std=c++17 -O2 -pthread -I.. mutex_test.cpp -o mutex_test
+#include "Check.h"
+#include "Mutex.h"
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <shared_mutex>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+using namespace utils;
+
+// Runs f in a forked child and returns whether it exited with 0.
+template <typename F> static bool in_child(F f) {
+  std::fflush(stdout);
+  pid_t pid = fork();
+  if (pid == 0) {
+    f();
+    std::fflush(stdout);
+    _exit(failures == 0 ? 0 : 1);
+  }
+  int status = 0;
+  waitpid(pid, &status, 0);
+  return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+// Exclusive and shared holds of Mutex and SharedMutex on the current
+// backend: try_lock fails against any hold, try_lock_shared only against an
+// exclusive one, and a counter under the lock loses no increments.
+static void locks_on_backend(MutexBackend::Kind kind) {
+  CHECK(MutexBackend::kind() == kind);
+  Mutex m;
+  SharedMutex s;
+  CHECK(m.backend() == kind);
+  CHECK(s.backend() == kind);
+
+  m.lock();
+  std::thread([&] { CHECK(!m.try_lock()); }).join();
+  m.unlock();
+  CHECK(m.try_lock());
+  m.unlock();
+
+  s.lock_shared();
+  std::thread([&] {
+    CHECK(s.try_lock_shared());
+    s.unlock_shared();
+    CHECK(!s.try_lock());
+  }).join();
+  s.unlock_shared();
+  s.lock();
+  std::thread([&] { CHECK(!s.try_lock_shared()); }).join();
+  s.unlock();
+
+  constexpr int THREADS = 4;
+  constexpr int OPS = 20000;
+  long plain = 0, counter = 0, shadow = 0;
+  std::atomic<int> torn{0};
+  std::vector<std::thread> ts;
+  for (int t = 0; t < THREADS; t++) {
+    ts.emplace_back([&, t] {
+      for (int i = 0; i < OPS; i++) {
+        if (t % 2 == 0 || i % 4 == 0) {
+          std::lock_guard<SharedMutex> guard(s);
+          counter++;
+          shadow++;
+        } else {
+          std::shared_lock<SharedMutex> guard(s);
+          if (counter != shadow)
+            torn++;
+        }
+        std::lock_guard<Mutex> guard(m);
+        plain++;
+      }
+    });
+  }
+  for (auto &t : ts)
+    t.join();
+  CHECK(plain == THREADS * OPS);
+  CHECK(torn.load() == 0);
+  CHECK(counter == THREADS / 2 * OPS + THREADS / 2 * (OPS / 4));
+}
+
+// select() fixes the backend once; picking another one afterwards fails, the
+// same one succeeds.
+static void select_is_sticky() {
+  CHECK(MutexBackend::select(MutexBackend::HYBRID));
+  CHECK(MutexBackend::select(MutexBackend::HYBRID));
+  CHECK(!MutexBackend::select(MutexBackend::STD));
+  CHECK(MutexBackend::kind() == MutexBackend::HYBRID);
+}
+
+int main() {
+  const MutexBackend::Kind kinds[] = {MutexBackend::SPIN, MutexBackend::HYBRID,
+                                      MutexBackend::STD};
+  for (MutexBackend::Kind kind : kinds) {
+    CHECK(in_child([kind] {
+      CHECK(MutexBackend::select(kind));
+      locks_on_backend(kind);
+    }));
+  }
+
+  // Without select() the first lock reads UTILS_MUTEX_BACKEND.
+  CHECK(in_child([] {
+    setenv("UTILS_MUTEX_BACKEND", "std", 1);
+    locks_on_backend(MutexBackend::STD);
+  }));
+  CHECK(in_child([] {
+    unsetenv("UTILS_MUTEX_BACKEND");
+    locks_on_backend(MutexBackend::SPIN);
+  }));
+  CHECK(in_child(select_is_sticky));
+  return test_result();
+}
@@ -0,0 +1,132 @@
+// Regression tests for ObjectPool.
+// g++ -std=c++17 -O2 -pthread -I.. object_pool_test.cpp -o object_pool_test
+#include "Check.h"
+#include "ObjectPool.h"
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <thread>
+#include <vector>
+
+using namespace utils;
+
+struct alignas(32) Item {
+  uint64_t value[4];
+};
+
+// The pool gets its objects from the aligned operator new; the Items among
+// them are counted here to see what trim() gives back. A size header keeps
+// the count right in delete.
+static std::atomic<long> g_live{0};
+
+void *operator new(std::size_t n, std::align_val_t a) {
+  size_t align = (size_t)a < 16 ? 16 : (size_t)a;
+  char *raw = (char *)std::aligned_alloc(align, (n + 2 * align - 1) / align *
+                                                    align);
+  if (raw == nullptr)
+    throw std::bad_alloc();
+  char *p = raw + align;
+  ((size_t *)p)[-1] = n;
+  ((size_t *)p)[-2] = align;
+  if (n == sizeof(Item) && align == alignof(Item))
+    g_live++;
+  return p;
+}
+
+void operator delete(void *p, std::align_val_t) noexcept {
+  if (p == nullptr)
+    return;
+  size_t n = ((size_t *)p)[-1];
+  size_t align = ((size_t *)p)[-2];
+  if (n == sizeof(Item) && align == alignof(Item))
+    g_live--;
+  std::free((char *)p - align);
+}
+
+void operator delete(void *p, std::size_t, std::align_val_t a) noexcept {
+  operator delete(p, a);
+}
+
+using Pool = ObjectPool<Item, 8>;
+
+// trim() empties the depot and every thread's cache, including the cache of
+// a thread that stays idle throughout and of one that has exited.
+static void trim_drains_idle_caches() {
+  Pool pool;
+  std::vector<void *> ps;
+  for (int i = 0; i < 100; i++)
+    ps.push_back(pool.allocate());
+  for (void *p : ps)
+    pool.deallocate(p);
+  CHECK(g_live.load() == 100);
+  CHECK(pool.depot_size() > 0);
+
+  pool.trim();
+  CHECK(pool.depot_size() == 0);
+  CHECK(g_live.load() == 0);
+
+  std::atomic<int> step{0};
+  std::thread idle([&] {
+    std::vector<void *> mine;
+    for (int i = 0; i < 12; i++)
+      mine.push_back(pool.allocate());
+    for (void *q : mine)
+      pool.deallocate(q);
+    step = 1;
+    while (step.load() != 2)
+      std::this_thread::yield();
+    // The cache still works after being emptied behind the thread's back.
+    pool.deallocate(pool.allocate());
+  });
+  while (step.load() != 1)
+    std::this_thread::yield();
+  CHECK(g_live.load() == 12);
+  pool.trim();
+  CHECK(g_live.load() == 0);
+  step = 2;
+  idle.join();
+  CHECK(g_live.load() == 1);
+  pool.trim();
+  CHECK(g_live.load() == 0);
+}
+
+// trim() running while other threads allocate and free.
+static void trim_stress() {
+  {
+    Pool pool;
+    std::atomic<bool> stop{false};
+    std::vector<std::thread> ts;
+    for (int t = 0; t < 4; t++) {
+      ts.emplace_back([&] {
+        std::vector<Item *> held;
+        for (int i = 0; i < 100000; i++) {
+          if (held.size() < 50 && (i % 3 != 0 || held.empty())) {
+            held.push_back(pool.create());
+          } else {
+            pool.destroy(held.back());
+            held.pop_back();
+          }
+        }
+        for (Item *it : held)
+          pool.destroy(it);
+      });
+    }
+    std::thread trimmer([&] {
+      while (!stop)
+        pool.trim();
+    });
+    for (auto &t : ts)
+      t.join();
+    stop = true;
+    trimmer.join();
+  }
+  CHECK(g_live.load() == 0);
+}
+
+int main() {
+  trim_drains_idle_caches();
+  CHECK(g_live.load() == 0);
+  trim_stress();
+  return test_result();
+}
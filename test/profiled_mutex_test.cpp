@@ -0,0 +1,110 @@
+// Regression tests for the ProfileStats / ProfiledWait mode of BasicSpinMutex.
+// g++ -std=c++17 -O2 -pthread -I.. profiled_mutex_test.cpp -o profiled_test
+#include "Check.h"
+#include "ProfiledMutex.h"
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace utils;
+
+// The saved profile line of name: acquired contended shared maxWaiters and
+// the sum of the hold buckets.
+struct Saved {
+  uint64_t acquired = 0, contended = 0, shared = 0, maxWaiters = 0, holds = 0;
+};
+
+static Saved saved(const std::string &name) {
+  const char *path = "profiled_mutex_test.profile";
+  Saved s;
+  CHECK(LockProfiler::save(path));
+  std::ifstream in(path);
+  std::string line;
+  while (std::getline(in, line)) {
+    std::istringstream fields(line);
+    std::string n;
+    fields >> n;
+    if (n != name)
+      continue;
+    fields >> s.acquired >> s.contended >> s.shared >> s.maxWaiters;
+    for (uint64_t h; fields >> h;)
+      s.holds += h;
+  }
+  std::remove(path);
+  return s;
+}
+
+// A waiter that arrives while the lock is held is counted as contended and
+// as a waiter, and every exclusive hold lands in the histogram.
+static void records_contention() {
+  ProfiledMutex m("contention");
+  m.lock();
+  std::thread waiter([&] {
+    m.lock();
+    m.unlock();
+  });
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  m.unlock();
+  waiter.join();
+
+  Saved s = saved("contention");
+  CHECK(s.acquired == 2);
+  CHECK(s.contended == 1);
+  CHECK(s.maxWaiters == 1);
+  CHECK(s.holds == 2);
+  CHECK(s.shared == 0);
+}
+
+// Every LockPolicy the profile can derive keeps mutual exclusion, including
+// the one that never parks and the one that parks right away.
+static void policies_exclude(const LockPolicy &policy, const char *name) {
+  ProfiledSharedMutex m(name);
+  LockProfiler::get(name).set_policy(policy);
+  long counter = 0;
+  std::atomic<int> inside{0};
+  std::atomic<int> overlaps{0};
+  std::vector<std::thread> ts;
+  for (int t = 0; t < 4; t++) {
+    ts.emplace_back([&, t] {
+      for (int i = 0; i < 5000; i++) {
+        if (t == 0) {
+          m.lock_shared();
+          if (inside.load() != 0)
+            overlaps++;
+          m.unlock_shared();
+          continue;
+        }
+        m.lock();
+        if (inside.fetch_add(1) != 0)
+          overlaps++;
+        counter++;
+        inside.fetch_sub(1);
+        m.unlock();
+      }
+    });
+  }
+  for (auto &t : ts)
+    t.join();
+
+  CHECK(counter == 3 * 5000);
+  CHECK(overlaps.load() == 0);
+  CHECK(!m.is_locked());
+  Saved s = saved(name);
+  CHECK(s.acquired == 4 * 5000);
+  CHECK(s.shared == 5000);
+  CHECK(s.holds == 3 * 5000);
+}
+
+int main() {
+  LockProfiler::set_recording(true);
+  records_contention();
+  policies_exclude(LockPolicy{}, "default");
+  policies_exclude(LockPolicy{16, false, false}, "yield");
+  policies_exclude(LockPolicy{0, true, true}, "park");
+  return test_result();
+}
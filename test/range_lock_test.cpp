@@ -0,0 +1,145 @@
+// Regression tests for RangeLock.
+// g++ -std=c++17 -O2 -pthread -I.. range_lock_test.cpp -o range_lock_test
+#include "Check.h"
+#include "RangeLock.h"
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <random>
+#include <thread>
+#include <vector>
+
+using namespace utils;
+
+// Holds random ranges and compares every try_lock against a brute-force scan
+// of the held ones.
+static void matches_brute_force() {
+  struct Held {
+    uint64_t begin, end;
+    bool shared;
+    std::unique_ptr<RangeLock::Request> req;
+  };
+  RangeLock lock;
+  std::vector<Held> held;
+  std::mt19937_64 rng(7);
+  for (int i = 0; i < 20000; i++) {
+    if (!held.empty() && rng() % 3 == 0) {
+      size_t k = rng() % held.size();
+      lock.unlock(*held[k].req);
+      held.erase(held.begin() + k);
+      continue;
+    }
+    uint64_t begin = rng() % 1000;
+    uint64_t end = begin + 1 + rng() % 20;
+    bool shared = rng() % 2 == 0;
+    bool expected = true;
+    for (const Held &h : held) {
+      if (h.begin < end && begin < h.end && !(h.shared && shared))
+        expected = false;
+    }
+    auto req = std::make_unique<RangeLock::Request>();
+    bool got = shared ? lock.try_lock_shared(*req, begin, end)
+                      : lock.try_lock(*req, begin, end);
+    CHECK(got == expected);
+    if (got)
+      held.push_back({begin, end, shared, std::move(req)});
+  }
+  CHECK(lock.request_count() == held.size());
+  for (Held &h : held)
+    lock.unlock(*h.req);
+  CHECK(lock.request_count() == 0);
+}
+
+// A waiting request blocks later overlapping ones but not disjoint ones.
+static void waiting_request_is_fifo() {
+  RangeLock lock;
+  RangeLock::Request a, b, c, d;
+  lock.lock(a, 0, 10);
+  std::atomic<bool> done{false};
+  std::thread t([&] {
+    lock.lock(b, 5, 15);
+    done = true;
+    lock.unlock(b);
+  });
+  while (lock.request_count() != 2)
+    std::this_thread::yield();
+  CHECK(!lock.try_lock_shared(c, 12, 20));
+  CHECK(lock.try_lock(d, 15, 20));
+  CHECK(!done);
+  lock.unlock(a);
+  t.join();
+  CHECK(done);
+  lock.unlock(d);
+  CHECK(lock.request_count() == 0);
+}
+
+// Threads lock overlapping ranges of a small array and check that nobody
+// else writes a slot they hold.
+static void overlapping_stress() {
+  constexpr int SLOTS = 64;
+  RangeLock lock;
+  std::atomic<int> writers[SLOTS] = {};
+  std::atomic<int> readers[SLOTS] = {};
+  std::atomic<int> bad{0};
+  std::atomic<bool> done{false};
+  std::vector<std::thread> ts;
+  for (int t = 0; t < 6; t++) {
+    ts.emplace_back([&, t] {
+      std::mt19937 rng(t);
+      for (int i = 0; i < 20000; i++) {
+        int begin = rng() % SLOTS;
+        int end = begin + 1 + rng() % 8;
+        if (end > SLOTS)
+          end = SLOTS;
+        bool shared = rng() % 2 == 0;
+        RangeLock::Request req;
+        if (shared)
+          lock.lock_shared(req, begin, end);
+        else
+          lock.lock(req, begin, end);
+        for (int s = begin; s < end; s++) {
+          if (shared) {
+            readers[s]++;
+            if (writers[s] != 0)
+              bad++;
+          } else if (writers[s]++ != 0 || readers[s] != 0) {
+            bad++;
+          }
+        }
+        for (int s = begin; s < end; s++) {
+          if (shared)
+            readers[s]--;
+          else
+            writers[s]--;
+        }
+        lock.unlock(req);
+      }
+    });
+  }
+  std::thread watchdog([&] {
+    auto deadline =
+        std::chrono::steady_clock::now() + std::chrono::seconds(20);
+    while (!done && std::chrono::steady_clock::now() < deadline)
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    if (!done) {
+      std::printf("hung\n");
+      std::fflush(stdout);
+      std::_Exit(1);
+    }
+  });
+  for (auto &t : ts)
+    t.join();
+  done = true;
+  watchdog.join();
+  CHECK(bad == 0);
+  CHECK(lock.request_count() == 0);
+}
+
+int main() {
+  matches_brute_force();
+  waiting_request_is_fifo();
+  overlapping_stress();
+  return test_result();
+}
@@ -0,0 +1,109 @@
+// Regression tests for SingleThreadMode. The mode is process-wide, so every
+// test runs in a forked child.
+// g++ -std=c++17 -O2 -pthread -I.. single_thread_mode_test.cpp -o single_test
+#define SPIN_MUTEX_SINGLE_THREAD_MODE 1
+#include "Check.h"
+#include "SpinMutex.h"
+#include <csignal>
+#include <cstdio>
+#include <mutex>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+using namespace utils;
+
+// Runs f in a forked child and returns its wait status.
+template <typename F> static int in_child(F f) {
+  std::fflush(stdout);
+  pid_t pid = fork();
+  if (pid == 0) {
+    f();
+    std::fflush(stdout);
+    _exit(failures == 0 ? 0 : 1);
+  }
+  int status = 0;
+  waitpid(pid, &status, 0);
+  return status;
+}
+
+static bool exited_ok(int status) {
+  return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+// With the mode on, the enabling thread still gets exclusion semantics from
+// the plain loads and stores.
+static void locks_work_in_mode() {
+  SingleThreadMode::enable();
+  CHECK(SingleThreadMode::active());
+  SpinMutex m;
+  SharedSpinMutex s;
+  ReentrantSpinMutex r;
+  m.lock();
+  CHECK(m.is_locked());
+  CHECK(!m.try_lock());
+  m.unlock();
+  CHECK(!m.is_locked());
+  s.lock_shared();
+  s.lock_shared();
+  CHECK(s.read_locked_count() == 2);
+  CHECK(!s.try_lock());
+  s.unlock_shared();
+  s.unlock_shared();
+  CHECK(s.try_lock());
+  CHECK(!s.try_lock_shared());
+  s.unlock();
+  r.lock();
+  r.lock();
+  CHECK(r.reentrant_count() == 2);
+  r.unlock();
+  r.unlock();
+  CHECK(!r.is_locked());
+}
+
+// The first create_thread() leaves the mode before the thread runs, after
+// which the locks exclude again.
+static void create_thread_leaves_mode() {
+  constexpr int THREADS = 4;
+  constexpr int OPS = 50000;
+  SingleThreadMode::enable();
+  SpinMutex m;
+  long counter = 0;
+  m.lock();
+  counter++;
+  m.unlock();
+  std::vector<std::thread> ts;
+  for (int t = 0; t < THREADS; t++) {
+    ts.push_back(create_thread([&] {
+      for (int i = 0; i < OPS; i++) {
+        std::lock_guard<SpinMutex> guard(m);
+        counter++;
+      }
+    }));
+  }
+  CHECK(!SingleThreadMode::active());
+  for (auto &t : ts)
+    t.join();
+  CHECK(counter == 1 + THREADS * OPS);
+}
+
+// A thread started behind the mode's back must not share the locks without
+// atomics; it stops the process instead.
+static void foreign_thread_aborts() {
+  std::freopen("/dev/null", "w", stderr);
+  SingleThreadMode::enable();
+  SpinMutex m;
+  std::thread([&] {
+    m.lock();
+    m.unlock();
+  }).join();
+}
+
+int main() {
+  CHECK(exited_ok(in_child(locks_work_in_mode)));
+  CHECK(exited_ok(in_child(create_thread_leaves_mode)));
+  int status = in_child(foreign_thread_aborts);
+  CHECK(WIFSIGNALED(status) && WTERMSIG(status) == SIGABRT);
+  return test_result();
+}
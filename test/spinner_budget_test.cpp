@@ -0,0 +1,77 @@
+// Regression tests for SpinnerBudget admission in the BasicSpinMutex slow
+// paths.
+// g++ -std=c++17 -O2 -pthread -I.. spinner_budget_test.cpp -o budget_test
+#include "Check.h"
+#include "SpinMutex.h"
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace utils;
+
+using ParkMutex = BasicSpinMutex<ExclusiveMode, NonReentrant,
+                                 ExponentialBackoff, ParkWait>;
+using SharedParkMutex =
+    BasicSpinMutex<SharedMode, NonReentrant, ExponentialBackoff, ParkWait>;
+
+// Waits up to 5 seconds for SpinnerBudget::spinning() to reach n.
+static bool spinning_drops_to(uint32_t n) {
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+  while (SpinnerBudget::spinning() != n) {
+    if (std::chrono::steady_clock::now() > deadline)
+      return false;
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  return true;
+}
+
+// More waiters than the budget block on a held lock until they have all
+// parked. A parked waiter must have given its place back, so spinning()
+// drops to 0 while they sleep, and every waiter still gets the lock.
+template <typename Mutex, typename Acquire>
+static void parked_waiters_leave_budget(Acquire acquire) {
+  constexpr int WAITERS = 6;
+  SpinnerBudget::enable(2);
+  Mutex m;
+  m.lock();
+  std::atomic<int> started{0}, acquired{0};
+  std::vector<std::thread> ts;
+  for (int i = 0; i < WAITERS; i++) {
+    ts.emplace_back([&] {
+      started++;
+      acquire(m);
+      acquired++;
+    });
+  }
+  while (started.load() != WAITERS)
+    std::this_thread::yield();
+  // Long enough for the waiters to get through their spin rounds.
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  CHECK(spinning_drops_to(0));
+  CHECK(acquired.load() == 0);
+  m.unlock();
+  for (auto &t : ts)
+    t.join();
+  CHECK(acquired.load() == WAITERS);
+  CHECK(SpinnerBudget::spinning() == 0);
+  SpinnerBudget::disable();
+}
+
+int main() {
+  parked_waiters_leave_budget<ParkMutex>([](ParkMutex &m) {
+    m.lock();
+    m.unlock();
+  });
+  parked_waiters_leave_budget<SharedParkMutex>([](SharedParkMutex &m) {
+    m.lock();
+    m.unlock();
+  });
+  parked_waiters_leave_budget<SharedParkMutex>([](SharedParkMutex &m) {
+    m.lock_shared();
+    m.unlock_shared();
+  });
+  return test_result();
+}
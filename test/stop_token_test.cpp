@@ -0,0 +1,153 @@
+// Regression tests for lock(std::stop_token) and lock_shared(std::stop_token)
+// of BasicSpinMutex: a stop before the call, while parked, while spinning,
+// and a wait that ends with the lock. The lock word and the reader count
+// must be clean afterwards.
+// g++ -std=c++20 -O2 -pthread -I.. stop_token_test.cpp -o stop_token_test
+#include "Check.h"
+#include "SpinMutex.h"
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <stop_token>
+#include <thread>
+#include <type_traits>
+
+using namespace utils;
+
+using SpinShared =
+    BasicSpinMutex<SharedMode, NonReentrant, ExponentialBackoff, SpinWait>;
+using ParkShared =
+    BasicSpinMutex<SharedMode, NonReentrant, ExponentialBackoff, ParkWait>;
+using SpinExclusive =
+    BasicSpinMutex<ExclusiveMode, NonReentrant, ExponentialBackoff, SpinWait>;
+using ParkExclusive =
+    BasicSpinMutex<ExclusiveMode, NonReentrant, ExponentialBackoff, ParkWait>;
+
+template <typename Mutex>
+static constexpr bool SHARED = !std::is_same_v<Mutex, SpinExclusive> &&
+                               !std::is_same_v<Mutex, ParkExclusive>;
+
+enum class Hold { EXCLUSIVE, SHARED };
+
+template <typename Mutex> static void hold(Mutex &m, Hold h) {
+  if constexpr (SHARED<Mutex>) {
+    if (h == Hold::SHARED) {
+      m.lock_shared();
+      return;
+    }
+  }
+  m.lock();
+}
+
+template <typename Mutex> static void release(Mutex &m, Hold h) {
+  if constexpr (SHARED<Mutex>) {
+    if (h == Hold::SHARED) {
+      m.unlock_shared();
+      return;
+    }
+  }
+  m.unlock();
+}
+
+template <typename Mutex>
+static bool acquire(Mutex &m, Hold h, std::stop_token stop) {
+  if constexpr (SHARED<Mutex>) {
+    if (h == Hold::SHARED)
+      return m.lock_shared(stop);
+  }
+  return m.lock(stop);
+}
+
+template <typename Mutex> static bool clean(const Mutex &m) {
+  if constexpr (SHARED<Mutex>) {
+    if (m.read_locked_count() != 0 || m.is_write_locked())
+      return false;
+  }
+  return !m.is_locked() && !m.has_waiters();
+}
+
+// The holder runs on another thread so that the waiter blocks; the waiter is
+// the calling thread. stopAfter < 0 stops before the call, otherwise after
+// the waiter had that many milliseconds: 0 catches a ParkWait waiter still
+// spinning, 50 has it parked, and a SpinWait waiter spins throughout. With
+// releaseInstead the holder lets go instead and the waiter must get the
+// lock.
+template <typename Mutex>
+static void blocked_waiter(Hold held, Hold wanted, int stopAfter,
+                           bool releaseInstead) {
+  Mutex m;
+  std::stop_source source;
+  std::atomic<bool> holding{false}, letGo{false};
+  std::thread holder([&] {
+    hold(m, held);
+    holding = true;
+    while (!letGo)
+      std::this_thread::yield();
+    release(m, held);
+  });
+  while (!holding)
+    std::this_thread::yield();
+
+  if (stopAfter < 0)
+    source.request_stop();
+  std::thread trigger([&] {
+    if (stopAfter < 0)
+      return;
+    std::this_thread::sleep_for(std::chrono::milliseconds(stopAfter));
+    if (releaseInstead)
+      letGo = true;
+    else
+      source.request_stop();
+  });
+
+  bool got = acquire(m, wanted, source.get_token());
+  trigger.join();
+  CHECK(got == releaseInstead);
+  if (got) {
+    CHECK(m.is_locked());
+    release(m, wanted);
+  }
+  letGo = true;
+  holder.join();
+  CHECK(clean(m));
+}
+
+template <typename Mutex> static void all_cases(Hold held, Hold wanted) {
+  blocked_waiter<Mutex>(held, wanted, -1, false);
+  blocked_waiter<Mutex>(held, wanted, 0, false);
+  blocked_waiter<Mutex>(held, wanted, 50, false);
+  blocked_waiter<Mutex>(held, wanted, 50, true);
+}
+
+// A free lock is taken even with stop already requested: the token is only
+// polled once the fast path failed.
+template <typename Mutex> static void free_lock_ignores_stop() {
+  Mutex m;
+  std::stop_source source;
+  source.request_stop();
+  CHECK(m.lock(source.get_token()));
+  m.unlock();
+  if constexpr (SHARED<Mutex>) {
+    CHECK(m.lock_shared(source.get_token()));
+    m.unlock_shared();
+  }
+  CHECK(clean(m));
+}
+
+int main() {
+  // Writers blocked by a writer, readers by a writer, writers by a reader
+  // (the wait for the read count after the word was taken).
+  all_cases<SpinExclusive>(Hold::EXCLUSIVE, Hold::EXCLUSIVE);
+  all_cases<ParkExclusive>(Hold::EXCLUSIVE, Hold::EXCLUSIVE);
+  all_cases<ParkShared>(Hold::EXCLUSIVE, Hold::EXCLUSIVE);
+  all_cases<ParkShared>(Hold::EXCLUSIVE, Hold::SHARED);
+  all_cases<ParkShared>(Hold::SHARED, Hold::EXCLUSIVE);
+  all_cases<SpinShared>(Hold::EXCLUSIVE, Hold::EXCLUSIVE);
+  all_cases<SpinShared>(Hold::EXCLUSIVE, Hold::SHARED);
+  all_cases<SpinShared>(Hold::SHARED, Hold::EXCLUSIVE);
+  free_lock_ignores_stop<SpinExclusive>();
+  free_lock_ignores_stop<ParkExclusive>();
+  free_lock_ignores_stop<ParkShared>();
+  free_lock_ignores_stop<SpinShared>();
+  return test_result();
+}
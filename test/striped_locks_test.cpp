@@ -0,0 +1,130 @@
+// Regression tests for StripedLocks: the stripe index, the Stats of the try
+// paths, and the dedup and lock order of lock_all() / lock_range().
+// g++ -std=c++17 -O2 -pthread -I.. striped_locks_test.cpp -o striped_test
+#include "Check.h"
+#include "StripedLocks.h"
+#include <cstdio>
+#include <vector>
+
+using namespace utils;
+
+// Logs every lock and unlock by the mutex it went to, '+' for lock and '-'
+// for unlock, in the order they happened.
+struct LoggingMutex {
+  struct Event {
+    const LoggingMutex *mutex;
+    char op;
+  };
+  static inline std::vector<Event> log;
+
+  void lock() {
+    log.push_back({this, '+'});
+    _m.lock();
+  }
+  bool try_lock() { return _m.try_lock(); }
+  void unlock() {
+    log.push_back({this, '-'});
+    _m.unlock();
+  }
+  void lock_shared() {
+    log.push_back({this, '+'});
+    _m.lock_shared();
+  }
+  bool try_lock_shared() { return _m.try_lock_shared(); }
+  void unlock_shared() {
+    log.push_back({this, '-'});
+    _m.unlock_shared();
+  }
+
+  SharedSpinMutex _m;
+};
+
+// The index is the top log2(count) bits of the Fibonacci product, and a
+// single stripe takes every key.
+static void stripe_of_uses_top_bits() {
+  StripedLocks<SpinMutex, 16> locks;
+  StripedLocks<SpinMutex, 1> one;
+  for (uint64_t k = 0; k < 1000; k++) {
+    uint64_t h = std::hash<uint64_t>()(k) * 0x9E3779B97F4A7C15ull;
+    CHECK(locks.stripe_of(k) == (size_t)(h >> 60));
+    CHECK(one.stripe_of(k) == 0);
+  }
+}
+
+// try_lock() and try_lock_shared() count a success as an uncontended
+// acquisition and a failure not at all, as lock() would.
+static void try_lock_counts_stats() {
+  StripedLocks<SharedSpinMutex, 4, CountStats> locks;
+  auto &s = locks.stripe_for(1);
+  CHECK(s.try_lock());
+  CHECK(!s.try_lock());
+  CHECK(!s.try_lock_shared());
+  s.unlock();
+  CHECK(s.try_lock_shared());
+  s.unlock_shared();
+  CHECK(s.stats().acquired_count() == 2);
+  CHECK(s.stats().contended_count() == 0);
+}
+
+// Keys that share a stripe lock it once, and the stripes are locked in
+// ascending order and unlocked in descending order whatever order the keys
+// were given in.
+static void multi_guard_dedups_and_orders() {
+  using Locks = StripedLocks<LoggingMutex, 8>;
+  Locks locks;
+  // One key per stripe, and a second key on stripe 3.
+  int first[8];
+  bool seen[8] = {};
+  int twin = -1;
+  for (int k = 0, found = 0; found < 8 || twin < 0; k++) {
+    size_t s = locks.stripe_of(k);
+    if (!seen[s]) {
+      seen[s] = true;
+      first[s] = k;
+      found++;
+    } else if (s == 3 && twin < 0) {
+      twin = k;
+    }
+  }
+
+  auto check_log = [&](size_t stripes) {
+    const auto &log = LoggingMutex::log;
+    CHECK(log.size() == 2 * stripes);
+    for (size_t i = 0; i < log.size(); i++)
+      CHECK(log[i].op == (i < stripes ? '+' : '-'));
+    for (size_t i = 1; i < stripes; i++)
+      CHECK(log[i - 1].mutex < log[i].mutex);
+    for (size_t i = 0; i < stripes; i++)
+      CHECK(log[i].mutex == log[2 * stripes - 1 - i].mutex);
+  };
+
+  LoggingMutex::log.clear();
+  {
+    auto g = locks.lock_all(first[6], first[3], twin, first[0], first[3]);
+    CHECK(g.stripe_count() == 3);
+    CHECK(LoggingMutex::log[0].mutex == &locks.stripe_for(first[0]).mutex());
+    CHECK(LoggingMutex::log[1].mutex == &locks.stripe_for(first[3]).mutex());
+    CHECK(LoggingMutex::log[2].mutex == &locks.stripe_for(first[6]).mutex());
+  }
+  check_log(3);
+
+  LoggingMutex::log.clear();
+  {
+    std::vector<int> keys;
+    for (int s = 7; s >= 0; s--) {
+      keys.push_back(first[s]);
+      keys.push_back(first[s]);
+    }
+    keys.push_back(twin);
+    auto g = locks.shared_range(keys.begin(), keys.end());
+    CHECK(g.stripe_count() == 8);
+  }
+  check_log(8);
+}
+
+int main() {
+  stripe_of_uses_top_bits();
+  try_lock_counts_stats();
+  multi_guard_dedups_and_orders();
+  return test_result();
+}
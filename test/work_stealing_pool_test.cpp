@@ -0,0 +1,154 @@
+// Regression tests for ChaseLevDeque and WorkStealingPool.
+// g++ -std=c++17 -O2 -pthread -I.. work_stealing_pool_test.cpp -o pool_test
+#include "Check.h"
+#include "WorkStealingPool.h"
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <thread>
+#include <vector>
+
+using namespace utils;
+
+// The owner pushes and takes in bursts while several thieves steal, starting
+// from a tiny array so that it grows under them. Every item must come out
+// exactly once, through take() or steal().
+static void deque_steal_stress() {
+  constexpr int STEALERS = 4;
+  constexpr int ITEMS = 200000;
+  ChaseLevDeque<int> deque(2);
+  std::unique_ptr<std::atomic<int>[]> seen(new std::atomic<int>[ITEMS]);
+  for (int i = 0; i < ITEMS; i++)
+    seen[i].store(0, std::memory_order_relaxed);
+  std::atomic<int> taken{0};
+  std::atomic<bool> done{false};
+
+  std::vector<std::thread> thieves;
+  for (int s = 0; s < STEALERS; s++) {
+    thieves.emplace_back([&] {
+      int x;
+      while (!done.load(std::memory_order_acquire)) {
+        if (deque.steal(x)) {
+          seen[x]++;
+          taken++;
+        }
+      }
+    });
+  }
+
+  int x;
+  for (int i = 0; i < ITEMS; i++) {
+    deque.push(i);
+    // Take back about a third, so the owner and the thieves race for the
+    // last item often.
+    if (i % 3 == 0 && deque.take(x)) {
+      seen[x]++;
+      taken++;
+    }
+  }
+  while (deque.take(x)) {
+    seen[x]++;
+    taken++;
+  }
+  while (taken.load() != ITEMS && !deque.empty())
+    std::this_thread::yield();
+  done = true;
+  for (auto &t : thieves)
+    t.join();
+
+  int bad = 0;
+  for (int i = 0; i < ITEMS; i++)
+    bad += seen[i].load() != 1;
+  CHECK(bad == 0);
+  CHECK(taken.load() == ITEMS);
+  CHECK(deque.empty());
+}
+
+// Waits up to 10 seconds for count to reach expected.
+static bool reaches(const std::atomic<int> &count, int expected) {
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+  while (count.load() != expected) {
+    if (std::chrono::steady_clock::now() > deadline)
+      return false;
+    std::this_thread::yield();
+  }
+  return true;
+}
+
+// Tasks submitted from outside go through the inject queue, the ones they
+// submit in turn through the workers' deques; every one runs exactly once.
+static void submit_runs_every_task_once() {
+  constexpr int OUTER = 2000;
+  constexpr int INNER = 4;
+  constexpr int TASKS = OUTER * (1 + INNER);
+  std::unique_ptr<std::atomic<int>[]> runs(new std::atomic<int>[TASKS]);
+  for (int i = 0; i < TASKS; i++)
+    runs[i].store(0, std::memory_order_relaxed);
+  std::atomic<int> finished{0};
+  {
+    WorkStealingPool pool(4);
+    for (int o = 0; o < OUTER; o++) {
+      pool.submit([&, o] {
+        runs[o]++;
+        for (int k = 0; k < INNER; k++) {
+          pool.submit([&, o, k] {
+            runs[OUTER + o * INNER + k]++;
+            finished++;
+          });
+        }
+        finished++;
+      });
+    }
+    CHECK(reaches(finished, TASKS));
+  }
+  int bad = 0;
+  for (int i = 0; i < TASKS; i++)
+    bad += runs[i].load() != 1;
+  CHECK(bad == 0);
+}
+
+// parallel_for visits every index once, from outside threads and from inside
+// a task, where the calling worker takes part in the loop.
+static void parallel_for_covers_range() {
+  constexpr size_t N = 100000;
+  WorkStealingPool pool(3);
+  std::unique_ptr<std::atomic<int>[]> hits(new std::atomic<int>[N]);
+  for (size_t i = 0; i < N; i++)
+    hits[i].store(0, std::memory_order_relaxed);
+  pool.parallel_for(0, N, [&](size_t i) { hits[i]++; }, 16);
+  pool.parallel_for(0, N, [&](size_t i) { hits[i]++; });
+
+  std::atomic<int> nested{0};
+  pool.submit([&] {
+    CHECK(pool.current_worker() >= 0);
+    pool.parallel_for(0, N, [&](size_t i) { hits[i]++; }, 64);
+    nested++;
+  });
+  CHECK(reaches(nested, 1));
+
+  int bad = 0;
+  for (size_t i = 0; i < N; i++)
+    bad += hits[i].load() != 3;
+  CHECK(bad == 0);
+  CHECK(pool.current_worker() == -1);
+}
+
+// Workers that have gone to sleep on the futex must wake for new work.
+static void parked_workers_wake() {
+  WorkStealingPool pool(2);
+  std::atomic<int> ran{0};
+  for (int round = 0; round < 20; round++) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    pool.submit([&] { ran++; });
+    CHECK(reaches(ran, round + 1));
+  }
+}
+
+int main() {
+  deque_steal_stress();
+  submit_runs_every_task_once();
+  parallel_for_covers_range();
+  parked_workers_wake();
+  return test_result();
+}